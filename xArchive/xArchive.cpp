@@ -1,53 +1,76 @@
 #include "xArchive.h"
+#include "xArchiveChecksum.h"
+#include "xArchivePrefetch.h"
+#include "xArchiveTrace.h"
 #include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
 
 #pragma pack( 1 )
 
 namespace xArchive
 {
-    XARCHIVE_API Archive* Archive::Open( const std::string& filename, ArchiveOpenFlags flags )
+    XARCHIVE_API Archive* Archive::Open( const std::string& filename, ArchiveOpenFlags flags, ArchiveAllocatorType allocatorType )
     {
         ArchiveFileOpenMode mode = ArchiveFileOpenMode::eReadOnly;
 
         if( !(static_cast<int>(flags) & static_cast<int>(ArchiveOpenFlags::eReadonly)) )
             mode = ArchiveFileOpenMode::eReadWrite;
 
-        return new Archive( filename, mode );
+        return new Archive( std::make_unique<CompressedArchiveFile>( filename, mode ), allocatorType );
     }
 
-    XARCHIVE_API Archive* Archive::Create( const std::string& filename, uint32_t allocationSize )
+    XARCHIVE_API Archive* Archive::Create( const std::string& filename, uint32_t allocationSize, ArchiveAllocatorType allocatorType )
     {
         UniqueArchiveFile file = std::make_unique<CompressedArchiveFile>( filename, ArchiveFileOpenMode::eWriteOnly );
         UniqueArchiveHeader header = std::make_unique<ArchiveHeader>();
 
         header->Magic = ArchiveMagic::eArchive;
+        header->Version = ArchiveVersion;
         header->AllocationSize = allocationSize;
-        memset( header->AllocationTable, 0, sizeof( header->AllocationTable ) );
-
-        header->Root.Magic = ArchiveMagic::eDirectory;
-        header->Root.Parent = 0;
-        header->Root.Next = 0;
-        header->Root.NumEntries = 0;
-        memset( header->Root.Entries, 0, sizeof( header->Root.Entries ) );
+        header->AllocationPageCount = 0;
+        header->AllocationMap = 0;
+        header->SlotPageCount = 0;
+        header->ChunkPageCount = 0;
+        header->SlotMap = 0;
+        header->ChunkMap = 0;
+
+        header->Reserved = 0;
+        header->Root = ArchiveDirectory( 0 );
+        header->Root.Checksum = header->Root.ComputeChecksum();
+        header->Checksum = Crc32cExcludingField( header.get(), OffsetOf( ArchiveHeader, Root ), OffsetOf( ArchiveHeader, Checksum ) );
 
         file->Write( header.get(), sizeof( ArchiveHeader ) );
         file->Close();
 
-        return new Archive( filename, ArchiveFileOpenMode::eReadWrite );
+        return new Archive( std::make_unique<CompressedArchiveFile>( filename, ArchiveFileOpenMode::eReadWrite ), allocatorType );
     }
 
-    Archive::Archive( const std::string& filename, ArchiveFileOpenMode mode )
-        : m_pArchiveFile( nullptr )
-        , m_Mode( mode )
+    Archive::Archive( UniqueArchiveFile archiveFile, ArchiveAllocatorType allocatorType )
+        : m_pArchiveFile( std::move( archiveFile ) )
+        , m_Mode( m_pArchiveFile->Mode() )
+        , m_DirectoryPool()
         , m_pAllocator( nullptr )
         , m_pHeader( nullptr )
         , m_pCurrentDirectory( nullptr )
         , m_CurrentDirectoryPath( "/" )
-        , m_pDirectoryFree( std::bind( &Archive::_FreeNonRoot, this, std::placeholders::_1 ) )
+        , m_CurrentDirectoryOffset( 0 )
+        , m_InlineThreshold( 256 )
+        , m_ChunkStore( ArchiveChunkPage::Capacity )
+        , m_Deduplication( false )
+        , m_VerifyChecksums( false )
+        , m_AccessTraceEnabled( false )
+        , m_WorkloadTraceEnabled( false )
+        , m_WorkloadDepth( 0 )
+        , m_BatchDepth( 0 )
+        , m_AllocationTableDirty( false )
+        , m_DirtyDirectories()
+        , m_SolidCacheOffset( 0 )
+        , m_SolidCache()
+        , m_pPrefetcher( nullptr )
     {
-        m_pArchiveFile = std::make_unique<CompressedArchiveFile>( filename, mode );
+        const std::string filename = m_pArchiveFile->Name();
 
         m_pHeader = std::make_unique<ArchiveHeader>();
         m_pArchiveFile->Read( m_pHeader.get(), sizeof( ArchiveHeader ) );
@@ -55,70 +78,244 @@ namespace xArchive
         if( m_pHeader->Magic != ArchiveMagic::eArchive )
             throw std::runtime_error( (filename + " is not archive").c_str() );
 
-        if( m_pHeader->Root.Magic != ArchiveMagic::eDirectory )
+        if( m_pHeader->Version != ArchiveVersion )
+            throw std::runtime_error( (filename + " has unsupported archive version").c_str() );
+
+        if( m_pHeader->Root.Magic != ArchiveMagic::eDirectory ||
+            m_pHeader->Checksum != Crc32cExcludingField( m_pHeader.get(), OffsetOf( ArchiveHeader, Root ), OffsetOf( ArchiveHeader, Checksum ) ) ||
+            m_pHeader->Root.Checksum != m_pHeader->Root.ComputeChecksum() )
             throw std::runtime_error( (filename + " is corrupted").c_str() );
 
-        m_pCurrentDirectory = SharedArchiveDirectory( &m_pHeader->Root, m_pDirectoryFree );
+        m_pCurrentDirectory = m_DirectoryPool.Allocate( m_pHeader->Root );
         m_CurrentDirectoryOffset = OffsetOf( ArchiveHeader, Root );
 
         AllocatorCallbacks allocatorCallbacks;
         allocatorCallbacks.pfnFlushAllocationTable = &Archive::_AllocationTableUpdated;
         allocatorCallbacks.pfnReallocateEntry = &Archive::_ReallocationHandler;
 
-        m_pAllocator = std::make_unique<ArchiveAllocator>(
-            this,
-            m_pHeader->AllocationTable,
-            static_cast<uint32_t>(ExtentOf( ElementOf( ArchiveHeader, AllocationTable ) )),
-            m_pHeader->AllocationSize,
-            allocatorCallbacks );
+        switch( allocatorType )
+        {
+        case ArchiveAllocatorType::eBitmap:
+            m_pAllocator = std::make_unique<ArchiveAllocator>(
+                this,
+                m_pHeader->AllocationSize,
+                ArchiveAllocationPage::BlockCount,
+                ArchiveAllocationPage::PageSize,
+                ArchiveSlotPage::Capacity,
+                allocatorCallbacks );
+            break;
+
+        case ArchiveAllocatorType::eExtent:
+            m_pAllocator = std::make_unique<ArchiveExtentAllocator>(
+                this,
+                m_pHeader->AllocationSize,
+                ArchiveAllocationPage::BlockCount,
+                ArchiveAllocationPage::PageSize,
+                ArchiveSlotPage::Capacity,
+                allocatorCallbacks );
+            break;
+
+        default:
+            throw std::invalid_argument( "Unsupported allocator type" );
+        }
 
         m_pAllocator->SetAllocationBase( sizeof( ArchiveHeader ) );
+
+        _LoadAllocationTable();
+    }
+
+    Archive::~Archive()
+    {
+        if( m_BatchDepth == 0 )
+            return;
+
+        try
+        {
+            // Unfinished batches are committed when the archive is closed
+            m_BatchDepth = 1;
+            CommitBatch();
+        }
+        catch( ... )
+        {
+        }
+    }
+
+    Archive* Archive::Snapshot()
+    {
+        ArchiveTraceScope traceScope( "Archive::Snapshot", "api" );
+
+        // Data of entries removed within the batch may already be discarded
+        if( m_BatchDepth > 0 )
+            throw std::runtime_error( "Cannot take snapshot during batch" );
+
+        UniqueArchive snapshot( new Archive( m_pArchiveFile->Snapshot(), ArchiveAllocatorType::eBitmap ) );
+        snapshot->SetCurrentDirectory( m_CurrentDirectoryPath );
+
+        return snapshot.release();
+    }
+
+    void Archive::BeginBatch()
+    {
+        _CheckWrite();
+
+        m_BatchDepth++;
+    }
+
+    void Archive::CommitBatch()
+    {
+        ArchiveTraceScope traceScope( "Archive::CommitBatch", "api" );
+
+        if( m_BatchDepth == 0 )
+            throw std::runtime_error( "No batch in progress" );
+
+        if( --m_BatchDepth > 0 )
+            return;
+
+        // Blocks are written in the order of their offsets
+        for( const auto& dirtyDirectory : m_DirtyDirectories )
+            _StoreDirectory( dirtyDirectory.first, *dirtyDirectory.second );
+
+        m_DirtyDirectories.clear();
+
+        if( m_AllocationTableDirty )
+        {
+            _FlushAllocationTable();
+            m_AllocationTableDirty = false;
+        }
+
+        m_pArchiveFile->Flush();
     }
 
     Archive::ArchiveEntry::ArchiveEntry()
-        : Name()
-        , Offset( 0 )
-        , Size( 0 )
+        : NameOffset( 0 )
+        , NameLength( 0 )
+        , Slot( 0 )
         , Type( ArchiveEntryType( -1 ) )
+        , Flags( 0 )
+        , SizeHigh( 0 )
+        , Sector( 0 )
+        , SizeLow( 0 )
     {
-        memset( Name, 0, sizeof( Name ) );
     }
 
-    Archive::ArchiveEntry::ArchiveEntry( const std::string& name, uint32_t offset, uint32_t size, ArchiveEntryType type )
-        : Name()
-        , Offset( offset )
-        , Size( size )
+    Archive::ArchiveEntry::ArchiveEntry( uint32_t sector, uint64_t size, ArchiveEntryType type )
+        : NameOffset( 0 )
+        , NameLength( 0 )
+        , Slot( 0 )
         , Type( type )
+        , Flags( 0 )
+        , SizeHigh( 0 )
+        , Sector( sector )
+        , SizeLow( 0 )
+    {
+        SetSize( size );
+    }
+
+    bool Archive::ArchiveEntry::IsInline() const
+    {
+        return (Flags & static_cast<uint8_t>(ArchiveEntryFlags::eInline)) != 0;
+    }
+
+    bool Archive::ArchiveEntry::IsSlot() const
+    {
+        return (Flags & static_cast<uint8_t>(ArchiveEntryFlags::eSlot)) != 0;
+    }
+
+    bool Archive::ArchiveEntry::IsChunked() const
+    {
+        return (Flags & static_cast<uint8_t>(ArchiveEntryFlags::eChunked)) != 0;
+    }
+
+    bool Archive::ArchiveEntry::IsSolid() const
+    {
+        return (Flags & static_cast<uint8_t>(ArchiveEntryFlags::eSolid)) != 0;
+    }
+
+    bool Archive::ArchiveEntry::HasChecksum() const
+    {
+        return (Flags & static_cast<uint8_t>(ArchiveEntryFlags::eChecksum)) != 0;
+    }
+
+    uint64_t Archive::ArchiveEntry::GetSize() const
+    {
+        return (static_cast<uint64_t>(SizeHigh) << 32) | SizeLow;
+    }
+
+    void Archive::ArchiveEntry::SetSize( uint64_t size )
+    {
+        if( size > MaxSize )
+            throw std::invalid_argument( "Entry size exceeds maximum entry size" );
+
+        SizeHigh = static_cast<uint16_t>(size >> 32);
+        SizeLow = static_cast<uint32_t>(size);
+    }
+
+    uint32_t Archive::ArchiveEntry::GetHeapSize() const
+    {
+        return NameLength + GetPayloadSize();
+    }
+
+    uint32_t Archive::ArchiveEntry::GetPayloadSize() const
+    {
+        if( IsInline() )
+            return SizeLow;
+
+        return HasChecksum() ? sizeof( uint32_t ) : 0;
+    }
+
+    Archive::ArchiveDirectoryEntry::ArchiveDirectoryEntry( uint32_t sector )
+        : ArchiveEntry( sector, sizeof( ArchiveDirectory ), ArchiveEntryType::eDirectory )
     {
-        StringToArray( name, Name );
     }
 
-    Archive::ArchiveDirectoryEntry::ArchiveDirectoryEntry( const std::string& name, uint32_t offset )
-        : ArchiveEntry( name, offset, sizeof( ArchiveDirectory ), ArchiveEntryType::eDirectory )
+    Archive::ArchiveFileEntry::ArchiveFileEntry( uint32_t sector, uint64_t size )
+        : ArchiveEntry( sector, size, ArchiveEntryType::eFile )
     {
     }
 
-    Archive::ArchiveFileEntry::ArchiveFileEntry( const std::string& name, uint32_t offset, uint32_t size )
-        : ArchiveEntry( name, offset, size, ArchiveEntryType::eFile )
+    Archive::ArchiveInlineFileEntry::ArchiveInlineFileEntry( uint32_t size )
+        : ArchiveEntry( 0, size, ArchiveEntryType::eFile )
     {
+        Flags = static_cast<uint8_t>(ArchiveEntryFlags::eInline);
     }
 
-    Archive::ArchiveDirectory::ArchiveDirectory( uint32_t parent )
+    Archive::ArchiveDirectory::ArchiveDirectory( uint64_t parent )
         : Magic( ArchiveMagic::eDirectory )
+        , NumEntries( 0 )
+        , HeapOffset( DataSize )
+        , Checksum( 0 )
+        , Reserved( 0 )
         , Parent( parent )
         , Next( 0 )
-        , NumEntries( 0 )
-        , Entries()
+        , Data()
     {
-        memset( Entries, 0, sizeof( Entries ) );
+        memset( Data, 0, sizeof( Data ) );
     }
 
-    void Archive::ArchiveDirectory::AddEntry( const ArchiveEntry& entry )
+    void Archive::ArchiveDirectory::AddEntry( const ArchiveEntry& entry, std::string_view name, const void* inlineData, uint32_t checksum )
     {
-        if( NumEntries == ExtentOf( Entries ) )
+        const uint32_t payloadSize = entry.GetPayloadSize();
+
+        if( !HasFreeSpace( name.length() + payloadSize ) )
             throw std::runtime_error( "Out of memory" );
 
-        Entries[NumEntries] = entry;
+        HeapOffset -= static_cast<uint16_t>(name.length() + payloadSize);
+        memcpy( Data + HeapOffset, name.data(), name.length() );
+
+        if( entry.IsInline() )
+        {
+            // Empty inline files have no data
+            if( payloadSize > 0 )
+                memcpy( Data + HeapOffset + name.length(), inlineData, payloadSize );
+        }
+
+        else if( entry.HasChecksum() )
+            memcpy( Data + HeapOffset + name.length(), &checksum, sizeof( uint32_t ) );
+
+        ArchiveEntry& newEntry = reinterpret_cast<ArchiveEntry*>(Data)[NumEntries];
+        newEntry = entry;
+        newEntry.NameOffset = HeapOffset;
+        newEntry.NameLength = static_cast<uint8_t>(name.length());
 
         NumEntries++;
     }
@@ -131,7 +328,22 @@ namespace xArchive
         if( n >= NumEntries )
             throw std::out_of_range( "Entry index out of range" );
 
-        memmove( &Entries[n], &Entries[n + 1], SizeOfElement( Entries ) * (NumEntries - n) );
+        ArchiveEntry* entries = reinterpret_cast<ArchiveEntry*>(Data);
+
+        const uint16_t heapOffset = entries[n].NameOffset;
+        const uint16_t heapSize = static_cast<uint16_t>(entries[n].GetHeapSize());
+
+        // Close the gap in the heap, names and data stored below the removed entry move up
+        memmove( Data + HeapOffset + heapSize, Data + HeapOffset, heapOffset - HeapOffset );
+        HeapOffset += heapSize;
+
+        for( uint32_t i = 0; i < NumEntries; ++i )
+        {
+            if( entries[i].NameOffset < heapOffset )
+                entries[i].NameOffset += heapSize;
+        }
+
+        memmove( &entries[n], &entries[n + 1], sizeof( ArchiveEntry ) * (NumEntries - n - 1) );
 
         NumEntries--;
     }
@@ -141,7 +353,7 @@ namespace xArchive
         if( n >= NumEntries )
             throw std::out_of_range( "Entry index out of range" );
 
-        return Entries[n];
+        return reinterpret_cast<ArchiveEntry*>(Data)[n];
     }
 
     const Archive::ArchiveEntry& Archive::ArchiveDirectory::GetEntry( uint32_t n ) const
@@ -149,104 +361,133 @@ namespace xArchive
         if( n >= NumEntries )
             throw std::out_of_range( "Entry index out of range" );
 
-        return Entries[n];
+        return reinterpret_cast<const ArchiveEntry*>(Data)[n];
     }
 
-    bool Archive::ArchiveDirectory::HasFreeSpace() const
+    std::string_view Archive::ArchiveDirectory::GetEntryName( uint32_t n ) const
     {
-        return NumEntries < ExtentOf( Entries );
+        const ArchiveEntry& entry = GetEntry( n );
+
+        return std::string_view( Data + entry.NameOffset, entry.NameLength );
     }
 
-    void Archive::CreateDirectory( const std::string& path )
+    const void* Archive::ArchiveDirectory::GetInlineData( const ArchiveEntry& entry ) const
     {
-        _CheckWrite();
+        return Data + entry.NameOffset + entry.NameLength;
+    }
+
+    uint32_t Archive::ArchiveDirectory::GetEntryChecksum( const ArchiveEntry& entry ) const
+    {
+        uint32_t checksum;
+        memcpy( &checksum, Data + entry.NameOffset + entry.NameLength, sizeof( uint32_t ) );
+
+        return checksum;
+    }
+
+    void Archive::ArchiveDirectory::SetEntryChecksum( const ArchiveEntry& entry, uint32_t checksum )
+    {
+        memcpy( Data + entry.NameOffset + entry.NameLength, &checksum, sizeof( uint32_t ) );
+    }
+
+    bool Archive::ArchiveDirectory::HasFreeSpace( size_t heapSize ) const
+    {
+        return sizeof( ArchiveEntry ) * (NumEntries + 1) + heapSize <= HeapOffset;
+    }
+
+    uint32_t Archive::ArchiveDirectory::ComputeChecksum() const
+    {
+        return Crc32cExcludingField( this, sizeof( ArchiveDirectory ), OffsetOf( ArchiveDirectory, Checksum ) );
+    }
 
-        auto components = StringSplit( path, "/" );
+    void Archive::CreateDirectory( std::string_view path )
+    {
+        ArchiveTraceScope traceScope( "Archive::CreateDirectory", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eCreateDirectory, path );
 
-        const std::string entryName = components.back();
+        _CheckWrite();
 
-        // Remove last component from the path
-        components.pop_back();
+        std::string_view parentPath;
+        std::string_view entryName;
+        PathSplitLast( path, parentPath, entryName );
 
-        std::string path_ = "";
-        if( !StringStartsWith( path, "/" ) )
-            path_ = "./";
+        if( entryName.empty() || entryName == "." || entryName == ".." )
+            throw std::invalid_argument( "Invalid path" );
 
-        path_.append( StringJoin( components, "/" ) );
+        if( entryName.length() > MaxNameLength )
+            throw std::invalid_argument( (std::string( entryName ) + " name is too long").c_str() );
 
         // Get directory entry of the parent
-        auto parentDirectoryOffset = _GetDirectoryOffset( path_ );
-        auto parentDirectory = _ReadDirectory( parentDirectoryOffset );
+        const uint64_t parentDirectoryOffset = _GetDirectoryOffset( parentPath );
 
-        while( !parentDirectory->HasFreeSpace() )
-        {
-            if( parentDirectory->Next != 0 )
-            {
-                parentDirectoryOffset = parentDirectory->Next;
-                parentDirectory = _ReadDirectory( parentDirectory->Next );
-                continue;
-            }
+        uint64_t directoryAllocationOffset = m_pAllocator->Allocate( sizeof( ArchiveDirectory ) );
 
-            uint32_t allocationOffset = m_pAllocator->Allocate( sizeof( ArchiveDirectory ) );
+        const ArchiveDirectory directory( parentDirectoryOffset );
 
-            parentDirectory->Next = allocationOffset;
+        _AddEntry( parentDirectoryOffset, ArchiveDirectoryEntry( m_pAllocator->GetSector( directoryAllocationOffset ) ), entryName );
+        _WriteDirectory( directoryAllocationOffset, directory );
+        _Flush();
+    }
 
-            m_pArchiveFile->Seek( parentDirectoryOffset );
-            m_pArchiveFile->Write( parentDirectory.get(), sizeof( ArchiveDirectory ) );
+    void Archive::RemoveDirectory( std::string_view path )
+    {
+        ArchiveTraceScope traceScope( "Archive::RemoveDirectory", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eRemoveDirectory, path );
 
-            auto parentDirectoryExt = SharedArchiveDirectory(
-                new ArchiveDirectory( parentDirectory->Parent ), m_pDirectoryFree );
+        _CheckWrite();
 
-            parentDirectoryOffset = allocationOffset;
-            parentDirectory = parentDirectoryExt;
-        }
+        std::string_view parentPath;
+        std::string_view entryName;
+        PathSplitLast( path, parentPath, entryName );
 
-        uint32_t directoryAllocationOffset = m_pAllocator->Allocate( sizeof( ArchiveDirectory ) );
+        if( entryName.empty() || entryName == "." || entryName == ".." )
+            throw std::invalid_argument( "Invalid path" );
 
-        auto directory = SharedArchiveDirectory(
-            new ArchiveDirectory( parentDirectoryOffset ), m_pDirectoryFree );
+        std::string directoryPath = m_CurrentDirectoryPath;
+        PathNormalize( path, directoryPath );
 
-        parentDirectory->AddEntry( ArchiveDirectoryEntry( entryName, directoryAllocationOffset ) );
+        if( m_CurrentDirectoryPath.compare( 0, directoryPath.length(), directoryPath ) == 0 )
+            throw std::invalid_argument( "Cannot remove current directory" );
 
-        m_pArchiveFile->Seek( parentDirectoryOffset );
-        m_pArchiveFile->Write( parentDirectory.get(), sizeof( ArchiveDirectory ) );
-        m_pArchiveFile->Seek( directoryAllocationOffset );
-        m_pArchiveFile->Write( directory.get(), sizeof( ArchiveDirectory ) );
-        m_pArchiveFile->Flush();
+        const uint64_t parentDirectoryOffset = _GetDirectoryOffset( parentPath );
 
-        if( parentDirectoryOffset == OffsetOf( ArchiveHeader, Root ) )
-        {
-            // Header has been invalidated
-            std::memcpy( &m_pHeader->Root, &*parentDirectory, sizeof( ArchiveDirectory ) );
-        }
+        ArchiveDirectory directory;
+        uint64_t blockOffset = 0;
+        uint64_t previousBlockOffset = 0;
 
-        if( parentDirectoryOffset == m_CurrentDirectoryOffset )
-        {
-            // Current directory has been invalidated
-            m_pCurrentDirectory = parentDirectory;
-        }
-    }
+        const int32_t index = _FindEntryBlock( parentDirectoryOffset, entryName, directory, blockOffset, previousBlockOffset );
 
-    void Archive::RemoveDirectory( const std::string& path )
-    {
-        (path);
+        if( index < 0 )
+            throw std::invalid_argument( (std::string( entryName ) + " not found").c_str() );
+
+        const ArchiveEntry& entry = directory.GetEntry( index );
+
+        if( entry.Type != ArchiveEntryType::eDirectory )
+            throw std::invalid_argument( (std::string( entryName ) + " is not a directory").c_str() );
+
+        ArchiveBatch batch( this );
+
+        // Whole subtree is freed at once
+        ArchiveAllocationList allocations;
+        _CollectAllocations( _GetEntryOffset( entry ), allocations );
+
+        _RemoveEntry( directory, blockOffset, previousBlockOffset, index, allocations );
+        _ReleaseAllocations( allocations );
+
+        batch.Commit();
     }
 
-    void Archive::SetCurrentDirectory( const std::string& path )
+    void Archive::SetCurrentDirectory( std::string_view path )
     {
+        ArchiveTraceScope traceScope( "Archive::SetCurrentDirectory", "api" );
+
         _CheckRead();
 
-        const uint32_t dirOffset = _GetDirectoryOffset( path );
+        const uint64_t dirOffset = _GetDirectoryOffset( path );
 
         m_CurrentDirectoryOffset = dirOffset;
         m_pCurrentDirectory = _ReadDirectory( dirOffset );
 
-        if( StringStartsWith( path, "/" ) )
-            m_CurrentDirectoryPath = path;
-        else
-            m_CurrentDirectoryPath.append( path + "/" );
-
-        _NormalizeCurrentDirectoryPath();
+        PathNormalize( path, m_CurrentDirectoryPath );
     }
 
     std::string Archive::GetCurrentDirectory() const
@@ -254,8 +495,11 @@ namespace xArchive
         return m_CurrentDirectoryPath;
     }
 
-    std::vector<std::string> Archive::ListDirectory( const std::string& path )
+    std::vector<std::string> Archive::ListDirectory( std::string_view path )
     {
+        ArchiveTraceScope traceScope( "Archive::ListDirectory", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eListDirectory, path );
+
         _CheckRead();
 
         std::vector<std::string> entries;
@@ -264,7 +508,7 @@ namespace xArchive
         while( currentDirectory )
         {
             for( uint32_t i = 0; i < currentDirectory->NumEntries; ++i )
-                entries.push_back( currentDirectory->Entries[i].Name );
+                entries.emplace_back( currentDirectory->GetEntryName( i ) );
 
             currentDirectory = _ReadDirectory( currentDirectory->Next );
         }
@@ -272,300 +516,1810 @@ namespace xArchive
         return entries;
     }
 
-    void Archive::CreateFile( const std::string& path, const void* data, size_t size )
+    ArchiveWalker Archive::Walk( std::string_view path, bool recursive, ArchiveWalkOrder order )
     {
-        _CheckWrite();
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eWalkDirectory, path );
+        workloadScope.Size = (recursive ? static_cast<uint64_t>(ArchiveWorkloadFlags::eRecursive) : 0) |
+            (order == ArchiveWalkOrder::eBreadthFirst ? static_cast<uint64_t>(ArchiveWorkloadFlags::eBreadthFirst) : 0);
 
-        auto components = StringSplit( path, "/" );
+        _CheckRead();
 
-        const std::string entryName = components.back();
+        const uint64_t dirOffset = _GetDirectoryOffset( path );
 
-        // Remove last component from the path
-        components.pop_back();
+        std::string dirPath = m_CurrentDirectoryPath;
+        PathNormalize( path, dirPath );
 
-        std::string path_ = "";
-        if( !StringStartsWith( path, "/" ) )
-            path_ = "./";
+        return ArchiveWalker( this, dirOffset, std::move( dirPath ), recursive, order );
+    }
 
-        path_.append( StringJoin( components, "/" ) );
+    void Archive::CreateFile( std::string_view path, const void* data, size_t size )
+    {
+        ArchiveTraceScope traceScope( "Archive::CreateFile", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eCreateFile, path );
+        workloadScope.Size = size;
 
-        // Get directory entry of the parent
-        auto parentDirectoryOffset = _GetDirectoryOffset( path_ );
-        auto parentDirectory = _ReadDirectory( parentDirectoryOffset );
+        _CheckWrite();
 
-        while( !parentDirectory->HasFreeSpace() )
-        {
-            if( parentDirectory->Next != 0 )
-            {
-                parentDirectoryOffset = parentDirectory->Next;
-                parentDirectory = _ReadDirectory( parentDirectory->Next );
-                continue;
-            }
+        std::string_view parentPath;
+        std::string_view entryName;
+        PathSplitLast( path, parentPath, entryName );
 
-            uint32_t allocationOffset = m_pAllocator->Allocate( sizeof( ArchiveDirectory ) );
+        if( entryName.empty() || entryName == "." || entryName == ".." )
+            throw std::invalid_argument( "Invalid path" );
 
-            parentDirectory->Next = allocationOffset;
+        if( entryName.length() > MaxNameLength )
+            throw std::invalid_argument( (std::string( entryName ) + " name is too long").c_str() );
 
-            m_pArchiveFile->Seek( parentDirectoryOffset );
-            m_pArchiveFile->Write( parentDirectory.get(), sizeof( ArchiveDirectory ) );
+        if( size > ArchiveEntry::MaxSize )
+            throw std::invalid_argument( (std::string( entryName ) + " is too large").c_str() );
 
-            auto parentDirectoryExt = SharedArchiveDirectory(
-                new ArchiveDirectory( parentDirectory->Parent ), m_pDirectoryFree );
+        // Get directory entry of the parent
+        const uint64_t parentDirectoryOffset = _GetDirectoryOffset( parentPath );
 
-            parentDirectoryOffset = allocationOffset;
-            parentDirectory = parentDirectoryExt;
+        // Tiny files are kept in the directory heap and don't need separate allocation
+        if( size <= m_InlineThreshold )
+        {
+            _AddEntry( parentDirectoryOffset, ArchiveInlineFileEntry( static_cast<uint32_t>(size) ), entryName, data );
+            _Flush();
+            return;
         }
 
-        uint32_t fileAllocationOffset = m_pAllocator->Allocate( static_cast<uint32_t>(size) );
+        ArchiveFileEntry fileEntry( 0, size );
+        fileEntry.Flags |= static_cast<uint8_t>(ArchiveEntryFlags::eChecksum);
 
-        parentDirectory->AddEntry( ArchiveFileEntry( entryName, fileAllocationOffset, static_cast<uint32_t>(size) ) );
-
-        m_pArchiveFile->Seek( parentDirectoryOffset );
-        m_pArchiveFile->Write( parentDirectory.get(), sizeof( ArchiveDirectory ) );
-        m_pArchiveFile->Seek( fileAllocationOffset, std::fstream::beg );
-        m_pArchiveFile->Write( data, size );
-        m_pArchiveFile->Flush();
+        uint64_t fileAllocationOffset = 0;
 
-        if( parentDirectoryOffset == OffsetOf( ArchiveHeader, Root ) )
+        if( _UseChunkedStorage( size ) )
         {
-            // Header has been invalidated
-            memcpy( &m_pHeader->Root, &*parentDirectory, sizeof( ArchiveDirectory ) );
+            fileEntry.Flags |= static_cast<uint8_t>(ArchiveEntryFlags::eChunked);
+            fileAllocationOffset = _WriteChunkedData( data, size );
         }
-
-        if( parentDirectoryOffset == m_CurrentDirectoryOffset )
+        else
         {
-            // Current directory has been invalidated
-            m_pCurrentDirectory = parentDirectory;
+            fileAllocationOffset = m_pAllocator->Allocate( size );
+
+            m_pArchiveFile->Seek( fileAllocationOffset, std::fstream::beg );
+            m_pArchiveFile->Write( data, size );
         }
-    }
 
-    void Archive::UpdateFile( const std::string& path, const void* data, size_t size )
-    {
-        (path, data, size);
-    }
+        _SetEntryOffset( fileEntry, fileAllocationOffset );
 
-    void Archive::RemoveFile( const std::string& path )
-    {
-        (path);
+        _AddEntry( parentDirectoryOffset, fileEntry, entryName, nullptr, Crc32c( data, size ) );
+        _Flush();
     }
 
-    size_t Archive::GetFileSize( const std::string& path )
+    void Archive::ImportTree( const std::vector<ArchiveImportEntry>& manifest, const ArchiveImportOptions& options )
     {
-        _CheckRead();
-        auto entry = _GetEntry( path );
+        ArchiveTraceScope traceScope( "Archive::ImportTree", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eImportTree, "." );
 
-        return static_cast<size_t>(entry.Size);
-    }
+        _CheckWrite();
 
-    void Archive::ReadFile( const std::string& path, void* buffer, size_t bufferSize )
-    {
-        _CheckRead();
-        auto entry = _GetEntry( path );
+        std::vector<ImportDirectory> directories;
+        std::vector<ImportItem> items;
+        std::unordered_map<std::string, int32_t> directoryIndices;
 
-        // Check if provided buffer is sufficient
-        if( bufferSize < entry.Size )
+        for( const ArchiveImportEntry& source : manifest )
         {
-            std::stringstream stringBuilder;
-            stringBuilder
-                << "Insufficient buffer. The buffer is to small "
-                "(" << bufferSize << "B) to store file " << path.c_str() <<
-                "(" << entry.Size << "B) in it.";
-
-            throw std::invalid_argument( stringBuilder.str() );
-        }
+            std::string normalizedPath = m_CurrentDirectoryPath;
+            PathNormalize( source.Path, normalizedPath );
 
-        m_pArchiveFile->Seek( entry.Offset );
-        m_pArchiveFile->Read( buffer, entry.Size );
+            if( normalizedPath.length() <= 1 )
+                throw std::invalid_argument( "Invalid path" );
 
-        // Fill remaining bytes in buffer with 0
-        memset( reinterpret_cast<char*>(buffer) + entry.Size, 0, bufferSize - entry.Size );
-    }
+            const size_t separator = normalizedPath.find_last_of( '/', normalizedPath.length() - 2 );
 
-    std::vector<char> Archive::ReadFile( const std::string& path )
-    {
-        // Get file byte size
-        const size_t fileSize = GetFileSize( path );
+            ImportItem item = {};
+            item.Source = &source;
+            item.Name = normalizedPath.substr( separator + 1, normalizedPath.length() - separator - 2 );
+            item.ParentPath = normalizedPath.substr( 0, separator + 1 );
+            item.Directory = -1;
+            item.CreatedDirectory = -1;
 
-        std::vector<char> fileBuffer;
-        fileBuffer.resize( fileSize );
+            if( item.Name.length() > MaxNameLength )
+                throw std::invalid_argument( (item.Name + " name is too long").c_str() );
 
-        // Read bytes
-        ReadFile( path, fileBuffer.data(), fileSize );
+            if( source.Type == ArchiveEntryType::eDirectory )
+            {
+                item.CreatedDirectory = static_cast<int32_t>(directories.size());
 
-        return fileBuffer;
-    }
+                if( !directoryIndices.emplace( normalizedPath, item.CreatedDirectory ).second )
+                    throw std::invalid_argument( (item.Name + " is listed more than once").c_str() );
+                directories.push_back( ImportDirectory{ normalizedPath, {}, 0 } );
+            }
 
-    Archive::ArchiveEntry Archive::_GetEntry( const std::string& path )
-    {
-        auto components = StringSplit( path, "/" );
+            else if( source.Size > ArchiveEntry::MaxSize )
+                throw std::invalid_argument( (item.Name + " is too large").c_str() );
 
-        const std::string entryName = components.back();
+            else
+                workloadScope.Size += source.Size;
 
-        // Remove last component from the path
-        components.pop_back();
+            items.push_back( std::move( item ) );
+        }
 
-        std::string path_ = "";
-        if( !StringStartsWith( path, "/" ) )
-            path_ = "./";
+        // Contents of each directory follow each other, directories come first
+        std::stable_sort( items.begin(), items.end(),
+            []( const ImportItem& a, const ImportItem& b )
+            {
+                if( a.Source->Type != b.Source->Type )
+                    return a.Source->Type == ArchiveEntryType::eDirectory;
 
-        path_.append( StringJoin( components, "/" ) );
+                return a.ParentPath < b.ParentPath;
+            } );
 
-        // Get directory entry of the parent
-        SharedArchiveDirectory parentDirectory = _GetDirectory( path_ );
+        std::vector<char> buffer;
 
-        for( uint32_t i = 0; i < parentDirectory->NumEntries; ++i )
+        auto readSource = [&]( const ArchiveImportEntry& source )
         {
-            if( parentDirectory->Entries[i].Name == entryName )
-            {
-                return parentDirectory->Entries[i];
-            }
-        }
-
-        throw std::invalid_argument( (entryName + " not found").c_str() );
-    }
+            _ReadImportSource( source, buffer );
+        };
 
-    uint32_t Archive::_GetDirectoryOffset( const std::string& path )
-    {
-        std::string path_ = path;
+        const uint32_t allocationSize = m_pAllocator->GetAllocationSize();
+        const uint64_t directoryStride = static_cast<uint64_t>(m_pAllocator->GetSectorCount( sizeof( ArchiveDirectory ) )) * allocationSize;
 
-        uint32_t currentDirectoryOffset = m_CurrentDirectoryOffset;
-        SharedArchiveDirectory currentDirectory = m_pCurrentDirectory;
+        // Size everything first. Entries are added to the in-memory blocks of new directories
+        // and their offsets are filled in once the whole layout is known.
+        uint64_t metadataSize = 0;
+        uint64_t dataSize = 0;
 
-        if( StringStartsWith( path, "/" ) )
-        {
-            currentDirectoryOffset = OffsetOf( ArchiveHeader, Root );
-            currentDirectory.reset( &m_pHeader->Root, m_pDirectoryFree );
-            path_ = path.substr( 1, std::string::npos );
-        }
+        // Items are sorted by parent, each existing parent is looked up once
+        std::string_view existingParentPath;
+        uint64_t existingParentOffset = 0;
 
-        for( auto component : StringSplit( path_, "/" ) )
+        for( ImportItem& item : items )
         {
-            bool directoryFound = false;
+            const ArchiveImportEntry& source = *item.Source;
+            const void* inlineData = nullptr;
 
-            if( component == "." )
-                continue;
+            if( source.Type == ArchiveEntryType::eDirectory )
+            {
+                item.Entry = ArchiveDirectoryEntry( 0 );
+            }
 
-            if( component == ".." )
+            else if( source.Size <= m_InlineThreshold )
             {
-                if( currentDirectory->Parent == 0 )
-                    throw std::invalid_argument( "Invalid path" );
+                readSource( source );
 
-                currentDirectoryOffset = currentDirectory->Parent;
-                currentDirectory = _ReadDirectory( currentDirectory->Parent );
-                directoryFound = true;
+                item.Entry = ArchiveInlineFileEntry( static_cast<uint32_t>(source.Size) );
+                inlineData = buffer.data();
             }
 
-            while( !directoryFound )
+            else
             {
-                for( uint32_t i = 0; i < currentDirectory->NumEntries; ++i )
-                {
-                    ArchiveEntry* entry = currentDirectory->Entries + i;
+                item.Entry = ArchiveFileEntry( 0, source.Size );
+                item.Entry.Flags |= static_cast<uint8_t>(ArchiveEntryFlags::eChecksum);
 
-                    if( entry->Name == component )
-                    {
-                        if( entry->Type != ArchiveEntryType::eDirectory )
-                            throw std::invalid_argument( (component + " is not a directory").c_str() );
+                // Solid groups are compressed once all files have been sized
+                if( options.Solid && source.Size < options.SolidGroupSize )
+                    item.Entry.Flags |= static_cast<uint8_t>(ArchiveEntryFlags::eSolid);
 
-                        currentDirectoryOffset = entry->Offset;
-                        currentDirectory = _ReadDirectory( entry->Offset );
-                        directoryFound = true;
-                    }
-                }
+                else if( _UseChunkedStorage( source.Size ) )
+                    item.Entry.Flags |= static_cast<uint8_t>(ArchiveEntryFlags::eChunked);
 
-                if( !directoryFound )
+                // Whole-sector files are laid out contiguously after the directory blocks
+                else if( m_pAllocator->GetSlotSize( source.Size ) == 0 )
                 {
-                    if( currentDirectory->Next == 0 )
-                        throw std::invalid_argument( (component + " not found").c_str() );
-
-                    currentDirectory = _ReadDirectory( currentDirectory->Next );
+                    item.Offset = dataSize;
+                    dataSize += static_cast<uint64_t>(m_pAllocator->GetSectorCount( source.Size )) * allocationSize;
                 }
             }
-        }
 
-        return currentDirectoryOffset;
-    }
+            auto parent = directoryIndices.find( item.ParentPath );
 
-    Archive::SharedArchiveDirectory Archive::_GetDirectory( const std::string& path )
-    {
-        return _ReadDirectory( _GetDirectoryOffset( path ) );
-    }
+            // Missing parents must fail the import before anything is allocated
+            if( parent == directoryIndices.end() )
+            {
+                if( existingParentPath.empty() || existingParentPath != item.ParentPath )
+                {
+                    existingParentOffset = _GetDirectoryOffset( item.ParentPath );
+                    existingParentPath = item.ParentPath;
+                }
 
-    Archive::SharedArchiveDirectory Archive::_ReadDirectory( uint32_t offset )
-    {
-        if( offset == 0 )
-            return nullptr;
-        
-        std::vector<uint32_t> buffer;
-        buffer.resize( sizeof( ArchiveDirectory ) / SizeOfElement( buffer ) );
+                item.ParentOffset = existingParentOffset;
 
-        m_pArchiveFile->Seek( offset );
-        m_pArchiveFile->Read( buffer.data(), sizeof( ArchiveDirectory ) );
+                if( inlineData )
+                    item.InlineData.assign( buffer.begin(), buffer.end() );
 
-        if( static_cast<ArchiveMagic>(buffer[0]) != ArchiveMagic::eDirectory )
-            throw std::runtime_error( "Archive file corrupted" );
+                continue;
+            }
 
-        return SharedArchiveDirectory(
-            new ArchiveDirectory( *reinterpret_cast<ArchiveDirectory*>(buffer.data()) ), m_pDirectoryFree );
-    }
+            ImportDirectory& directory = directories[parent->second];
+            const size_t heapSize = item.Name.length() + item.Entry.GetPayloadSize();
 
-    void Archive::_NormalizeCurrentDirectoryPath()
-    {
-        std::vector<std::string> normalizedPathComponents;
+            if( directory.Blocks.empty() || !directory.Blocks.back().HasFreeSpace( heapSize ) )
+            {
+                directory.Blocks.emplace_back();
+                metadataSize += directoryStride;
+            }
 
-        for( auto component : StringSplit( m_CurrentDirectoryPath.substr( 1, std::string::npos ), "/" ) )
-        {
-            if( component == "." )
-                continue;
+            item.Directory = parent->second;
+            item.Block = static_cast<uint32_t>(directory.Blocks.size() - 1);
+            item.Index = directory.Blocks.back().NumEntries;
 
-            if( component == ".." )
-                normalizedPathComponents.pop_back();
+            directory.Blocks.back().AddEntry( item.Entry, item.Name, inlineData );
+        }
 
-            else
-                normalizedPathComponents.push_back( component );
+        for( ImportDirectory& directory : directories )
+        {
+            if( directory.Blocks.empty() )
+            {
+                directory.Blocks.emplace_back();
+                metadataSize += directoryStride;
+            }
         }
 
-        const std::string sep = "/";
+        ArchiveBatch batch( this );
 
-        if( normalizedPathComponents.size() == 0 )
-            m_CurrentDirectoryPath = sep;
-        else
-            m_CurrentDirectoryPath = sep + StringJoin( normalizedPathComponents, sep ) + sep;
-    }
+        // Directory blocks and whole-sector files share single allocation
+        const uint64_t layoutSize = std::max<uint64_t>( metadataSize + dataSize, allocationSize );
+        const uint64_t layoutOffset = (metadataSize + dataSize > 0)
+            ? m_pAllocator->Allocate( layoutSize )
+            : 0;
 
-    void Archive::_CheckRead() const
-    {
-        if( m_Mode == ArchiveFileOpenMode::eWriteOnly )
-            throw std::runtime_error( "Archive not opened in read mode" );
-    }
+        std::vector<ArchiveSolidItem> solidItems;
+        std::vector<ImportItem*> solidImportItems;
 
-    void Archive::_CheckWrite() const
-    {
-        if( m_Mode == ArchiveFileOpenMode::eReadOnly )
-            throw std::runtime_error( "Archive not opened in write mode" );
-    }
+        try
+        {
+            uint64_t blockOffset = layoutOffset;
 
-    void Archive::_FreeNonRoot( ArchiveDirectory* dirPtr )
-    {
-        if( dirPtr == &m_pHeader->Root )
-            return;
+            for( ImportDirectory& directory : directories )
+            {
+                directory.Offset = blockOffset;
+                blockOffset += directory.Blocks.size() * directoryStride;
+            }
 
-        delete dirPtr;
-    }
+            const uint64_t dataOffset = layoutOffset + metadataSize;
 
-    void Archive::_AllocationTableUpdated()
-    {
-        m_pArchiveFile->Seek( 0 );
-        m_pArchiveFile->Write( m_pHeader.get(), sizeof( ArchiveHeader ) );
-    }
+            for( ImportItem& item : items )
+            {
+                if( item.CreatedDirectory >= 0 )
+                {
+                    item.Offset = directories[item.CreatedDirectory].Offset;
+                }
 
-    void Archive::_ReallocationHandler( uint32_t oldOffset, uint32_t newOffset, uint32_t size )
-    {
-        std::vector<char> dataBuffer( size );
+                else if( !item.Entry.IsInline() && !item.Entry.IsChunked() && !item.Entry.IsSolid() && m_pAllocator->GetSlotSize( item.Source->Size ) == 0 )
+                {
+                    item.Offset += dataOffset;
+
+                    // Files are written in the order of their placement
+                    readSource( *item.Source );
+                    item.Checksum = Crc32c( buffer.data(), buffer.size() );
+
+                    m_pArchiveFile->Seek( item.Offset );
+                    m_pArchiveFile->Write( buffer.data(), buffer.size() );
+                }
+            }
+
+            // Small files are packed into shared sectors
+            for( ImportItem& item : items )
+            {
+                if( item.Source->Type != ArchiveEntryType::eFile || item.Entry.IsInline() || item.Entry.IsSolid() )
+                    continue;
+
+                if( item.Entry.IsChunked() )
+                {
+                    readSource( *item.Source );
+                    item.Checksum = Crc32c( buffer.data(), buffer.size() );
+                    item.Offset = _WriteChunkedData( buffer.data(), buffer.size() );
+                }
+
+                else if( m_pAllocator->GetSlotSize( item.Source->Size ) != 0 )
+                {
+                    readSource( *item.Source );
+                    item.Checksum = Crc32c( buffer.data(), buffer.size() );
+                    item.Offset = m_pAllocator->Allocate( buffer.size() );
+
+                    m_pArchiveFile->Seek( item.Offset );
+                    m_pArchiveFile->Write( buffer.data(), buffer.size() );
+                }
+            }
+
+            // Remaining files are compressed together in solid groups
+            for( ImportItem& item : items )
+            {
+                if( !item.Entry.IsSolid() )
+                    continue;
+
+                solidItems.push_back( ArchiveSolidItem{ item.Source, item.Name, 0, 0, 0 } );
+                solidImportItems.push_back( &item );
+            }
+
+            if( !solidItems.empty() )
+            {
+                _WriteSolidGroups( solidItems, options.SolidGroupSize );
+
+                for( size_t i = 0; i < solidItems.size(); ++i )
+                {
+                    solidImportItems[i]->Offset = solidItems[i].Offset;
+                    solidImportItems[i]->Checksum = solidItems[i].Checksum;
+                    solidImportItems[i]->Entry.Slot = solidItems[i].Member;
+                }
+            }
+
+            for( ImportItem& item : items )
+            {
+                if( item.Entry.IsInline() )
+                    continue;
+
+                _SetEntryOffset( item.Entry, item.Offset );
+
+                if( item.Directory >= 0 )
+                {
+                    ArchiveDirectory& block = directories[item.Directory].Blocks[item.Block];
+                    block.GetEntry( item.Index ).Slot = item.Entry.Slot;
+                    _SetEntryOffset( block.GetEntry( item.Index ), item.Offset );
+
+                    if( item.Entry.HasChecksum() )
+                        block.SetEntryChecksum( block.GetEntry( item.Index ), item.Checksum );
+                }
+            }
+        }
+        catch( ... )
+        {
+            // Nothing references the written data yet, all of it is given back
+            ArchiveAllocationList allocations;
+
+            if( layoutOffset != 0 )
+                allocations.emplace_back( layoutOffset, layoutSize );
+
+            for( ImportItem& item : items )
+            {
+                if( item.Source->Type != ArchiveEntryType::eFile || item.Entry.IsInline() || item.Entry.IsSolid() || item.Offset == 0 )
+                    continue;
+
+                if( item.Entry.IsChunked() || m_pAllocator->GetSlotSize( item.Source->Size ) != 0 )
+                {
+                    _SetEntryOffset( item.Entry, item.Offset );
+                    _CollectEntryAllocations( item.Entry, allocations );
+                }
+            }
+
+            // Each member drops its reference, the last one frees the group
+            for( size_t i = 0; i < solidItems.size(); ++i )
+            {
+                if( solidItems[i].Offset == 0 )
+                    continue;
+
+                ArchiveEntry entry = solidImportItems[i]->Entry;
+                entry.Slot = solidItems[i].Member;
+                _SetEntryOffset( entry, solidItems[i].Offset );
+                _CollectEntryAllocations( entry, allocations );
+            }
+
+            _ReleaseAllocations( allocations );
+            throw;
+        }
+
+        // Link the blocks of new directories
+        for( ImportItem& item : items )
+        {
+            if( item.CreatedDirectory < 0 )
+                continue;
+
+            ImportDirectory& directory = directories[item.CreatedDirectory];
+
+            auto parent = directoryIndices.find( item.ParentPath );
+
+            const uint64_t parentOffset = (parent != directoryIndices.end())
+                ? directories[parent->second].Offset
+                : item.ParentOffset;
+
+            for( size_t i = 0; i < directory.Blocks.size(); ++i )
+            {
+                ArchiveDirectory& block = directory.Blocks[i];
+                block.Parent = parentOffset;
+                block.Next = (i + 1 < directory.Blocks.size()) ? directory.Offset + (i + 1) * directoryStride : 0;
+
+                _WriteDirectory( directory.Offset + i * directoryStride, block );
+            }
+        }
+
+        // Entries of existing directories are appended to them
+        for( ImportItem& item : items )
+        {
+            if( item.Directory >= 0 )
+                continue;
+
+            const void* inlineData = item.InlineData.empty() ? nullptr : item.InlineData.data();
+
+            _AddEntry( item.ParentOffset, item.Entry, item.Name, inlineData, item.Checksum );
+        }
+
+        batch.Commit();
+    }
+
+    void Archive::_ReadImportSource( const ArchiveImportEntry& source, std::vector<char>& buffer, uint64_t maxSize )
+    {
+        // Only the beginning of the file is read when maxSize is smaller than the file
+        const bool partial = maxSize < source.Size;
+
+        buffer.resize( static_cast<size_t>(std::min( source.Size, maxSize )) );
+
+        if( buffer.empty() )
+            return;
+
+        if( source.Data != nullptr )
+        {
+            memcpy( buffer.data(), source.Data, buffer.size() );
+            return;
+        }
+
+        std::ifstream file( source.SourceFilename, std::ios::in | std::ios::binary );
+        file.read( buffer.data(), buffer.size() );
+
+        if( !file || (!partial && file.peek() != std::ifstream::traits_type::eof()) )
+            throw std::runtime_error( (source.SourceFilename + " cannot be read or its size has changed").c_str() );
+    }
+
+    void Archive::UpdateFile( std::string_view path, const void* data, size_t size )
+    {
+        ArchiveTraceScope traceScope( "Archive::UpdateFile", "api" );
+
+        (void)path;
+        (void)data;
+        (void)size;
+    }
+
+    void Archive::RemoveFile( std::string_view path )
+    {
+        ArchiveTraceScope traceScope( "Archive::RemoveFile", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eRemoveFile, path );
+
+        _CheckWrite();
+
+        std::string_view parentPath;
+        std::string_view entryName;
+        PathSplitLast( path, parentPath, entryName );
+
+        if( entryName.empty() || entryName == "." || entryName == ".." )
+            throw std::invalid_argument( "Invalid path" );
+
+        const uint64_t parentDirectoryOffset = _GetDirectoryOffset( parentPath );
+
+        ArchiveDirectory directory;
+        uint64_t blockOffset = 0;
+        uint64_t previousBlockOffset = 0;
+
+        const int32_t index = _FindEntryBlock( parentDirectoryOffset, entryName, directory, blockOffset, previousBlockOffset );
+
+        if( index < 0 )
+            throw std::invalid_argument( (std::string( entryName ) + " not found").c_str() );
+
+        const ArchiveEntry& entry = directory.GetEntry( index );
+
+        if( entry.Type != ArchiveEntryType::eFile )
+            throw std::invalid_argument( (std::string( entryName ) + " is not a file").c_str() );
+
+        ArchiveBatch batch( this );
+
+        ArchiveAllocationList allocations;
+        _CollectEntryAllocations( entry, allocations );
+
+        _RemoveEntry( directory, blockOffset, previousBlockOffset, index, allocations );
+        _ReleaseAllocations( allocations );
+
+        batch.Commit();
+    }
+
+    size_t Archive::GetFileSize( std::string_view path )
+    {
+        ArchiveTraceScope traceScope( "Archive::GetFileSize", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eGetFileSize, path );
+
+        _CheckRead();
+
+        ArchiveDirectory directory;
+        const ArchiveEntry& entry = _GetEntry( path, directory );
+
+        workloadScope.Size = entry.GetSize();
+
+        return static_cast<size_t>(entry.GetSize());
+    }
+
+    void Archive::SetInlineThreshold( size_t threshold )
+    {
+        if( threshold > MaxInlineSize )
+            throw std::invalid_argument( "Inline threshold exceeds maximum inline file size" );
+
+        m_InlineThreshold = threshold;
+    }
+
+    size_t Archive::GetInlineThreshold() const
+    {
+        return m_InlineThreshold;
+    }
+
+    void Archive::SetDeduplication( bool enable )
+    {
+        m_Deduplication = enable;
+    }
+
+    bool Archive::GetDeduplication() const
+    {
+        return m_Deduplication;
+    }
+
+    void Archive::BeginAccessTrace()
+    {
+        m_AccessTrace.clear();
+        m_AccessTraceStart = std::chrono::steady_clock::now();
+        m_AccessTraceEnabled = true;
+    }
+
+    std::vector<ArchiveAccessRecord> Archive::EndAccessTrace()
+    {
+        m_AccessTraceEnabled = false;
+
+        std::vector<ArchiveAccessRecord> trace;
+        trace.swap( m_AccessTrace );
+
+        return trace;
+    }
+
+    XARCHIVE_API void Archive::SaveAccessTrace( const std::string& filename, const std::vector<ArchiveAccessRecord>& trace )
+    {
+        std::ofstream file( filename, std::ios::out | std::ios::trunc );
+
+        if( !file )
+            throw std::runtime_error( (std::string( filename ) + " cannot be opened").c_str() );
+
+        // One record per line, time in microseconds followed by the path
+        for( const ArchiveAccessRecord& record : trace )
+            file << record.Time.count() << '\t' << record.Path << '\n';
+    }
+
+    XARCHIVE_API std::vector<ArchiveAccessRecord> Archive::LoadAccessTrace( const std::string& filename )
+    {
+        std::ifstream file( filename, std::ios::in );
+
+        if( !file )
+            throw std::runtime_error( (std::string( filename ) + " cannot be opened").c_str() );
+
+        std::vector<ArchiveAccessRecord> trace;
+        std::string line;
+
+        while( std::getline( file, line ) )
+        {
+            const size_t separator = line.find( '\t' );
+
+            if( separator == std::string::npos )
+                continue;
+
+            ArchiveAccessRecord record;
+            record.Time = std::chrono::microseconds( std::stoll( line.substr( 0, separator ) ) );
+            record.Path = line.substr( separator + 1 );
+
+            trace.push_back( std::move( record ) );
+        }
+
+        return trace;
+    }
+
+    XARCHIVE_API ArchiveStats Archive::GetStats()
+    {
+        return ArchiveCounters::Get();
+    }
+
+    XARCHIVE_API void Archive::ResetStats()
+    {
+        ArchiveCounters::Reset();
+    }
+
+    XARCHIVE_API void Archive::EnableTracing( bool enable )
+    {
+        ArchiveTracing::Enable( enable );
+    }
+
+    XARCHIVE_API void Archive::SaveTrace( const std::string& filename )
+    {
+        ArchiveTracing::Save( filename );
+    }
+
+    XARCHIVE_API void Archive::ClearTrace()
+    {
+        ArchiveTracing::Clear();
+    }
+
+    void Archive::SetVerifyChecksums( bool enable )
+    {
+        m_VerifyChecksums = enable;
+    }
+
+    bool Archive::GetVerifyChecksums() const
+    {
+        return m_VerifyChecksums;
+    }
+
+    double Archive::GetFragmentation() const
+    {
+        return m_pAllocator->GetFragmentation();
+    }
+
+    ArchiveCompactResult Archive::Compact( const ArchiveCompactOptions& options )
+    {
+        ArchiveTraceScope traceScope( "Archive::Compact", "api" );
+
+        _CheckWrite();
+
+        std::vector<CompactItem> items;
+        _BuildCompactPlan( OffsetOf( ArchiveHeader, Root ), items );
+
+        return _CompactItems( items, options );
+    }
+
+    ArchiveCompactResult Archive::Relayout( const std::vector<ArchiveAccessRecord>& trace, const ArchiveCompactOptions& options )
+    {
+        ArchiveTraceScope traceScope( "Archive::Relayout", "api" );
+
+        _CheckWrite();
+
+        std::vector<CompactItem> items;
+        _BuildCompactPlan( OffsetOf( ArchiveHeader, Root ), items );
+
+        // Entry offset -> position of the first access in the trace
+        std::unordered_map<uint64_t, size_t> accessRanks;
+
+        std::vector<const ArchiveAccessRecord*> records;
+        records.reserve( trace.size() );
+
+        for( const ArchiveAccessRecord& record : trace )
+            records.push_back( &record );
+
+        std::stable_sort( records.begin(), records.end(),
+            []( const ArchiveAccessRecord* a, const ArchiveAccessRecord* b ) { return a->Time < b->Time; } );
+
+        for( const ArchiveAccessRecord* record : records )
+        {
+            ArchiveDirectory directory;
+            const ArchiveEntry* entry = nullptr;
+
+            // Entries removed since the trace was recorded are skipped
+            try
+            {
+                entry = &_GetEntry( record->Path, directory );
+            }
+            catch( const std::invalid_argument& )
+            {
+                continue;
+            }
+
+            if( entry->Type == ArchiveEntryType::eFile && !entry->IsInline() && !entry->IsSlot() && !entry->IsSolid() )
+                accessRanks.emplace( _GetEntryOffset( *entry ), accessRanks.size() );
+        }
+
+        auto getRank = [&]( const CompactItem& item )
+        {
+            if( item.Type == ArchiveEntryType::eDirectory )
+                return size_t( 0 );
+
+            auto rank = accessRanks.find( item.Offset );
+
+            // Entries which haven't been accessed follow in the traversal order
+            return (rank != accessRanks.end()) ? rank->second + 1 : accessRanks.size() + 1;
+        };
+
+        // Directory blocks first, then entries in order of the first access
+        std::stable_sort( items.begin(), items.end(),
+            [&]( const CompactItem& a, const CompactItem& b ) { return getRank( a ) < getRank( b ); } );
+
+        return _CompactItems( items, options );
+    }
+
+    ArchiveCompactResult Archive::_CompactItems( std::vector<CompactItem>& items, const ArchiveCompactOptions& options )
+    {
+        const auto startTime = std::chrono::steady_clock::now();
+
+        ArchiveCompactResult result = {};
+        result.Complete = true;
+
+        // First sector -> index of the item stored there
+        std::map<uint32_t, uint32_t> itemSectors;
+
+        for( uint32_t i = 0; i < items.size(); ++i )
+            itemSectors.emplace( m_pAllocator->GetSector( items[i].Offset ), i );
+
+        // Allocated sectors not owned by any item (allocation table pages, shared sectors) can't be moved
+        auto findPinnedSector = [&]( uint32_t sector, uint32_t sectorCount ) -> int64_t
+        {
+            const uint32_t endSector = sector + sectorCount;
+
+            while( sector < endSector )
+            {
+                if( !m_pAllocator->IsSectorAllocated( sector ) )
+                {
+                    sector++;
+                    continue;
+                }
+
+                auto owner = itemSectors.upper_bound( sector );
+
+                if( owner != itemSectors.begin() )
+                {
+                    --owner;
+
+                    const uint32_t ownerEnd = owner->first + m_pAllocator->GetSectorCount( items[owner->second].Size );
+
+                    if( sector < ownerEnd )
+                    {
+                        sector = ownerEnd;
+                        continue;
+                    }
+                }
+
+                return sector;
+            }
+
+            return -1;
+        };
+
+        auto budgetExhausted = [&]()
+        {
+            if( options.ByteBudget != 0 && result.BytesMoved >= options.ByteBudget )
+                return true;
+
+            if( options.TimeBudget.count() != 0 && std::chrono::steady_clock::now() - startTime >= options.TimeBudget )
+                return true;
+
+            return false;
+        };
+
+        auto moveItem = [&]( uint32_t index, uint64_t newOffset )
+        {
+            itemSectors.erase( m_pAllocator->GetSector( items[index].Offset ) );
+
+            _MoveCompactItem( items, index, newOffset );
+
+            itemSectors.emplace( m_pAllocator->GetSector( newOffset ), index );
+
+            result.BytesMoved += items[index].Size;
+            result.EntriesMoved++;
+        };
+
+        ArchiveBatch batch( this );
+
+        // Items are laid out one after another from the beginning of the archive
+        uint32_t cursor = 0;
+        uint32_t i = 0;
+
+        while( i < items.size() )
+        {
+            const uint32_t sectorCount = m_pAllocator->GetSectorCount( items[i].Size );
+
+            m_pAllocator->ExpandTable( static_cast<uint64_t>(cursor) + sectorCount );
+
+            const int64_t pinnedSector = findPinnedSector( cursor, sectorCount );
+
+            if( pinnedSector >= 0 )
+            {
+                cursor = static_cast<uint32_t>(pinnedSector) + 1;
+                continue;
+            }
+
+            if( m_pAllocator->GetSector( items[i].Offset ) == cursor )
+            {
+                cursor += sectorCount;
+                i++;
+                continue;
+            }
+
+            if( budgetExhausted() )
+            {
+                result.Complete = false;
+                break;
+            }
+
+            // Items which come later in the plan are moved out of the way
+            auto occupant = itemSectors.upper_bound( cursor );
+
+            if( occupant != itemSectors.begin() )
+                --occupant;
+
+            while( occupant != itemSectors.end() && occupant->first < cursor + sectorCount )
+            {
+                const uint32_t occupantIndex = occupant->second;
+                const uint64_t occupantOffset = items[occupantIndex].Offset;
+                const uint64_t occupantSize = items[occupantIndex].Size;
+
+                ++occupant;
+
+                if( occupantIndex == i ||
+                    m_pAllocator->GetSector( occupantOffset ) + m_pAllocator->GetSectorCount( occupantSize ) <= cursor )
+                    continue;
+
+                const uint64_t newOffset = m_pAllocator->AllocateAfter(
+                    m_pAllocator->GetSectorOffset( cursor + sectorCount ), occupantSize );
+
+                moveItem( occupantIndex, newOffset );
+                m_pAllocator->Free( occupantOffset, occupantSize );
+
+                occupant = itemSectors.upper_bound( m_pAllocator->GetSector( occupantOffset ) );
+            }
+
+            // Allocation table pages added while moving the items may have taken the space
+            if( findPinnedSector( cursor, sectorCount ) >= 0 )
+                continue;
+
+            const uint64_t oldOffset = items[i].Offset;
+            const uint64_t newOffset = m_pAllocator->GetSectorOffset( cursor );
+
+            // The old and new location may overlap, the data is read before it is written
+            m_pAllocator->Free( oldOffset, items[i].Size );
+            m_pAllocator->AllocateAt( newOffset, items[i].Size );
+
+            moveItem( i, newOffset );
+
+            cursor += sectorCount;
+            i++;
+        }
+
+        batch.Commit();
+
+        _TruncateTail();
+        m_pArchiveFile->Flush();
+
+        return result;
+    }
+
+    void Archive::ReadFile( std::string_view path, void* buffer, size_t bufferSize )
+    {
+        ArchiveTraceScope traceScope( "Archive::ReadFile", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eReadFile, path );
+
+        _CheckRead();
+
+        ArchiveDirectory directory;
+        const ArchiveEntry& entry = _GetEntry( path, directory );
+
+        const uint64_t entrySize = entry.GetSize();
+        workloadScope.Size = entrySize;
+
+        // Check if provided buffer is sufficient
+        if( bufferSize < entrySize )
+        {
+            std::stringstream stringBuilder;
+            stringBuilder
+                << "Insufficient buffer. The buffer is to small "
+                "(" << bufferSize << "B) to store file " << path <<
+                "(" << entrySize << "B) in it.";
+
+            throw std::invalid_argument( stringBuilder.str() );
+        }
+
+        _ReadEntryData( directory, entry, buffer );
+
+        // Fill remaining bytes in buffer with 0
+        memset( reinterpret_cast<char*>(buffer) + entrySize, 0, bufferSize - static_cast<size_t>(entrySize) );
+    }
+
+    std::vector<char> Archive::ReadFile( std::string_view path )
+    {
+        ArchiveTraceScope traceScope( "Archive::ReadFile", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::eReadFile, path );
+
+        _CheckRead();
+
+        ArchiveDirectory directory;
+        const ArchiveEntry& entry = _GetEntry( path, directory );
+
+        std::vector<char> fileBuffer;
+        fileBuffer.resize( static_cast<size_t>(entry.GetSize()) );
+        workloadScope.Size = fileBuffer.size();
+
+        // Read bytes
+        _ReadEntryData( directory, entry, fileBuffer.data() );
+
+        return fileBuffer;
+    }
+
+    const Archive::ArchiveEntry& Archive::_GetEntry( std::string_view path, ArchiveDirectory& parentDirectory )
+    {
+        std::string_view parentPath;
+        std::string_view entryName;
+        PathSplitLast( path, parentPath, entryName );
+
+        // Get directory entry of the parent
+        _GetDirectoryOffset( parentPath, parentDirectory );
+
+        const ArchiveEntry* entry = _FindEntry( parentDirectory, entryName );
+
+        if( !entry )
+            throw std::invalid_argument( (std::string( entryName ) + " not found").c_str() );
+
+        return *entry;
+    }
+
+    const Archive::ArchiveEntry* Archive::_FindEntry( ArchiveDirectory& directory, std::string_view name )
+    {
+        ArchiveCounters::Add( ArchiveCounter::eDirectoryLookups, 1 );
+
+        // Directory is used as a scratch buffer for the following blocks of the chain
+        while( true )
+        {
+            for( uint32_t i = 0; i < directory.NumEntries; ++i )
+            {
+                if( directory.GetEntryName( i ) == name )
+                    return &directory.GetEntry( i );
+            }
+
+            if( directory.Next == 0 )
+                return nullptr;
+
+            _ReadDirectory( directory.Next, directory );
+        }
+    }
+
+    uint64_t Archive::_GetDirectoryOffset( std::string_view path )
+    {
+        ArchiveDirectory directory;
+        return _GetDirectoryOffset( path, directory );
+    }
+
+    uint64_t Archive::_GetDirectoryOffset( std::string_view path, ArchiveDirectory& currentDirectory )
+    {
+        ArchiveTraceScope traceScope( "Archive::ResolvePath", "path" );
+
+        uint64_t currentDirectoryOffset = m_CurrentDirectoryOffset;
+        currentDirectory = *m_pCurrentDirectory;
+
+        if( PathIsAbsolute( path ) )
+        {
+            currentDirectoryOffset = OffsetOf( ArchiveHeader, Root );
+            currentDirectory = m_pHeader->Root;
+        }
+
+        for( std::string_view component : PathComponents( path ) )
+        {
+            if( component == "." )
+                continue;
+
+            if( component == ".." )
+            {
+                if( currentDirectory.Parent == 0 )
+                    throw std::invalid_argument( "Invalid path" );
+
+                currentDirectoryOffset = currentDirectory.Parent;
+                _ReadDirectory( currentDirectory.Parent, currentDirectory );
+                continue;
+            }
+
+            const ArchiveEntry* entry = _FindEntry( currentDirectory, component );
+
+            if( !entry )
+                throw std::invalid_argument( (std::string( component ) + " not found").c_str() );
+
+            if( entry->Type != ArchiveEntryType::eDirectory )
+                throw std::invalid_argument( (std::string( component ) + " is not a directory").c_str() );
+
+            currentDirectoryOffset = _GetEntryOffset( *entry );
+            _ReadDirectory( currentDirectoryOffset, currentDirectory );
+        }
+
+        return currentDirectoryOffset;
+    }
+
+    uint64_t Archive::_GetEntryOffset( const ArchiveEntry& entry ) const
+    {
+        uint64_t offset = m_pAllocator->GetSectorOffset( entry.Sector );
+
+        if( entry.IsSlot() )
+            offset += static_cast<uint64_t>(entry.Slot) * m_pAllocator->GetSlotSize( entry.GetSize() );
+
+        return offset;
+    }
+
+    void Archive::_SetEntryOffset( ArchiveEntry& entry, uint64_t offset ) const
+    {
+        // Solid groups always take whole sectors, Slot holds index of the member
+        if( entry.IsSolid() )
+        {
+            entry.Sector = m_pAllocator->GetSector( offset );
+            return;
+        }
+
+        // Chunk lists always take whole sectors
+        const uint32_t slotSize = entry.IsChunked() ? 0 : m_pAllocator->GetSlotSize( entry.GetSize() );
+
+        entry.Sector = m_pAllocator->GetSector( offset );
+        entry.Slot = 0;
+        entry.Flags &= ~static_cast<uint8_t>(ArchiveEntryFlags::eSlot);
+
+        if( slotSize != 0 )
+        {
+            entry.Slot = static_cast<uint8_t>((offset - m_pAllocator->GetSectorOffset( entry.Sector )) / slotSize);
+            entry.Flags |= static_cast<uint8_t>(ArchiveEntryFlags::eSlot);
+        }
+    }
+
+    Archive::PooledArchiveDirectory Archive::_GetDirectory( std::string_view path )
+    {
+        return _ReadDirectory( _GetDirectoryOffset( path ) );
+    }
+
+    Archive::PooledArchiveDirectory Archive::_ReadDirectory( uint64_t offset )
+    {
+        if( offset == 0 )
+            return nullptr;
+
+        auto directory = m_DirectoryPool.Allocate();
+        _ReadDirectory( offset, *directory );
+
+        return directory;
+    }
+
+    void Archive::_ReadDirectory( uint64_t offset, ArchiveDirectory& directory )
+    {
+        ArchiveCounters::Add( ArchiveCounter::eDirectoryBlocksRead, 1 );
+
+        if( m_BatchDepth > 0 )
+        {
+            // The block may not have been written yet
+            auto dirtyDirectory = m_DirtyDirectories.find( offset );
+
+            if( dirtyDirectory != m_DirtyDirectories.end() )
+            {
+                directory = *dirtyDirectory->second;
+                return;
+            }
+        }
+
+        m_pArchiveFile->Seek( offset );
+        m_pArchiveFile->Read( &directory, sizeof( ArchiveDirectory ) );
+
+        if( directory.Magic != ArchiveMagic::eDirectory )
+            throw std::runtime_error( "Archive file corrupted" );
+
+        if( m_VerifyChecksums && directory.Checksum != directory.ComputeChecksum() )
+            throw std::runtime_error( "Archive file corrupted" );
+    }
+
+    void Archive::_WriteDirectory( uint64_t offset, const ArchiveDirectory& directory )
+    {
+        if( m_BatchDepth > 0 )
+        {
+            // Keep the block in memory until the batch is committed
+            PooledArchiveDirectory& dirtyDirectory = m_DirtyDirectories[offset];
+
+            if( dirtyDirectory )
+                *dirtyDirectory = directory;
+            else
+                dirtyDirectory = m_DirectoryPool.Allocate( directory );
+        }
+        else
+        {
+            _StoreDirectory( offset, directory );
+        }
+
+        if( offset == OffsetOf( ArchiveHeader, Root ) )
+        {
+            // Header has been invalidated
+            m_pHeader->Root = directory;
+        }
+
+        if( offset == m_CurrentDirectoryOffset )
+        {
+            // Current directory has been invalidated
+            *m_pCurrentDirectory = directory;
+        }
+    }
+
+    uint64_t Archive::_GetEntryAllocationSize( const ArchiveEntry& entry )
+    {
+        if( entry.IsSolid() )
+        {
+            ArchiveSolidGroupHeader groupHeader;
+
+            m_pArchiveFile->Seek( _GetEntryOffset( entry ) );
+            m_pArchiveFile->Read( &groupHeader, sizeof( ArchiveSolidGroupHeader ) );
+
+            return std::max<uint64_t>( groupHeader.GetGroupSize(), m_pAllocator->GetAllocationSize() );
+        }
+
+        if( !entry.IsChunked() )
+            return entry.GetSize();
+
+        ArchiveChunkListHeader listHeader;
+
+        m_pArchiveFile->Seek( _GetEntryOffset( entry ) );
+        m_pArchiveFile->Read( &listHeader, sizeof( ArchiveChunkListHeader ) );
+
+        const uint64_t listSize = sizeof( ArchiveChunkListHeader ) +
+            static_cast<uint64_t>(listHeader.ChunkCount) * sizeof( ArchiveChunkReference );
+
+        return std::max<uint64_t>( listSize, m_pAllocator->GetAllocationSize() );
+    }
+
+    uint64_t Archive::_WriteChunkedData( const void* data, size_t size )
+    {
+        ArchiveTraceScope traceScope( "Archive::WriteChunkedData", "io" );
+
+        const char* bytes = reinterpret_cast<const char*>(data);
+
+        std::vector<ArchiveChunkReference> chunks;
+        size_t position = 0;
+
+        while( position < size )
+        {
+            const size_t chunkSize = ArchiveChunkStore::FindChunkBoundary( bytes + position, size - position );
+
+            ArchiveChunkReference chunk = {};
+            chunk.Offset = _StoreChunk( bytes + position, static_cast<uint32_t>(chunkSize) );
+            chunk.Size = static_cast<uint32_t>(chunkSize);
+
+            chunks.push_back( chunk );
+            position += chunkSize;
+        }
+
+        ArchiveChunkListHeader listHeader = {};
+        listHeader.ChunkCount = static_cast<uint32_t>(chunks.size());
+
+        const uint64_t listSize = sizeof( ArchiveChunkListHeader ) + chunks.size() * sizeof( ArchiveChunkReference );
+
+        // The list is never packed into a shared sector, its size is not known from the entry
+        const uint64_t listOffset = m_pAllocator->Allocate( std::max<uint64_t>( listSize, m_pAllocator->GetAllocationSize() ) );
+
+        m_pArchiveFile->Seek( listOffset );
+        m_pArchiveFile->Write( &listHeader, sizeof( ArchiveChunkListHeader ) );
+        m_pArchiveFile->Write( chunks.data(), chunks.size() * sizeof( ArchiveChunkReference ) );
+
+        return listOffset;
+    }
+
+    uint64_t Archive::_StoreChunk( const void* data, uint32_t size )
+    {
+        const uint64_t fingerprint = ArchiveChunkStore::Fingerprint( data, size );
+
+        std::vector<char> storedData;
+
+        // Fingerprints may collide, the data is compared before the chunk is shared
+        const int32_t index = m_ChunkStore.Find( fingerprint, size, [&]( const ArchiveChunk& chunk )
+            {
+                storedData.resize( chunk.Size );
+
+                m_pArchiveFile->Seek( chunk.Offset );
+                m_pArchiveFile->Read( storedData.data(), chunk.Size );
+
+                return memcmp( storedData.data(), data, size ) == 0;
+            } );
+
+        if( index >= 0 )
+        {
+            m_ChunkStore.AddReference( static_cast<uint32_t>(index) );
+            return m_ChunkStore.GetChunk( static_cast<uint32_t>(index) ).Offset;
+        }
+
+        const uint64_t chunkOffset = m_pAllocator->Allocate( size );
+
+        m_pArchiveFile->Seek( chunkOffset );
+        m_pArchiveFile->Write( data, size );
+
+        if( m_ChunkStore.IsFull() )
+            m_ChunkStore.AddPage( m_pAllocator->Allocate( ArchiveChunkPage::PageSize ) );
+
+        m_ChunkStore.Insert( fingerprint, chunkOffset, size );
+
+        return chunkOffset;
+    }
+
+    void Archive::_ReadChunkList( const ArchiveEntry& entry, std::vector<ArchiveChunkReference>& chunks )
+    {
+        ArchiveChunkListHeader listHeader;
+
+        m_pArchiveFile->Seek( _GetEntryOffset( entry ) );
+        m_pArchiveFile->Read( &listHeader, sizeof( ArchiveChunkListHeader ) );
+
+        chunks.resize( listHeader.ChunkCount );
+        m_pArchiveFile->Read( chunks.data(), chunks.size() * sizeof( ArchiveChunkReference ) );
+    }
+
+    void Archive::_ReadEntryData( const ArchiveDirectory& directory, const ArchiveEntry& entry, void* buffer )
+    {
+        ArchiveTraceScope traceScope( "Archive::ReadEntryData", "io" );
+
+        if( entry.IsInline() )
+        {
+            // Buffer of the empty file may be null
+            if( entry.SizeLow > 0 )
+                memcpy( buffer, directory.GetInlineData( entry ), entry.SizeLow );
+
+            return;
+        }
+
+        if( entry.IsSolid() )
+        {
+            _ReadSolidMember( entry, buffer );
+        }
+        else if( entry.IsChunked() )
+        {
+            std::vector<ArchiveChunkReference> chunks;
+            _ReadChunkList( entry, chunks );
+
+            char* output = reinterpret_cast<char*>(buffer);
+
+            for( const ArchiveChunkReference& chunk : chunks )
+            {
+                m_pArchiveFile->Seek( chunk.Offset );
+                m_pArchiveFile->Read( output, chunk.Size );
+                output += chunk.Size;
+            }
+        }
+        else
+        {
+            m_pArchiveFile->Seek( _GetEntryOffset( entry ) );
+            m_pArchiveFile->Read( buffer, static_cast<size_t>(entry.GetSize()) );
+        }
+
+        // Inline data is covered by the checksum of the directory block
+        if( m_VerifyChecksums && entry.HasChecksum() &&
+            directory.GetEntryChecksum( entry ) != Crc32c( buffer, static_cast<size_t>(entry.GetSize()) ) )
+        {
+            const std::string_view name( directory.Data + entry.NameOffset, entry.NameLength );
+            throw std::runtime_error( (std::string( name ) + " is corrupted").c_str() );
+        }
+    }
+
+    void Archive::_AddEntry( uint64_t directoryOffset, const ArchiveEntry& entry, std::string_view name, const void* inlineData, uint32_t checksum )
+    {
+        const size_t heapSize = name.length() + entry.GetPayloadSize();
+
+        auto directory = _ReadDirectory( directoryOffset );
+
+        while( !directory->HasFreeSpace( heapSize ) )
+        {
+            if( directory->Next != 0 )
+            {
+                directoryOffset = directory->Next;
+                directory = _ReadDirectory( directory->Next );
+                continue;
+            }
+
+            uint64_t allocationOffset = m_pAllocator->Allocate( sizeof( ArchiveDirectory ) );
+
+            directory->Next = allocationOffset;
+
+            _WriteDirectory( directoryOffset, *directory );
+
+            auto directoryExt = m_DirectoryPool.Allocate(
+                ArchiveDirectory( directory->Parent ) );
+
+            directoryOffset = allocationOffset;
+            directory = directoryExt;
+        }
+
+        directory->AddEntry( entry, name, inlineData, checksum );
+
+        _WriteDirectory( directoryOffset, *directory );
+    }
+
+    bool Archive::_UseChunkedStorage( uint64_t size ) const
+    {
+        // Chunking pays off only for files larger than the allocation unit
+        return m_Deduplication &&
+            size > std::max<uint64_t>( ArchiveChunkStore::MinChunkSize, m_pAllocator->GetAllocationSize() );
+    }
+
+    void Archive::_CheckRead() const
+    {
+        if( m_Mode == ArchiveFileOpenMode::eWriteOnly )
+            throw std::runtime_error( "Archive not opened in read mode" );
+    }
+
+    void Archive::_CheckWrite() const
+    {
+        if( m_Mode == ArchiveFileOpenMode::eReadOnly )
+            throw std::runtime_error( "Archive not opened in write mode" );
+    }
+
+    void Archive::_StoreDirectory( uint64_t offset, const ArchiveDirectory& directory )
+    {
+        ArchiveTraceScope traceScope( "Archive::StoreDirectory", "io" );
+
+        // Checksum is computed only when the block is actually written
+        const uint32_t checksum = directory.ComputeChecksum();
+        const size_t checksumOffset = OffsetOf( ArchiveDirectory, Checksum );
+        const size_t checksumEnd = checksumOffset + sizeof( uint32_t );
+
+        m_pArchiveFile->Seek( offset );
+        m_pArchiveFile->Write( &directory, checksumOffset );
+        m_pArchiveFile->Write( &checksum, sizeof( uint32_t ) );
+        m_pArchiveFile->Write( reinterpret_cast<const char*>(&directory) + checksumEnd, sizeof( ArchiveDirectory ) - checksumEnd );
+    }
+
+    void Archive::_LoadAllocationTable()
+    {
+        ArchiveAllocationPage page;
+        uint64_t pageOffset = m_pHeader->AllocationMap;
+
+        for( uint32_t i = 0; i < m_pHeader->AllocationPageCount; ++i )
+        {
+            m_pArchiveFile->Seek( pageOffset );
+            m_pArchiveFile->Read( &page, sizeof( ArchiveAllocationPage ) );
+
+            if( page.Magic != ArchiveMagic::eAllocationPage ||
+                page.Checksum != Crc32cExcludingField( &page, sizeof( page ), OffsetOf( ArchiveAllocationPage, Checksum ) ) )
+                throw std::runtime_error( "Archive file corrupted" );
+
+            m_pAllocator->LoadPage( pageOffset, page.Blocks );
+            pageOffset = page.Next;
+        }
+
+        ArchiveSlotPage slotPage;
+        uint64_t slotPageOffset = m_pHeader->SlotMap;
+
+        for( uint32_t i = 0; i < m_pHeader->SlotPageCount; ++i )
+        {
+            m_pArchiveFile->Seek( slotPageOffset );
+            m_pArchiveFile->Read( &slotPage, sizeof( ArchiveSlotPage ) );
+
+            if( slotPage.Magic != ArchiveMagic::eSlotPage || slotPage.Count > ArchiveSlotPage::Capacity ||
+                slotPage.Checksum != Crc32cExcludingField( &slotPage, sizeof( slotPage ), OffsetOf( ArchiveSlotPage, Checksum ) ) )
+                throw std::runtime_error( "Archive file corrupted" );
+
+            m_pAllocator->LoadSlotPage( slotPageOffset, slotPage.Sectors, slotPage.Count );
+            slotPageOffset = slotPage.Next;
+        }
+
+        m_pAllocator->Rebuild();
+
+        ArchiveChunkPage chunkPage;
+        uint64_t chunkPageOffset = m_pHeader->ChunkMap;
+
+        for( uint32_t i = 0; i < m_pHeader->ChunkPageCount; ++i )
+        {
+            m_pArchiveFile->Seek( chunkPageOffset );
+            m_pArchiveFile->Read( &chunkPage, sizeof( ArchiveChunkPage ) );
+
+            if( chunkPage.Magic != ArchiveMagic::eChunkPage || chunkPage.Count > ArchiveChunkPage::Capacity ||
+                chunkPage.Checksum != Crc32cExcludingField( &chunkPage, sizeof( chunkPage ), OffsetOf( ArchiveChunkPage, Checksum ) ) )
+                throw std::runtime_error( "Archive file corrupted" );
+
+            m_ChunkStore.LoadPage( chunkPageOffset, chunkPage.Chunks, chunkPage.Count );
+            chunkPageOffset = chunkPage.Next;
+        }
+
+        m_ChunkStore.Rebuild();
+    }
+
+    void Archive::_Flush()
+    {
+        if( m_BatchDepth == 0 )
+            m_pArchiveFile->Flush();
+    }
+
+    void Archive::_AllocationTableUpdated()
+    {
+        if( m_BatchDepth > 0 )
+        {
+            m_AllocationTableDirty = true;
+            return;
+        }
+
+        _FlushAllocationTable();
+    }
+
+    void Archive::_FlushAllocationTable()
+    {
+        ArchiveTraceScope traceScope( "Archive::FlushAllocationTable", "io" );
+
+        const uint32_t pageCount = m_pAllocator->GetPageCount();
+
+        // Only the pages modified since the last flush are written back
+        for( uint32_t i = 0; i < pageCount; ++i )
+        {
+            if( !m_pAllocator->IsPageDirty( i ) )
+                continue;
+
+            ArchiveAllocationPage page;
+            page.Magic = ArchiveMagic::eAllocationPage;
+            page.Next = (i + 1 < pageCount) ? m_pAllocator->GetPageOffset( i + 1 ) : 0;
+            memcpy( page.Blocks, m_pAllocator->GetPageBlocks( i ), sizeof( page.Blocks ) );
+            page.Checksum = Crc32cExcludingField( &page, sizeof( page ), OffsetOf( ArchiveAllocationPage, Checksum ) );
+
+            m_pArchiveFile->Seek( m_pAllocator->GetPageOffset( i ) );
+            m_pArchiveFile->Write( &page, sizeof( ArchiveAllocationPage ) );
+        }
+
+        const uint32_t slotPageCount = m_pAllocator->GetSlotPageCount();
+
+        for( uint32_t i = 0; i < slotPageCount; ++i )
+        {
+            if( !m_pAllocator->IsSlotPageDirty( i ) )
+                continue;
+
+            uint32_t count = 0;
+            const ArchiveSlotSector* sectors = m_pAllocator->GetSlotPageSectors( i, count );
+
+            ArchiveSlotPage page = {};
+            page.Magic = ArchiveMagic::eSlotPage;
+            page.Count = count;
+            page.Next = (i + 1 < slotPageCount) ? m_pAllocator->GetSlotPageOffset( i + 1 ) : 0;
+            memcpy( page.Sectors, sectors, sizeof( ArchiveSlotSector ) * count );
+            page.Checksum = Crc32cExcludingField( &page, sizeof( page ), OffsetOf( ArchiveSlotPage, Checksum ) );
+
+            m_pArchiveFile->Seek( m_pAllocator->GetSlotPageOffset( i ) );
+            m_pArchiveFile->Write( &page, sizeof( ArchiveSlotPage ) );
+        }
+
+        const uint32_t chunkPageCount = m_ChunkStore.GetPageCount();
+
+        for( uint32_t i = 0; i < chunkPageCount; ++i )
+        {
+            if( !m_ChunkStore.IsPageDirty( i ) )
+                continue;
+
+            uint32_t count = 0;
+            const ArchiveChunk* chunks = m_ChunkStore.GetPageChunks( i, count );
+
+            ArchiveChunkPage page = {};
+            page.Magic = ArchiveMagic::eChunkPage;
+            page.Count = count;
+            page.Next = (i + 1 < chunkPageCount) ? m_ChunkStore.GetPageOffset( i + 1 ) : 0;
+            memcpy( page.Chunks, chunks, sizeof( ArchiveChunk ) * count );
+            page.Checksum = Crc32cExcludingField( &page, sizeof( page ), OffsetOf( ArchiveChunkPage, Checksum ) );
+
+            m_pArchiveFile->Seek( m_ChunkStore.GetPageOffset( i ) );
+            m_pArchiveFile->Write( &page, sizeof( ArchiveChunkPage ) );
+        }
+
+        m_pAllocator->ClearDirtyPages();
+        m_ChunkStore.ClearDirtyPages();
+
+        m_pHeader->AllocationPageCount = pageCount;
+        m_pHeader->AllocationMap = (pageCount > 0) ? m_pAllocator->GetPageOffset( 0 ) : 0;
+        m_pHeader->SlotPageCount = slotPageCount;
+        m_pHeader->SlotMap = (slotPageCount > 0) ? m_pAllocator->GetSlotPageOffset( 0 ) : 0;
+        m_pHeader->ChunkPageCount = chunkPageCount;
+        m_pHeader->ChunkMap = (chunkPageCount > 0) ? m_ChunkStore.GetPageOffset( 0 ) : 0;
+
+        m_pHeader->Checksum = Crc32cExcludingField( m_pHeader.get(), OffsetOf( ArchiveHeader, Root ), OffsetOf( ArchiveHeader, Checksum ) );
+
+        // Root directory is kept up to date by _WriteDirectory
+        m_pArchiveFile->Seek( 0 );
+        m_pArchiveFile->Write( m_pHeader.get(), OffsetOf( ArchiveHeader, Root ) );
+
+        ArchiveCounters::Add( ArchiveCounter::eHeaderFlushes, 1 );
+    }
+
+    void Archive::_BuildCompactPlan( uint64_t directoryOffset, std::vector<CompactItem>& items )
+    {
+        std::vector<CompactItem> subdirectories;
+
+        ArchiveDirectory directory;
+        uint64_t blockOffset = directoryOffset;
+
+        _ReadDirectory( blockOffset, directory );
+
+        while( true )
+        {
+            for( uint32_t i = 0; i < directory.NumEntries; ++i )
+            {
+                const ArchiveEntry& entry = directory.GetEntry( i );
+
+                // Inline entries, shared sectors and solid groups stay where they are
+                if( entry.IsInline() || entry.IsSlot() || entry.IsSolid() )
+                    continue;
+
+                const CompactItem item = { _GetEntryOffset( entry ), _GetEntryAllocationSize( entry ), blockOffset, i, entry.Type };
+
+                if( entry.Type == ArchiveEntryType::eDirectory )
+                    subdirectories.push_back( item );
+                else
+                    items.push_back( item );
+            }
+
+            if( directory.Next == 0 )
+                break;
+
+            items.push_back( CompactItem{ directory.Next, sizeof( ArchiveDirectory ), blockOffset, CompactItem::NextLink, ArchiveEntryType::eDirectory } );
+
+            blockOffset = directory.Next;
+            _ReadDirectory( blockOffset, directory );
+        }
+
+        // Each subdirectory is followed by its contents
+        for( const CompactItem& subdirectory : subdirectories )
+        {
+            items.push_back( subdirectory );
+            _BuildCompactPlan( subdirectory.Offset, items );
+        }
+    }
+
+    void Archive::_MoveCompactItem( std::vector<CompactItem>& items, uint32_t index, uint64_t newOffset )
+    {
+        CompactItem& item = items[index];
+        const uint64_t oldOffset = item.Offset;
+
+        if( item.Type == ArchiveEntryType::eFile )
+        {
+            _ReallocationHandler( oldOffset, newOffset, item.Size );
+        }
+        else
+        {
+            ArchiveDirectory directory;
+            _ReadDirectory( oldOffset, directory );
+
+            // Pending copy of the block must not overwrite the new owner of its sectors
+            m_DirtyDirectories.erase( oldOffset );
+
+            if( oldOffset == m_CurrentDirectoryOffset )
+                m_CurrentDirectoryOffset = newOffset;
+
+            _WriteDirectory( newOffset, directory );
+        }
+
+        ArchiveDirectory referencingDirectory;
+        _ReadDirectory( item.ReferenceOffset, referencingDirectory );
+
+        if( item.ReferenceIndex == CompactItem::NextLink )
+            referencingDirectory.Next = newOffset;
+        else
+            _SetEntryOffset( referencingDirectory.GetEntry( item.ReferenceIndex ), newOffset );
+
+        _WriteDirectory( item.ReferenceOffset, referencingDirectory );
+
+        item.Offset = newOffset;
+
+        if( item.Type == ArchiveEntryType::eDirectory )
+        {
+            for( CompactItem& otherItem : items )
+            {
+                if( otherItem.ReferenceOffset == oldOffset )
+                    otherItem.ReferenceOffset = newOffset;
+            }
+
+            // Subdirectories refer to the first block of their parent
+            if( item.ReferenceIndex != CompactItem::NextLink )
+                _UpdateParentLinks( newOffset );
+        }
+    }
+
+    void Archive::_UpdateParentLinks( uint64_t directoryOffset )
+    {
+        ArchiveDirectory directory;
+        ArchiveDirectory subdirectory;
+
+        _ReadDirectory( directoryOffset, directory );
+
+        while( true )
+        {
+            for( uint32_t i = 0; i < directory.NumEntries; ++i )
+            {
+                const ArchiveEntry& entry = directory.GetEntry( i );
+
+                if( entry.Type != ArchiveEntryType::eDirectory )
+                    continue;
+
+                uint64_t blockOffset = _GetEntryOffset( entry );
+
+                while( blockOffset != 0 )
+                {
+                    _ReadDirectory( blockOffset, subdirectory );
+
+                    subdirectory.Parent = directoryOffset;
+
+                    _WriteDirectory( blockOffset, subdirectory );
+                    blockOffset = subdirectory.Next;
+                }
+            }
+
+            if( directory.Next == 0 )
+                break;
+
+            _ReadDirectory( directory.Next, directory );
+        }
+    }
+
+    int32_t Archive::_FindEntryBlock( uint64_t directoryOffset, std::string_view name, ArchiveDirectory& directory, uint64_t& blockOffset, uint64_t& previousBlockOffset )
+    {
+        ArchiveCounters::Add( ArchiveCounter::eDirectoryLookups, 1 );
+
+        blockOffset = directoryOffset;
+        previousBlockOffset = 0;
+
+        _ReadDirectory( blockOffset, directory );
+
+        while( true )
+        {
+            for( uint32_t i = 0; i < directory.NumEntries; ++i )
+            {
+                if( directory.GetEntryName( i ) == name )
+                    return static_cast<int32_t>(i);
+            }
+
+            if( directory.Next == 0 )
+                return -1;
+
+            previousBlockOffset = blockOffset;
+            blockOffset = directory.Next;
+
+            _ReadDirectory( blockOffset, directory );
+        }
+    }
+
+    void Archive::_RemoveEntry( ArchiveDirectory& directory, uint64_t blockOffset, uint64_t previousBlockOffset, uint32_t index, ArchiveAllocationList& allocations )
+    {
+        directory.RemoveEntry( index );
+
+        if( directory.NumEntries > 0 || previousBlockOffset == 0 )
+        {
+            _WriteDirectory( blockOffset, directory );
+            return;
+        }
+
+        // Empty extension block is unlinked from the chain
+        ArchiveDirectory previousDirectory;
+        _ReadDirectory( previousBlockOffset, previousDirectory );
+
+        previousDirectory.Next = directory.Next;
+
+        _WriteDirectory( previousBlockOffset, previousDirectory );
+
+        allocations.emplace_back( blockOffset, sizeof( ArchiveDirectory ) );
+    }
+
+    void Archive::_CollectAllocations( uint64_t directoryOffset, ArchiveAllocationList& allocations )
+    {
+        ArchiveDirectory directory;
+        uint64_t blockOffset = directoryOffset;
+
+        while( blockOffset != 0 )
+        {
+            _ReadDirectory( blockOffset, directory );
+
+            allocations.emplace_back( blockOffset, sizeof( ArchiveDirectory ) );
+
+            for( uint32_t i = 0; i < directory.NumEntries; ++i )
+            {
+                const ArchiveEntry& entry = directory.GetEntry( i );
+
+                if( entry.Type == ArchiveEntryType::eDirectory )
+                    _CollectAllocations( _GetEntryOffset( entry ), allocations );
+                else
+                    _CollectEntryAllocations( entry, allocations );
+            }
+
+            blockOffset = directory.Next;
+        }
+    }
+
+    void Archive::_CollectEntryAllocations( const ArchiveEntry& entry, ArchiveAllocationList& allocations )
+    {
+        if( entry.IsInline() )
+            return;
+
+        if( entry.IsSolid() )
+        {
+            const uint64_t groupOffset = _GetEntryOffset( entry );
+
+            ArchiveSolidGroupHeader groupHeader;
+            std::vector<ArchiveSolidMember> members;
+            _ReadSolidGroup( groupOffset, groupHeader, members );
+
+            // Group is freed when the last entry referencing it is removed
+            if( --groupHeader.ReferenceCount == 0 )
+            {
+                allocations.emplace_back( groupOffset, _GetEntryAllocationSize( entry ) );
+                return;
+            }
+
+            groupHeader.Checksum = groupHeader.ComputeChecksum( members.data() );
+
+            m_pArchiveFile->Seek( groupOffset );
+            m_pArchiveFile->Write( &groupHeader, sizeof( ArchiveSolidGroupHeader ) );
+            return;
+        }
+
+        if( entry.IsChunked() )
+        {
+            std::vector<ArchiveChunkReference> chunks;
+            _ReadChunkList( entry, chunks );
+
+            // Chunks are freed when the last entry referencing them is removed
+            for( const ArchiveChunkReference& chunk : chunks )
+            {
+                uint32_t chunkSize = 0;
+
+                if( m_ChunkStore.Release( chunk.Offset, chunkSize ) )
+                    allocations.emplace_back( chunk.Offset, chunkSize );
+            }
+
+            uint64_t pageOffset = 0;
+
+            while( m_ChunkStore.RemoveUnusedPage( pageOffset ) )
+                allocations.emplace_back( pageOffset, ArchiveChunkPage::PageSize );
+        }
+
+        allocations.emplace_back( _GetEntryOffset( entry ), _GetEntryAllocationSize( entry ) );
+    }
+
+    void Archive::_ReleaseAllocations( ArchiveAllocationList& allocations )
+    {
+        // Freeing in the order of offsets lets the allocator merge neighbouring ranges
+        std::sort( allocations.begin(), allocations.end() );
+
+        for( const auto& allocation : allocations )
+        {
+            // Pending copies of freed directory blocks must not be written back
+            m_DirtyDirectories.erase( allocation.first );
+
+            m_pAllocator->Free( allocation.first, allocation.second );
+
+            const uint32_t slotSize = m_pAllocator->GetSlotSize( allocation.second );
+            const uint64_t allocatedSize = slotSize
+                ? slotSize
+                : static_cast<uint64_t>(m_pAllocator->GetSectorCount( allocation.second )) * m_pAllocator->GetAllocationSize();
+
+            m_pArchiveFile->Discard( static_cast<size_t>(allocation.first), static_cast<size_t>(allocatedSize) );
+
+            if( m_pPrefetcher )
+                m_pPrefetcher->Invalidate( allocation.first, allocatedSize );
+        }
+
+        // Freed range may be reused by another solid group
+        m_SolidCacheOffset = 0;
+
+        _TruncateTail();
+    }
+
+    void Archive::_TruncateTail()
+    {
+        m_pArchiveFile->Seek( 0, SEEK_END );
+
+        const uint64_t fileSize = m_pArchiveFile->Tell();
+        const uint64_t allocationEnd = m_pAllocator->GetAllocationEnd();
+
+        if( allocationEnd < fileSize )
+            m_pArchiveFile->Truncate( static_cast<size_t>(allocationEnd) );
+    }
+
+    void Archive::_ReallocationHandler( uint64_t oldOffset, uint64_t newOffset, uint64_t size )
+    {
+        ArchiveTraceScope traceScope( "Archive::Relocate", "io" );
+
+        m_SolidCacheOffset = 0;
+
+        if( m_pPrefetcher )
+            m_pPrefetcher->Invalidate( oldOffset, size );
+
+        std::vector<char> dataBuffer( static_cast<size_t>(size) );
         void* pData = dataBuffer.data();
 
         m_pArchiveFile->Seek( oldOffset );
-        m_pArchiveFile->Read( pData, size );
+        m_pArchiveFile->Read( pData, dataBuffer.size() );
         m_pArchiveFile->Seek( newOffset );
-        m_pArchiveFile->Write( pData, size );
+        m_pArchiveFile->Write( pData, dataBuffer.size() );
+
+        ArchiveCounters::Add( ArchiveCounter::eRelocations, 1 );
+        ArchiveCounters::Add( ArchiveCounter::eBytesRelocated, size );
+    }
+
+
+    ArchiveBatch::ArchiveBatch( Archive* archive )
+        : m_pArchive( archive )
+    {
+        m_pArchive->BeginBatch();
+    }
+
+    ArchiveBatch::~ArchiveBatch()
+    {
+        if( !m_pArchive )
+            return;
+
+        try
+        {
+            m_pArchive->CommitBatch();
+        }
+        catch( ... )
+        {
+            // Destructor must not throw, call Commit to handle errors
+        }
+    }
+
+    void ArchiveBatch::Commit()
+    {
+        Archive* archive = m_pArchive;
+        m_pArchive = nullptr;
+
+        archive->CommitBatch();
     }
 }
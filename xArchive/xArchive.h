@@ -2,10 +2,16 @@
 #include "xArchiveConf.h"
 #include "xArchiveFile.h"
 #include "xArchiveAllocator.h"
+#include "xArchiveChunkStore.h"
 #include "xArchiveHelpers.h"
-#include <functional>
+#include "xArchivePool.h"
+#include "xArchiveStats.h"
+#include <chrono>
+#include <deque>
+#include <map>
 #include <vector>
 #include <string>
+#include <string_view>
 
 namespace xArchive
 {
@@ -14,124 +20,693 @@ namespace xArchive
         eReadonly = 1
     };
 
+    enum class ArchiveEntryType : uint8_t
+    {
+        eDirectory,
+        eFile
+    };
+
+    enum class ArchiveWalkOrder : uint32_t
+    {
+        eDepthFirst,
+        eBreadthFirst
+    };
+
+    // Metadata of the entry reported by ArchiveWalker.
+    struct ArchiveEntryInfo
+    {
+        std::string             Path;
+        std::string             Name;
+        ArchiveEntryType        Type;
+        uint64_t                Size;
+        uint64_t                Offset;
+        bool                    Inline;
+    };
+
+    // Entry of the tree added with Archive::ImportTree. Paths are relative to the current directory.
+    struct ArchiveImportEntry
+    {
+        std::string             Path;
+        ArchiveEntryType        Type = ArchiveEntryType::eFile;
+        uint64_t                Size = 0;
+        // File data is read from the source file unless it's provided in memory
+        std::string             SourceFilename;
+        const void*             Data = nullptr;
+    };
+
+    struct ArchiveImportOptions
+    {
+        // Files are grouped by content type and similarity and each group is compressed as
+        // a single stream. Gives better ratio for archives which are rarely read, because
+        // reading the file inflates its whole group. Reading the files in order of their
+        // offsets reported by Walk inflates each group only once.
+        bool                    Solid = false;
+        // Maximum uncompressed size of the solid group, larger files are stored separately
+        uint32_t                SolidGroupSize = 4 * 1024 * 1024;
+    };
+
+    struct ArchiveCompactOptions
+    {
+        // Compaction stops after moving at least this many bytes, 0 for no limit
+        uint64_t                ByteBudget = 0;
+        // Compaction stops after running for this time, 0 for no limit
+        std::chrono::milliseconds TimeBudget = std::chrono::milliseconds( 0 );
+    };
+
+    struct ArchiveCompactResult
+    {
+        uint64_t                BytesMoved;
+        uint32_t                EntriesMoved;
+        // False if the budget ran out, next call continues where this one stopped
+        bool                    Complete;
+    };
+
+    struct ArchiveVerifyOptions
+    {
+        // Number of worker threads, 0 to use all cores
+        uint32_t                ThreadCount = 0;
+        // Read data of the files and compare it with the stored checksums
+        bool                    VerifyData = true;
+    };
+
+    struct ArchiveVerifyResult
+    {
+        uint64_t                DirectoryCount;
+        uint64_t                FileCount;
+        uint64_t                BytesVerified;
+        std::chrono::milliseconds Duration;
+        // Description of each problem found, empty if the archive is consistent
+        std::vector<std::string> Issues;
+    };
+
+    // File read recorded by the access trace.
+    struct ArchiveAccessRecord
+    {
+        std::string             Path;
+        // Time since the trace has been started
+        std::chrono::microseconds Time;
+    };
+
+    // Public calls recorded by the workload trace.
+    enum class ArchiveOperation : uint8_t
+    {
+        eReadFile,
+        eCreateFile,
+        eRemoveFile,
+        eGetFileSize,
+        eListDirectory,
+        eCreateDirectory,
+        eRemoveDirectory,
+        // Only the start of the walk is timed, the entries are read lazily by the caller
+        eWalkDirectory,
+        // Recorded with the current directory and the total size of the files, the manifest is not kept
+        eImportTree,
+        // Prefetch is recorded separately for each of the paths
+        ePrefetch,
+        ePrefetchDirectory
+    };
+
+    // Arguments of the walks and directory prefetches, stored in the size of their records.
+    enum class ArchiveWorkloadFlags : uint64_t
+    {
+        eRecursive = 1,
+        eBreadthFirst = 2
+    };
+
+    struct ArchiveWorkloadRecord
+    {
+        ArchiveOperation        Operation;
+        // Absolute path of the entry
+        std::string             Path;
+        // Size of the data read or written
+        uint64_t                Size;
+        // Time since the trace has been started
+        std::chrono::microseconds Time;
+        std::chrono::microseconds Duration;
+    };
+
+    class ArchiveWalker;
+    class ArchivePrefetcher;
+
     class Archive
     {
     public:
         static XARCHIVE_API Archive* Open(
             const std::string& filename,
-            ArchiveOpenFlags flags = ArchiveOpenFlags() );
+            ArchiveOpenFlags flags = ArchiveOpenFlags(),
+            ArchiveAllocatorType allocatorType = ArchiveAllocatorType::eBitmap );
 
         static XARCHIVE_API Archive* Create(
             const std::string& filename,
-            uint32_t allocationSize = 4096 );
+            uint32_t allocationSize = 4096,
+            ArchiveAllocatorType allocatorType = ArchiveAllocatorType::eBitmap );
+
+        virtual ~Archive();
+
+        // Returns read-only archive with the current state of this archive. Its contents don't
+        // change when this archive is modified, the snapshot may be read from another thread
+        // without locking. Pages of the archive are copied on write while the snapshot exists.
+        virtual Archive* Snapshot();
+
+        // Defers write-back of the allocation table and directory blocks until the
+        // outermost batch is committed. Each dirty block is written once at commit.
+        virtual void BeginBatch();
+        virtual void CommitBatch();
 
-        virtual void CreateDirectory( const std::string& path );
-        virtual void RemoveDirectory( const std::string& path );
-        virtual void SetCurrentDirectory( const std::string& path );
+        virtual void CreateDirectory( std::string_view path );
+        virtual void RemoveDirectory( std::string_view path );
+        virtual void SetCurrentDirectory( std::string_view path );
         virtual std::string GetCurrentDirectory() const;
-        virtual std::vector<std::string> ListDirectory( const std::string& path );
-        virtual void ReadFile( const std::string& path, void* buffer, size_t bufferSize );
-        virtual std::vector<char> ReadFile( const std::string& path );
-        virtual void CreateFile( const std::string& path, const void* data, size_t size );
-        virtual void UpdateFile( const std::string& path, const void* data, size_t size );
-        virtual void RemoveFile( const std::string& path );
-        virtual size_t GetFileSize( const std::string& path );
+        virtual std::vector<std::string> ListDirectory( std::string_view path );
+        virtual ArchiveWalker Walk( std::string_view path, bool recursive = false, ArchiveWalkOrder order = ArchiveWalkOrder::eDepthFirst );
+        virtual void ReadFile( std::string_view path, void* buffer, size_t bufferSize );
+        virtual std::vector<char> ReadFile( std::string_view path );
+        virtual void CreateFile( std::string_view path, const void* data, size_t size );
+        // Adds the whole tree at once. Directory blocks and file data are allocated in
+        // a single contiguous range and written sequentially.
+        virtual void ImportTree( const std::vector<ArchiveImportEntry>& manifest, const ArchiveImportOptions& options = ArchiveImportOptions() );
+        virtual void UpdateFile( std::string_view path, const void* data, size_t size );
+        virtual void RemoveFile( std::string_view path );
+        virtual size_t GetFileSize( std::string_view path );
+
+        // Hints that the files will be read soon. Entries are resolved immediately, solid groups
+        // holding their data are inflated in the background, so the later reads find them in
+        // memory. Missing entries are ignored.
+        virtual void Prefetch( const std::vector<std::string>& paths );
+        virtual void PrefetchDirectory( std::string_view path, bool recursive = false );
+        virtual void SetInlineThreshold( size_t threshold );
+        virtual size_t GetInlineThreshold() const;
+
+        // Files created while deduplication is enabled are split into content-defined
+        // chunks, each unique chunk is stored only once.
+        virtual void SetDeduplication( bool enable );
+        virtual bool GetDeduplication() const;
+
+        // Checksums are always written. When verification is enabled, data of the files and
+        // directory blocks are checked when read, corrupted ones throw std::runtime_error.
+        virtual void SetVerifyChecksums( bool enable );
+        virtual bool GetVerifyChecksums() const;
+        virtual double GetFragmentation() const;
+
+        // Moves entries and directory blocks so that contents of each directory are stored
+        // contiguously in traversal order, then truncates free space at the end of the archive.
+        virtual ArchiveCompactResult Compact( const ArchiveCompactOptions& options = ArchiveCompactOptions() );
+
+        // Checks structure of the directory tree, allocation of all entries and data checksums
+        // using multiple threads. Runs on a snapshot, so the archive remains usable meanwhile.
+        virtual ArchiveVerifyResult Verify( const ArchiveVerifyOptions& options = ArchiveVerifyOptions() );
+
+        // Records reads of the files until the trace is ended. The reads are the same as the
+        // ReadFile records of the workload trace, only the path and time are kept.
+        virtual void BeginAccessTrace();
+        virtual std::vector<ArchiveAccessRecord> EndAccessTrace();
+
+        static XARCHIVE_API void SaveAccessTrace( const std::string& filename, const std::vector<ArchiveAccessRecord>& trace );
+        static XARCHIVE_API std::vector<ArchiveAccessRecord> LoadAccessTrace( const std::string& filename );
+
+        // Records successful calls which read or modify the entries, so the workload of the
+        // application can be replayed later against another archive or build of the library.
+        virtual void BeginWorkloadTrace();
+        virtual std::vector<ArchiveWorkloadRecord> EndWorkloadTrace();
+
+        // Workload traces are stored in binary form with each distinct path stored once.
+        static XARCHIVE_API void SaveWorkloadTrace( const std::string& filename, const std::vector<ArchiveWorkloadRecord>& trace );
+        static XARCHIVE_API std::vector<ArchiveWorkloadRecord> LoadWorkloadTrace( const std::string& filename );
+
+        // Performance counters of all archives in the process.
+        static XARCHIVE_API ArchiveStats GetStats();
+        static XARCHIVE_API void ResetStats();
+
+        // Scoped events of the operations of all archives in the process. Tracing is cheap to
+        // leave built in, events are recorded only while it's enabled.
+        static XARCHIVE_API void EnableTracing( bool enable );
+        // Saves the most recent events of each thread in Chrome trace (JSON) format.
+        static XARCHIVE_API void SaveTrace( const std::string& filename );
+        static XARCHIVE_API void ClearTrace();
+
+        // Like Compact, but places all directory blocks first followed by the files in order
+        // of their first access in the trace, so replaying the trace reads the archive sequentially.
+        virtual ArchiveCompactResult Relayout( const std::vector<ArchiveAccessRecord>& trace, const ArchiveCompactOptions& options = ArchiveCompactOptions() );
 
     private:
-        Archive( const std::string& filename, ArchiveFileOpenMode mode );
+        friend class ArchiveWalker;
+        friend class ArchiveVerifier;
+        friend class ArchivePrefetcher;
+
+        Archive( UniqueArchiveFile archiveFile, ArchiveAllocatorType allocatorType );
 
         enum class ArchiveMagic
             : uint32_t
         {
             eArchive                = BSwap( 'ARCH' ),
             eDirectory              = BSwap( 'DIR ' ),
-            eFile                   = BSwap( 'FILE' )
+            eFile                   = BSwap( 'FILE' ),
+            eAllocationPage         = BSwap( 'AMAP' ),
+            eSlotPage               = BSwap( 'SMAP' ),
+            eChunkPage              = BSwap( 'CMAP' ),
+            eSolidGroup             = BSwap( 'SOLD' )
         };
 
-        enum class ArchiveEntryType
-            : uint32_t
+        // Version of the archive layout, stored right after the archive magic.
+        // Version 2 introduced directory blocks with packed name heap.
+        // Version 3 introduced 64-bit offsets and paged allocation table.
+        // Version 4 introduced small entries packed into shared sectors.
+        // Version 5 introduced deduplicated chunked entries.
+        // Version 6 introduced CRC-32C checksums of entry data and metadata blocks.
+        // Version 7 introduced solid groups of entries compressed together.
+        static constexpr uint32_t ArchiveVersion = 7;
+
+        // Maximum length of the single path component stored in the directory.
+        static constexpr size_t MaxNameLength = 255;
+
+        // Files up to this size may be stored inline in the directory block.
+        static constexpr size_t MaxInlineSize = 1024;
+
+        enum class ArchiveEntryFlags
+            : uint8_t
         {
-            eDirectory,
-            eFile
+            // Entry data is stored in the directory heap right after the entry name
+            eInline                 = 1,
+            // Entry data is stored in the slot of the shared sector
+            eSlot                   = 2,
+            // Entry data is a list of references to the shared chunks
+            eChunked                = 4,
+            // Checksum of the entry data is stored in the directory heap right after the entry name
+            eChecksum               = 8,
+            // Entry data is a member of the solid group, Slot is the index of the member
+            eSolid                  = 16
         };
 
+        // Entry data is addressed with the allocation sector index (and slot index for
+        // entries in shared sectors) and the size is split into 48 bits to keep the entry
+        // 16 bytes long.
         struct ArchiveEntry
         {
-            char                    Name[32];
-            uint32_t                Offset;
-            uint32_t                Size;
+            static constexpr uint64_t MaxSize = (uint64_t( 1 ) << 48) - 1;
+
+            uint16_t                NameOffset;
+            uint8_t                 NameLength;
+            uint8_t                 Slot;
             ArchiveEntryType        Type;
+            uint8_t                 Flags;
+            uint16_t                SizeHigh;
+            uint32_t                Sector;
+            uint32_t                SizeLow;
 
             ArchiveEntry();
-            ArchiveEntry( const std::string& name, uint32_t offset, uint32_t size, ArchiveEntryType type );
+            ArchiveEntry( uint32_t sector, uint64_t size, ArchiveEntryType type );
+
+            bool IsInline() const;
+            bool IsSlot() const;
+            bool IsChunked() const;
+            bool IsSolid() const;
+            bool HasChecksum() const;
+            uint64_t GetSize() const;
+            void SetSize( uint64_t size );
+            uint32_t GetHeapSize() const;
+            // Size of the inline data or checksum stored after the name
+            uint32_t GetPayloadSize() const;
         };
 
         struct ArchiveDirectoryEntry
             : ArchiveEntry
         {
-            ArchiveDirectoryEntry( const std::string& name, uint32_t offset );
+            ArchiveDirectoryEntry( uint32_t sector );
         };
 
         struct ArchiveFileEntry
             : ArchiveEntry
         {
-            ArchiveFileEntry( const std::string& name, uint32_t offset, uint32_t size );
+            ArchiveFileEntry( uint32_t sector, uint64_t size );
+        };
+
+        struct ArchiveInlineFileEntry
+            : ArchiveEntry
+        {
+            ArchiveInlineFileEntry( uint32_t size );
         };
 
+        // Directory block keeps fixed-size entries at the beginning of the Data array
+        // and their names packed in the heap growing from the end of the block.
         struct ArchiveDirectory
         {
+            static constexpr uint32_t BlockSize = 4096;
+            static constexpr uint32_t DataSize = BlockSize - 32;
+
             ArchiveMagic            Magic;
-            uint32_t                Parent;
-            uint32_t                Next;
-            uint32_t                NumEntries;
-            ArchiveEntry            Entries[16];
+            uint16_t                NumEntries;
+            uint16_t                HeapOffset;
+            // Covers the whole block except this field
+            uint32_t                Checksum;
+            uint32_t                Reserved;
+            uint64_t                Parent;
+            uint64_t                Next;
+            char                    Data[DataSize];
 
-            ArchiveDirectory( uint32_t parent = 0 );
+            ArchiveDirectory( uint64_t parent = 0 );
 
-            void AddEntry( const ArchiveEntry& entry );
+            void AddEntry( const ArchiveEntry& entry, std::string_view name, const void* inlineData = nullptr, uint32_t checksum = 0 );
             void RemoveEntry( uint32_t n );
             ArchiveEntry& GetEntry( uint32_t n );
             const ArchiveEntry& GetEntry( uint32_t n ) const;
-            bool HasFreeSpace() const;
+            std::string_view GetEntryName( uint32_t n ) const;
+            const void* GetInlineData( const ArchiveEntry& entry ) const;
+            uint32_t GetEntryChecksum( const ArchiveEntry& entry ) const;
+            void SetEntryChecksum( const ArchiveEntry& entry, uint32_t checksum );
+            bool HasFreeSpace( size_t heapSize ) const;
+            uint32_t ComputeChecksum() const;
         };
 
-        using SharedArchiveDirectory = std::shared_ptr<ArchiveDirectory>;
-        using ArchiveDirectoryDeleter = std::function<void( ArchiveDirectory* )>;
+        static_assert( sizeof( ArchiveEntry ) == 16, "Unexpected directory entry layout" );
+        static_assert( sizeof( ArchiveDirectory ) == ArchiveDirectory::BlockSize, "Unexpected directory block layout" );
 
-        // Each allocation is recorded with 1 bit and equals to 1 allocation unit.
-        // Archive may hold up to 32k allocations.
-        typedef uint32_t ArchiveAllocationTable[1024];
+        using ArchiveDirectoryPool = ArchiveBlockPool<ArchiveDirectory>;
+        using PooledArchiveDirectory = ArchiveBlockHandle<ArchiveDirectory>;
+
+        // Each allocation unit is recorded with 1 bit of the allocation table. The table is
+        // stored in a chain of pages allocated in the archive when more space is needed.
+        struct ArchiveAllocationPage
+        {
+            static constexpr uint32_t PageSize = 4096;
+            static constexpr uint32_t BlockCount = (PageSize - 16) / sizeof( uint32_t );
+
+            ArchiveMagic            Magic;
+            uint32_t                Checksum;
+            uint64_t                Next;
+            uint32_t                Blocks[BlockCount];
+        };
+
+        static_assert( sizeof( ArchiveAllocationPage ) == ArchiveAllocationPage::PageSize, "Unexpected allocation page layout" );
+
+        // Occupancy of shared sectors, stored in a chain of pages like the allocation table.
+        struct ArchiveSlotPage
+        {
+            static constexpr uint32_t PageSize = 4096;
+            static constexpr uint32_t Capacity = (PageSize - 24) / sizeof( ArchiveSlotSector );
+
+            ArchiveMagic            Magic;
+            uint32_t                Count;
+            uint64_t                Next;
+            uint32_t                Checksum;
+            uint32_t                Reserved;
+            ArchiveSlotSector       Sectors[Capacity];
+            uint8_t                 Padding[PageSize - 24 - Capacity * sizeof( ArchiveSlotSector )];
+        };
+
+        static_assert( sizeof( ArchiveSlotPage ) == ArchiveSlotPage::PageSize, "Unexpected slot page layout" );
+
+        // Fingerprint index of the chunks, stored in a chain of pages like the allocation table.
+        struct ArchiveChunkPage
+        {
+            static constexpr uint32_t PageSize = 4096;
+            static constexpr uint32_t Capacity = (PageSize - 24) / sizeof( ArchiveChunk );
+
+            ArchiveMagic            Magic;
+            uint32_t                Count;
+            uint64_t                Next;
+            uint32_t                Checksum;
+            uint32_t                Reserved;
+            ArchiveChunk            Chunks[Capacity];
+            uint8_t                 Padding[PageSize - 24 - Capacity * sizeof( ArchiveChunk )];
+        };
+
+        static_assert( sizeof( ArchiveChunkPage ) == ArchiveChunkPage::PageSize, "Unexpected chunk page layout" );
+
+        // Data of the chunked entry starts with the header followed by references to the chunks.
+        struct ArchiveChunkListHeader
+        {
+            uint32_t                ChunkCount;
+            uint32_t                Reserved;
+        };
+
+        struct ArchiveChunkReference
+        {
+            uint64_t                Offset;
+            uint32_t                Size;
+            uint32_t                Reserved;
+        };
+
+        // Range of the member in the uncompressed data of the solid group
+        struct ArchiveSolidMember
+        {
+            uint64_t                Offset;
+            uint64_t                Size;
+        };
+
+        // Solid group keeps data of multiple entries compressed as a single raw deflate
+        // stream. The header is followed by the member table and the compressed data.
+        struct ArchiveSolidGroupHeader
+        {
+            static constexpr uint32_t MaxMembers = 256;
+
+            ArchiveMagic            Magic;
+            uint32_t                MemberCount;
+            // Entries still referencing the group, the group is freed when the last one is removed
+            uint32_t                ReferenceCount;
+            // Covers the header except this field and the member table
+            uint32_t                Checksum;
+            uint64_t                CompressedSize;
+            uint64_t                UncompressedSize;
+
+            // Size of the header, member table and compressed data
+            uint64_t GetGroupSize() const;
+            uint32_t ComputeChecksum( const ArchiveSolidMember* members ) const;
+        };
+
+        static_assert( sizeof( ArchiveSolidGroupHeader ) == 32, "Unexpected solid group layout" );
+
+        // File added to the solid group by ImportTree
+        struct ArchiveSolidItem
+        {
+            const ArchiveImportEntry* Source;
+            std::string             Name;
+            // Filled in when the group is written
+            uint64_t                Offset;
+            uint32_t                Checksum;
+            uint8_t                 Member;
+        };
 
         struct ArchiveHeader
         {
             ArchiveMagic            Magic;
+            uint32_t                Version;
             uint32_t                AllocationSize;
-            ArchiveAllocationTable  AllocationTable;
+            uint32_t                AllocationPageCount;
+            uint64_t                AllocationMap;
+            uint32_t                SlotPageCount;
+            uint32_t                ChunkPageCount;
+            uint64_t                SlotMap;
+            uint64_t                ChunkMap;
+            uint32_t                Reserved;
+            // Covers the header up to this field, root directory has its own checksum
+            uint32_t                Checksum;
             ArchiveDirectory        Root;
         };
 
         using UniqueArchiveHeader = std::unique_ptr<ArchiveHeader>;
 
+        // Records the public call to the workload trace when it returns without exception.
+        // Public calls made by other public calls are not recorded. Reads of the files are
+        // recorded to the access trace as well, so both traces share the same paths.
+        class ArchiveWorkloadScope
+        {
+        public:
+            ArchiveWorkloadScope( Archive* archive, ArchiveOperation operation, std::string_view path );
+            ~ArchiveWorkloadScope();
+
+            uint64_t                Size;
+
+        private:
+            Archive*                m_pArchive;
+            ArchiveOperation        m_Operation;
+            bool                    m_Outermost;
+            int                     m_UncaughtExceptions;
+            std::string             m_Path;
+            std::chrono::steady_clock::time_point m_StartTime;
+        };
+
+        // Directory created by ImportTree, its blocks are built in memory.
+        struct ImportDirectory
+        {
+            std::string             Path;
+            std::vector<ArchiveDirectory> Blocks;
+            uint64_t                Offset;
+        };
+
+        // Entry added by ImportTree to the new or existing directory.
+        struct ImportItem
+        {
+            const ArchiveImportEntry* Source;
+            std::string             Name;
+            std::string             ParentPath;
+            ArchiveEntry            Entry;
+            // New directory the entry is added to (-1 for existing directories), its block and entry index
+            int32_t                 Directory;
+            uint32_t                Block;
+            uint32_t                Index;
+            // New directory created by this entry
+            int32_t                 CreatedDirectory;
+            uint64_t                Offset;
+            uint32_t                Checksum;
+            // Existing directory the entry is added to and data of the inline file, both are
+            // resolved before the import starts writing
+            uint64_t                ParentOffset;
+            std::vector<char>       InlineData;
+        };
+
+        // Entry data or directory block which may be moved by Compact.
+        struct CompactItem
+        {
+            // Reference index of extension blocks linked from Next of the previous block
+            static constexpr uint32_t NextLink = ~0u;
+
+            uint64_t                Offset;
+            uint64_t                Size;
+            uint64_t                ReferenceOffset;
+            uint32_t                ReferenceIndex;
+            ArchiveEntryType        Type;
+        };
+
         UniqueArchiveFile           m_pArchiveFile;
         ArchiveFileOpenMode         m_Mode;
-        ArchiveDirectoryDeleter     m_pDirectoryFree;
+        ArchiveDirectoryPool        m_DirectoryPool;
         UniqueArchiveAllocator      m_pAllocator;
         UniqueArchiveHeader         m_pHeader;
-        SharedArchiveDirectory      m_pCurrentDirectory;
+        PooledArchiveDirectory      m_pCurrentDirectory;
         std::string                 m_CurrentDirectoryPath;
-        uint32_t                    m_CurrentDirectoryOffset;
+        uint64_t                    m_CurrentDirectoryOffset;
+        size_t                      m_InlineThreshold;
+        ArchiveChunkStore           m_ChunkStore;
+        bool                        m_Deduplication;
+        bool                        m_VerifyChecksums;
+        bool                        m_AccessTraceEnabled;
+        std::chrono::steady_clock::time_point m_AccessTraceStart;
+        std::vector<ArchiveAccessRecord> m_AccessTrace;
+        bool                        m_WorkloadTraceEnabled;
+        uint32_t                    m_WorkloadDepth;
+        std::chrono::steady_clock::time_point m_WorkloadTraceStart;
+        std::vector<ArchiveWorkloadRecord> m_WorkloadTrace;
+        uint32_t                    m_BatchDepth;
+        bool                        m_AllocationTableDirty;
+        std::map<uint64_t, PooledArchiveDirectory> m_DirtyDirectories;
+        // Uncompressed data of the most recently read solid group
+        uint64_t                    m_SolidCacheOffset;
+        std::shared_ptr<const std::vector<char>> m_SolidCache;
+        std::unique_ptr<ArchivePrefetcher> m_pPrefetcher;
 
-        ArchiveEntry _GetEntry( const std::string& path );
-        uint32_t _GetDirectoryOffset( const std::string& path );
-        SharedArchiveDirectory _GetDirectory( const std::string& path );
-        SharedArchiveDirectory _ReadDirectory( uint32_t offset );
-        void _NormalizeCurrentDirectoryPath();
+        const ArchiveEntry& _GetEntry( std::string_view path, ArchiveDirectory& directory );
+        const ArchiveEntry* _FindEntry( ArchiveDirectory& directory, std::string_view name );
+        uint64_t _GetDirectoryOffset( std::string_view path );
+        uint64_t _GetDirectoryOffset( std::string_view path, ArchiveDirectory& directory );
+        uint64_t _GetEntryOffset( const ArchiveEntry& entry ) const;
+        void _SetEntryOffset( ArchiveEntry& entry, uint64_t offset ) const;
+        PooledArchiveDirectory _GetDirectory( std::string_view path );
+        PooledArchiveDirectory _ReadDirectory( uint64_t offset );
+        void _ReadDirectory( uint64_t offset, ArchiveDirectory& directory );
+        void _WriteDirectory( uint64_t offset, const ArchiveDirectory& directory );
+        void _StoreDirectory( uint64_t offset, const ArchiveDirectory& directory );
+        void _LoadAllocationTable();
+        uint64_t _GetEntryAllocationSize( const ArchiveEntry& entry );
+        uint64_t _WriteChunkedData( const void* data, size_t size );
+        uint64_t _StoreChunk( const void* data, uint32_t size );
+        void _ReadChunkList( const ArchiveEntry& entry, std::vector<ArchiveChunkReference>& chunks );
+        void _ReadEntryData( const ArchiveDirectory& directory, const ArchiveEntry& entry, void* buffer );
+        void _WriteSolidGroups( std::vector<ArchiveSolidItem>& items, uint32_t groupSize );
+        uint64_t _WriteSolidGroup( const std::vector<ArchiveSolidMember>& members, const std::vector<char>& compressedData );
+        void _ReadSolidGroup( uint64_t offset, ArchiveSolidGroupHeader& groupHeader, std::vector<ArchiveSolidMember>& members );
+        static void _InflateSolidGroup( ArchiveFile& file, uint64_t offset, const ArchiveSolidGroupHeader& groupHeader, std::vector<char>& data );
+        void _ReadSolidMember( const ArchiveEntry& entry, void* buffer );
+        void _PrefetchDirectory( uint64_t directoryOffset, bool recursive, std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>>& groups );
+        void _PrefetchEntry( const ArchiveEntry& entry, std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>>& groups );
+        void _PrefetchSolidGroups( const std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>>& groups );
+        static void _ReadImportSource( const ArchiveImportEntry& source, std::vector<char>& buffer, uint64_t maxSize = ArchiveEntry::MaxSize );
+        void _AddEntry( uint64_t directoryOffset, const ArchiveEntry& entry, std::string_view name, const void* inlineData = nullptr, uint32_t checksum = 0 );
+        bool _UseChunkedStorage( uint64_t size ) const;
         void _CheckRead() const;
         void _CheckWrite() const;
-        void _FreeNonRoot( ArchiveDirectory* dirPtr );
+        void _Flush();
+        void _FlushAllocationTable();
         void _AllocationTableUpdated();
-        void _ReallocationHandler( uint32_t oldOffset, uint32_t newOffset, uint32_t size );
+        void _ReallocationHandler( uint64_t oldOffset, uint64_t newOffset, uint64_t size );
+        ArchiveCompactResult _CompactItems( std::vector<CompactItem>& items, const ArchiveCompactOptions& options );
+        void _BuildCompactPlan( uint64_t directoryOffset, std::vector<CompactItem>& items );
+        void _MoveCompactItem( std::vector<CompactItem>& items, uint32_t index, uint64_t newOffset );
+        void _UpdateParentLinks( uint64_t directoryOffset );
+
+        using ArchiveAllocationList = std::vector<std::pair<uint64_t, uint64_t>>;
+
+        int32_t _FindEntryBlock( uint64_t directoryOffset, std::string_view name, ArchiveDirectory& directory, uint64_t& blockOffset, uint64_t& previousBlockOffset );
+        void _RemoveEntry( ArchiveDirectory& directory, uint64_t blockOffset, uint64_t previousBlockOffset, uint32_t index, ArchiveAllocationList& allocations );
+        void _CollectAllocations( uint64_t directoryOffset, ArchiveAllocationList& allocations );
+        void _CollectEntryAllocations( const ArchiveEntry& entry, ArchiveAllocationList& allocations );
+        void _ReleaseAllocations( ArchiveAllocationList& allocations );
+        void _TruncateTail();
     };
 
     using UniqueArchive = std::unique_ptr<Archive>;
+
+    // Batch scope, commits the batch when it goes out of scope.
+    class XARCHIVE_API ArchiveBatch
+    {
+    public:
+        explicit ArchiveBatch( Archive* archive );
+        ~ArchiveBatch();
+
+        ArchiveBatch( const ArchiveBatch& ) = delete;
+        ArchiveBatch& operator=( const ArchiveBatch& ) = delete;
+
+        void Commit();
+
+    private:
+        Archive*                    m_pArchive;
+    };
+
+    // Lazily enumerates entries of the directory reading one directory block at a time.
+    // The archive must not be modified while the walk is in progress.
+    class XARCHIVE_API ArchiveWalker
+    {
+    public:
+        class Iterator
+        {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = ArchiveEntryInfo;
+            using difference_type = ptrdiff_t;
+            using pointer = const ArchiveEntryInfo*;
+            using reference = const ArchiveEntryInfo&;
+
+            explicit Iterator( ArchiveWalker* walker = nullptr );
+
+            reference operator*() const;
+            pointer operator->() const;
+            Iterator& operator++();
+            bool operator==( const Iterator& other ) const;
+            bool operator!=( const Iterator& other ) const;
+
+        private:
+            ArchiveWalker* m_pWalker;
+        };
+
+        ArchiveWalker( Archive* archive, uint64_t offset, std::string path, bool recursive, ArchiveWalkOrder order );
+
+        bool Next();
+        const ArchiveEntryInfo& Current() const;
+
+        Iterator begin();
+        Iterator end();
+
+    private:
+        struct Frame
+        {
+            Archive::PooledArchiveDirectory Directory;
+            uint32_t                Index;
+            std::string             Path;
+        };
+
+        Archive*                    m_pArchive;
+        bool                        m_Recursive;
+        ArchiveWalkOrder            m_Order;
+        std::deque<Frame>           m_Frames;
+        ArchiveEntryInfo            m_Current;
+    };
 }
@@ -1,135 +1,375 @@
 #include "xArchiveAllocator.h"
 #include "xArchiveHelpers.h"
+#include "xArchiveStats.h"
+#include "xArchiveTrace.h"
+#include <iterator>
 #include <system_error>
 
 namespace xArchive
 {
     ArchiveAllocator::ArchiveAllocator(
         Archive* archive,
-        uint32_t* allocationTable,
-        uint32_t allocationTableSize,
         uint32_t allocationSize,
+        uint32_t pageBlockCount,
+        uint32_t pageSize,
+        uint32_t slotPageCapacity,
         AllocatorCallbacks allocationCallbacks )
-        : m_pAllocationTable( allocationTable )
-        , m_AllocationTableSize( allocationTableSize )
+        : m_AllocationTable()
         , m_AllocationSize( allocationSize )
+        , m_AllocationBase( 0 )
+        , m_PageBlockCount( pageBlockCount )
+        , m_PageSize( pageSize )
         , m_pArchive( archive )
         , m_AllocationCallbacks( allocationCallbacks )
-        , m_AllocationBase( 0 )
+        , m_PageOffsets()
+        , m_DirtyPages()
+        , m_FullBlocks()
+        , m_EmptyBlocks()
+        , m_FirstFreeBlock( 0 )
+        , m_SlotPageCapacity( slotPageCapacity )
+        , m_SlotSectors()
+        , m_SlotPageOffsets()
+        , m_DirtySlotPages()
+        , m_SlotSectorIndices()
+        , m_PartialSlotSectors( CountTrailingZeros( MaxSlotSize / MinSlotSize ) + 1 )
     {
+        if( m_AllocationSize == 0 )
+            throw std::invalid_argument( "Invalid allocation size" );
     }
 
-    void ArchiveAllocator::SetAllocationBase( uint32_t base )
+    ArchiveAllocator::~ArchiveAllocator()
+    {
+    }
+
+    void ArchiveAllocator::SetAllocationBase( uint64_t base )
     {
         m_AllocationBase = base;
     }
 
-    uint32_t ArchiveAllocator::GetAllocationBase() const
+    uint64_t ArchiveAllocator::GetAllocationBase() const
     {
         return m_AllocationBase;
     }
 
-    uint32_t ArchiveAllocator::Allocate( uint32_t size )
+    uint32_t ArchiveAllocator::GetAllocationSize() const
     {
-        uint32_t allocationOffset = _Allocate( size );
+        return m_AllocationSize;
+    }
+
+    uint64_t ArchiveAllocator::Allocate( uint64_t size )
+    {
+        ArchiveTraceScope traceScope( "ArchiveAllocator::Allocate", "allocation" );
+
+        uint64_t allocationOffset = GetSlotSize( size )
+            ? _AllocateSlot( size )
+            : _Allocate( size );
 
         (m_pArchive->*m_AllocationCallbacks.pfnFlushAllocationTable)();
         return allocationOffset;
     }
 
-    uint32_t ArchiveAllocator::Reallocate( uint32_t offset, uint32_t oldSize, uint32_t newSize )
+    uint64_t ArchiveAllocator::Reallocate( uint64_t offset, uint64_t oldSize, uint64_t newSize )
     {
-        uint32_t allocationOffset = _Reallocate( offset, oldSize, newSize );
+        ArchiveTraceScope traceScope( "ArchiveAllocator::Reallocate", "allocation" );
+
+        uint64_t allocationOffset = _Reallocate( offset, oldSize, newSize );
 
         (m_pArchive->*m_AllocationCallbacks.pfnFlushAllocationTable)();
         return allocationOffset;
     }
 
-    void ArchiveAllocator::Free( uint32_t offset, uint32_t size )
+    void ArchiveAllocator::Free( uint64_t offset, uint64_t size )
     {
-        _Free( offset, size );
+        ArchiveTraceScope traceScope( "ArchiveAllocator::Free", "allocation" );
+
+        if( GetSlotSize( size ) )
+            _FreeSlot( offset, size );
+        else
+            _Free( offset, size );
 
         (m_pArchive->*m_AllocationCallbacks.pfnFlushAllocationTable)();
     }
 
-    uint32_t ArchiveAllocator::_Allocate( uint32_t bytesize )
+    void ArchiveAllocator::AllocateAt( uint64_t offset, uint64_t size )
+    {
+        const uint32_t sector = GetSector( offset );
+        const uint32_t sectorCount = _GetSectorCount( size );
+
+        ExpandTable( static_cast<uint64_t>(sector) + sectorCount );
+
+        if( !_AreSectorsFree( sector, sectorCount ) )
+            throw std::runtime_error( "Sectors already allocated" );
+
+        _AllocateAt( sector, sectorCount );
+
+        (m_pArchive->*m_AllocationCallbacks.pfnFlushAllocationTable)();
+    }
+
+    uint64_t ArchiveAllocator::AllocateAfter( uint64_t offset, uint64_t size )
+    {
+        ArchiveTraceScope traceScope( "ArchiveAllocator::AllocateAfter", "allocation" );
+
+        const uint32_t sectorCount = _GetSectorCount( size );
+
+        uint32_t sector = 0;
+
+        while( !_FindFreeSectorsAfter( sectorCount, GetSector( offset ), sector ) )
+            _AddPage();
+
+        _AllocateAt( sector, sectorCount );
+
+        (m_pArchive->*m_AllocationCallbacks.pfnFlushAllocationTable)();
+        return GetSectorOffset( sector );
+    }
+
+    void ArchiveAllocator::ExpandTable( uint64_t sectorCount )
+    {
+        while( GetTotalSectorCount() < sectorCount )
+            _AddPage();
+    }
+
+    uint32_t ArchiveAllocator::GetSector( uint64_t offset ) const
+    {
+        return static_cast<uint32_t>((offset - m_AllocationBase) / m_AllocationSize);
+    }
+
+    uint64_t ArchiveAllocator::GetSectorOffset( uint32_t sector ) const
+    {
+        return m_AllocationBase + static_cast<uint64_t>(sector) * m_AllocationSize;
+    }
+
+    uint32_t ArchiveAllocator::GetSectorCount( uint64_t size ) const
+    {
+        return _GetSectorCount( size );
+    }
+
+    uint64_t ArchiveAllocator::GetTotalSectorCount() const
+    {
+        return static_cast<uint64_t>(_GetTableSize()) * BitSizeOf<uint32_t>;
+    }
+
+    bool ArchiveAllocator::IsSectorAllocated( uint32_t sector ) const
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+
+        if( sector >= GetTotalSectorCount() )
+            return false;
+
+        return (m_AllocationTable[sector / blockSize] & (1u << (sector % blockSize))) != 0;
+    }
+
+    uint64_t ArchiveAllocator::GetAllocationEnd() const
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+
+        for( uint32_t block = _GetTableSize(); block > 0; --block )
+        {
+            const uint32_t allocated = m_AllocationTable[block - 1];
+
+            if( allocated != 0 )
+                return GetSectorOffset( block * blockSize - CountLeadingZeros( allocated ) );
+        }
+
+        return m_AllocationBase;
+    }
+
+    uint64_t ArchiveAllocator::GetFreeSectorCount() const
+    {
+        uint64_t allocatedSectors = 0;
+
+        for( uint32_t blockBits : m_AllocationTable )
+            allocatedSectors += PopCount( blockBits );
+
+        return static_cast<uint64_t>(m_AllocationTable.size()) * BitSizeOf<uint32_t> - allocatedSectors;
+    }
+
+    uint32_t ArchiveAllocator::GetSlotSize( uint64_t size ) const
     {
-        const uint32_t sectorsRequired =
-            (((bytesize - 1) / m_AllocationSize) + 1);
+        if( size > MaxSlotSize )
+            return 0;
 
-        const uint32_t blockSize =
-            static_cast<uint32_t>(BitSizeOfElement( m_pAllocationTable ));
+        uint32_t slotSize = MinSlotSize;
 
-        uint32_t sectorsFree = 0;
-        uint32_t sectorsFreeBlockOffset = 0;
-        uint32_t sectorsFreeSectorOffset = 0;
-        uint32_t currentSectorOffset = 0;
-        uint32_t currentBlockOffset = 0;
+        while( slotSize < size )
+            slotSize <<= 1;
 
-        while( currentBlockOffset < m_AllocationTableSize )
+        // Sharing the sector pays off only if at least 2 slots fit in it
+        return (2 * slotSize <= m_AllocationSize) ? slotSize : 0;
+    }
+
+    double ArchiveAllocator::GetFragmentation() const
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+
+        uint64_t freeSectors = 0;
+        uint64_t largestRun = 0;
+        uint64_t currentRun = 0;
+
+        for( uint32_t blockBits : m_AllocationTable )
         {
-            if( currentSectorOffset == blockSize )
+            if( blockBits == 0 )
             {
-                currentBlockOffset++;
-                currentSectorOffset = 0;
+                currentRun += blockSize;
+                freeSectors += blockSize;
+                largestRun = std::max( largestRun, currentRun );
+                continue;
             }
 
-            while( (currentSectorOffset < blockSize) &&
-                ((m_pAllocationTable[currentBlockOffset] & (1 << currentSectorOffset)) > 0) )
+            for( uint32_t bit = 0; bit < blockSize; ++bit )
             {
-                currentSectorOffset++;
+                if( blockBits & (1u << bit) )
+                {
+                    currentRun = 0;
+                    continue;
+                }
 
-                sectorsFree = 0;
-                sectorsFreeBlockOffset = currentBlockOffset;
-                sectorsFreeSectorOffset = currentSectorOffset;
+                freeSectors++;
+                currentRun++;
+                largestRun = std::max( largestRun, currentRun );
             }
+        }
 
-            while( currentSectorOffset < blockSize &&
-                (sectorsFree < sectorsRequired) &&
-                (m_pAllocationTable[currentBlockOffset] & (1 << currentSectorOffset)) == 0 )
-            {
-                currentSectorOffset++;
-                sectorsFree++;
-            }
+        if( freeSectors == 0 )
+            return 0.0;
 
-            if( sectorsFree == sectorsRequired )
-            {
-                uint32_t offset =
-                    m_AllocationBase
-                    + (sectorsFreeBlockOffset * blockSize + sectorsFreeSectorOffset) * m_AllocationSize;
+        return 1.0 - static_cast<double>(largestRun) / freeSectors;
+    }
 
-                currentSectorOffset = sectorsFreeSectorOffset;
-                currentBlockOffset = sectorsFreeBlockOffset;
+    void ArchiveAllocator::LoadPage( uint64_t offset, const uint32_t* blocks )
+    {
+        _AppendPage( offset );
 
-                // Update allocation table
-                for( uint32_t sector = 0; sector < sectorsRequired; ++sector, ++currentSectorOffset )
-                {
-                    if( currentSectorOffset == blockSize )
-                    {
-                        currentBlockOffset++;
-                        currentSectorOffset = 0;
-                    }
+        std::copy( blocks, blocks + m_PageBlockCount, m_AllocationTable.end() - m_PageBlockCount );
 
-                    m_pAllocationTable[currentBlockOffset] |= (1 << (currentSectorOffset));
-                }
+        m_DirtyPages.back() = false;
+    }
 
-                return offset;
-            }
+    void ArchiveAllocator::LoadSlotPage( uint64_t offset, const ArchiveSlotSector* slotSectors, uint32_t count )
+    {
+        m_SlotSectors.insert( m_SlotSectors.end(), slotSectors, slotSectors + count );
+
+        m_SlotPageOffsets.push_back( offset );
+        m_DirtySlotPages.push_back( false );
+    }
+
+    void ArchiveAllocator::Rebuild()
+    {
+        for( uint32_t block = 0; block < _GetTableSize(); ++block )
+            _UpdateSummary( block );
+
+        m_FirstFreeBlock = _GetNextNonFullBlock( 0 );
+
+        m_SlotSectorIndices.clear();
+
+        for( std::set<uint32_t>& partialSectors : m_PartialSlotSectors )
+            partialSectors.clear();
+
+        for( uint32_t index = 0; index < m_SlotSectors.size(); ++index )
+        {
+            const ArchiveSlotSector& slotSector = m_SlotSectors[index];
+
+            if( GetSlotSize( slotSector.SlotSize ) != slotSector.SlotSize )
+                throw std::runtime_error( "Invalid shared sector slot size" );
+
+            const uint32_t slotCount = _GetSlotsPerSector( slotSector.SlotSize );
+
+            m_SlotSectorIndices[slotSector.Sector] = index;
+
+            if( CountTrailingZeros64( ~slotSector.Occupancy ) < slotCount )
+                m_PartialSlotSectors[_GetSlotClass( slotSector.SlotSize )].insert( slotSector.Sector );
         }
+    }
 
-        throw std::runtime_error( "Out of memory" );
+    uint32_t ArchiveAllocator::GetPageCount() const
+    {
+        return static_cast<uint32_t>(m_PageOffsets.size());
     }
 
-    uint32_t ArchiveAllocator::_Reallocate( uint32_t offset, uint32_t oldSize, uint32_t newSize )
+    uint64_t ArchiveAllocator::GetPageOffset( uint32_t page ) const
     {
-        const uint32_t sectorsRequired =
-            (((newSize - 1) / m_AllocationSize) + 1);
+        return m_PageOffsets[page];
+    }
 
-        const uint32_t sectorsAllocated =
-            (((oldSize - 1) / m_AllocationSize) + 1);
+    const uint32_t* ArchiveAllocator::GetPageBlocks( uint32_t page ) const
+    {
+        return m_AllocationTable.data() + static_cast<size_t>(page) * m_PageBlockCount;
+    }
+
+    bool ArchiveAllocator::IsPageDirty( uint32_t page ) const
+    {
+        return m_DirtyPages[page];
+    }
+
+    uint32_t ArchiveAllocator::GetSlotPageCount() const
+    {
+        return static_cast<uint32_t>(m_SlotPageOffsets.size());
+    }
 
-        const uint32_t blockSize =
-            static_cast<uint32_t>(BitSizeOfElement( m_pAllocationTable ));
+    uint64_t ArchiveAllocator::GetSlotPageOffset( uint32_t page ) const
+    {
+        return m_SlotPageOffsets[page];
+    }
+
+    const ArchiveSlotSector* ArchiveAllocator::GetSlotPageSectors( uint32_t page, uint32_t& count ) const
+    {
+        const size_t first = static_cast<size_t>(page) * m_SlotPageCapacity;
+
+        count = static_cast<uint32_t>(std::min<size_t>( m_SlotPageCapacity, m_SlotSectors.size() - first ));
+        return m_SlotSectors.data() + first;
+    }
+
+    bool ArchiveAllocator::IsSlotPageDirty( uint32_t page ) const
+    {
+        return m_DirtySlotPages[page];
+    }
+
+    void ArchiveAllocator::ClearDirtyPages()
+    {
+        std::fill( m_DirtyPages.begin(), m_DirtyPages.end(), false );
+        std::fill( m_DirtySlotPages.begin(), m_DirtySlotPages.end(), false );
+    }
+
+    uint64_t ArchiveAllocator::_Allocate( uint64_t bytesize )
+    {
+        const uint32_t sectorsRequired = _GetSectorCount( bytesize );
+
+        uint32_t sector = 0;
+
+        while( !_FindFreeSectors( sectorsRequired, sector ) )
+            _AddPage();
+
+        _MarkSectors( sector, sectorsRequired, true );
+
+        return GetSectorOffset( sector );
+    }
+
+    uint64_t ArchiveAllocator::_Reallocate( uint64_t offset, uint64_t oldSize, uint64_t newSize )
+    {
+        const uint32_t oldSlotSize = GetSlotSize( oldSize );
+        const uint32_t newSlotSize = GetSlotSize( newSize );
+
+        if( oldSlotSize != 0 || newSlotSize != 0 )
+        {
+            // The slot is kept if the size class doesn't change, otherwise the data is moved
+            if( oldSlotSize == newSlotSize )
+                return offset;
+
+            uint64_t newAllocation = newSlotSize
+                ? _AllocateSlot( newSize )
+                : _Allocate( newSize );
+
+            (m_pArchive->*m_AllocationCallbacks.pfnReallocateEntry)(offset, newAllocation, std::min( oldSize, newSize ));
+
+            if( oldSlotSize )
+                _FreeSlot( offset, oldSize );
+            else
+                _Free( offset, oldSize );
+
+            return newAllocation;
+        }
+
+        const uint32_t sectorsRequired = _GetSectorCount( newSize );
+        const uint32_t sectorsAllocated = _GetSectorCount( oldSize );
 
         if( sectorsRequired > sectorsAllocated )
         {
@@ -138,7 +378,7 @@ namespace xArchive
 
             if( needsReallocation )
             {
-                uint32_t newAllocation = _Allocate( newSize );
+                uint64_t newAllocation = _Allocate( newSize );
 
                 (m_pArchive->*m_AllocationCallbacks.pfnReallocateEntry)(offset, newAllocation, oldSize);
 
@@ -155,126 +395,677 @@ namespace xArchive
         return offset;
     }
 
-    void ArchiveAllocator::_ShrinkAllocation( uint32_t offset, uint32_t oldSize, uint32_t newSize )
+    void ArchiveAllocator::_ShrinkAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize )
+    {
+        const uint32_t sectorsRequired = _GetSectorCount( newSize );
+        const uint32_t sectorsAllocated = _GetSectorCount( oldSize );
+
+        _MarkSectors( GetSector( offset ) + sectorsRequired, sectorsAllocated - sectorsRequired, false );
+    }
+
+    bool ArchiveAllocator::_ExpandAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize )
     {
-        const uint32_t sectorsRequired =
-            (((newSize - 1) / m_AllocationSize) + 1);
+        const uint32_t sectorsRequired = _GetSectorCount( newSize );
+        const uint32_t sectorsAllocated = _GetSectorCount( oldSize );
 
-        const uint32_t sectorsAllocated =
-            (((oldSize - 1) / m_AllocationSize) + 1);
+        const uint32_t firstNewSector = GetSector( offset ) + sectorsAllocated;
 
-        const uint32_t blockSize =
-            static_cast<uint32_t>(BitSizeOfElement( m_pAllocationTable ));
+        // Check if the allocation may be expanded
+        if( !_AreSectorsFree( firstNewSector, sectorsRequired - sectorsAllocated ) )
+            return false;
 
-        uint32_t currentSector = sectorsRequired;
+        _MarkSectors( firstNewSector, sectorsRequired - sectorsAllocated, true );
+        return true;
+    }
 
-        uint32_t currentSectorOffset =
-            (offset + sectorsRequired * m_AllocationSize) % blockSize;
+    void ArchiveAllocator::_Free( uint64_t offset, uint64_t size )
+    {
+        _MarkSectors( GetSector( offset ), _GetSectorCount( size ), false );
+    }
 
-        uint32_t currentBlockOffset =
-            (offset + sectorsRequired * m_AllocationSize) / blockSize;
+    void ArchiveAllocator::_SectorsAdded( uint32_t, uint32_t )
+    {
+    }
 
-        while( currentSector < sectorsAllocated )
+    void ArchiveAllocator::_AllocateAt( uint32_t sector, uint32_t sectorCount )
+    {
+        _MarkSectors( sector, sectorCount, true );
+    }
+
+    uint32_t ArchiveAllocator::_GetTableSize() const
+    {
+        return static_cast<uint32_t>(m_AllocationTable.size());
+    }
+
+    uint32_t ArchiveAllocator::_GetSectorCount( uint64_t size ) const
+    {
+        const uint64_t sectorCount = (size + m_AllocationSize - 1) / m_AllocationSize;
+
+        if( sectorCount >= MaxSectorCount )
+            throw std::runtime_error( "Out of memory" );
+
+        // Even empty allocations occupy one sector to get unique offset
+        return std::max<uint32_t>( 1, static_cast<uint32_t>(sectorCount) );
+    }
+
+    bool ArchiveAllocator::_FindFreeSectors( uint32_t sectorsRequired, uint32_t& sector ) const
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+        const uint32_t tableSize = _GetTableSize();
+
+        // Free run which may continue in the following blocks
+        uint32_t runSector = 0;
+        uint64_t runLength = 0;
+
+        uint32_t block = m_FirstFreeBlock;
+        ArchiveScopedCounter blocksScanned( ArchiveCounter::eAllocationBlocksScanned );
+
+        while( block < tableSize )
         {
-            if( currentSectorOffset == blockSize )
+            const uint32_t allocated = m_AllocationTable[block];
+            blocksScanned += 1;
+
+            if( allocated == ~0u )
+            {
+                // Skip all fully allocated blocks at once
+                runLength = 0;
+                block = _GetNextNonFullBlock( block + 1 );
+                continue;
+            }
+
+            if( runLength == 0 )
+                runSector = block * blockSize;
+
+            if( allocated == 0 )
+            {
+                const uint32_t emptyBlocks = _GetEmptyBlockRunLength( block );
+
+                runLength += static_cast<uint64_t>(emptyBlocks) * blockSize;
+                block += emptyBlocks;
+
+                if( runLength >= sectorsRequired )
+                {
+                    sector = runSector;
+                    return true;
+                }
+
+                continue;
+            }
+
+            // Free sectors at the beginning of the block extend the current run
+            if( runLength + CountTrailingZeros( allocated ) >= sectorsRequired )
             {
-                currentBlockOffset++;
-                currentSectorOffset = 0;
+                sector = runSector;
+                return true;
             }
 
-            m_pAllocationTable[currentBlockOffset] &= ~(1 << currentSectorOffset);
+            if( sectorsRequired < blockSize )
+            {
+                // Each iteration extends the length of free runs marked in the mask
+                uint32_t runs = ~allocated;
+                uint32_t length = 1;
+
+                while( runs && length < sectorsRequired )
+                {
+                    const uint32_t shift = std::min( length, sectorsRequired - length );
+                    runs &= runs >> shift;
+                    length += shift;
+                }
+
+                if( runs )
+                {
+                    sector = block * blockSize + CountTrailingZeros( runs );
+                    return true;
+                }
+            }
 
-            currentSectorOffset++;
-            currentSector++;
+            // Free sectors at the end of the block start a new run
+            runLength = CountLeadingZeros( allocated );
+            runSector = (block + 1) * blockSize - static_cast<uint32_t>(runLength);
+            block++;
         }
+
+        return false;
     }
 
-    bool ArchiveAllocator::_ExpandAllocation( uint32_t offset, uint32_t oldSize, uint32_t newSize )
+    bool ArchiveAllocator::_FindFreeSectorsAfter( uint32_t sectorsRequired, uint32_t firstSector, uint32_t& sector ) const
     {
-        const uint32_t sectorsRequired =
-            (((newSize - 1) / m_AllocationSize) + 1);
-
-        const uint32_t sectorsAllocated =
-            (((oldSize - 1) / m_AllocationSize) + 1);
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+        const uint64_t sectorCount = GetTotalSectorCount();
 
-        const uint32_t blockSize =
-            static_cast<uint32_t>(BitSizeOfElement( m_pAllocationTable ));
+        uint64_t runSector = firstSector;
+        uint64_t runLength = 0;
 
-        uint32_t currentSector = sectorsAllocated;
+        uint64_t current = firstSector;
+        ArchiveScopedCounter blocksScanned( ArchiveCounter::eAllocationBlocksScanned );
 
-        uint32_t currentSectorOffset =
-            (offset + sectorsAllocated * m_AllocationSize) % blockSize;
+        while( current < sectorCount )
+        {
+            const uint32_t block = static_cast<uint32_t>(current / blockSize);
+            const uint32_t bit = static_cast<uint32_t>(current % blockSize);
+            const uint32_t allocated = m_AllocationTable[block];
+            blocksScanned += 1;
 
-        uint32_t currentBlockOffset =
-            (offset + sectorsAllocated * m_AllocationSize) / blockSize;
+            if( bit == 0 && allocated == ~0u )
+            {
+                // Whole blocks are skipped at once
+                runLength = 0;
+                current += blockSize;
+            }
+            else if( bit == 0 && allocated == 0 )
+            {
+                if( runLength == 0 )
+                    runSector = current;
 
-        // Check if the allocation may be expanded
-        while( currentSector < sectorsRequired )
-        {
-            if( currentSectorOffset == blockSize )
+                runLength += blockSize;
+                current += blockSize;
+            }
+            else if( allocated & (1u << bit) )
             {
-                currentBlockOffset++;
-                currentSectorOffset = 0;
+                runLength = 0;
+                current++;
+            }
+            else
+            {
+                if( runLength == 0 )
+                    runSector = current;
+
+                runLength++;
+                current++;
             }
 
-            if( m_pAllocationTable[currentBlockOffset] & (1 << currentSectorOffset) )
+            if( runLength >= sectorsRequired )
             {
-                // Cannot expand the allocation
+                sector = static_cast<uint32_t>(runSector);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool ArchiveAllocator::_AreSectorsFree( uint32_t sector, uint32_t sectorCount ) const
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+
+        if( static_cast<uint64_t>(sector) + sectorCount > static_cast<uint64_t>(_GetTableSize()) * blockSize )
+            return false;
+
+        uint32_t block = sector / blockSize;
+        uint32_t bit = sector % blockSize;
+
+        while( sectorCount > 0 )
+        {
+            const uint32_t count = std::min( sectorCount, blockSize - bit );
+            const uint32_t mask = (count == blockSize) ? ~0u : (((1u << count) - 1) << bit);
+
+            if( m_AllocationTable[block] & mask )
                 return false;
+
+            sectorCount -= count;
+            block++;
+            bit = 0;
+        }
+
+        return true;
+    }
+
+    void ArchiveAllocator::_MarkSectors( uint32_t sector, uint32_t sectorCount, bool allocated )
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+
+        uint32_t block = sector / blockSize;
+        uint32_t bit = sector % blockSize;
+
+        if( !allocated )
+            m_FirstFreeBlock = std::min( m_FirstFreeBlock, block );
+
+        while( sectorCount > 0 )
+        {
+            const uint32_t count = std::min( sectorCount, blockSize - bit );
+            const uint32_t mask = (count == blockSize) ? ~0u : (((1u << count) - 1) << bit);
+
+            if( allocated )
+                m_AllocationTable[block] |= mask;
+            else
+                m_AllocationTable[block] &= ~mask;
+
+            _UpdateSummary( block );
+            m_DirtyPages[block / m_PageBlockCount] = true;
+
+            sectorCount -= count;
+            block++;
+            bit = 0;
+        }
+
+        if( allocated )
+            m_FirstFreeBlock = _GetNextNonFullBlock( m_FirstFreeBlock );
+    }
+
+    uint32_t ArchiveAllocator::_GetNextNonFullBlock( uint32_t block ) const
+    {
+        const uint32_t tableSize = _GetTableSize();
+
+        while( block < tableSize )
+        {
+            const uint32_t nonFull = ~m_FullBlocks[block / 32] >> (block % 32);
+
+            if( nonFull )
+                return std::min( block + CountTrailingZeros( nonFull ), tableSize );
+
+            block = (block / 32 + 1) * 32;
+        }
+
+        return tableSize;
+    }
+
+    uint32_t ArchiveAllocator::_GetEmptyBlockRunLength( uint32_t block ) const
+    {
+        const uint32_t tableSize = _GetTableSize();
+
+        uint32_t length = 0;
+
+        while( block < tableSize )
+        {
+            const uint32_t bit = block % 32;
+            const uint32_t empty = CountTrailingZeros( ~(m_EmptyBlocks[block / 32] >> bit) );
+
+            length += std::min( empty, 32 - bit );
+            block += std::min( empty, 32 - bit );
+
+            if( empty < 32 - bit )
+                break;
+        }
+
+        return length;
+    }
+
+    void ArchiveAllocator::_UpdateSummary( uint32_t block )
+    {
+        const uint32_t mask = 1u << (block % 32);
+
+        if( m_AllocationTable[block] == ~0u )
+            m_FullBlocks[block / 32] |= mask;
+        else
+            m_FullBlocks[block / 32] &= ~mask;
+
+        if( m_AllocationTable[block] == 0 )
+            m_EmptyBlocks[block / 32] |= mask;
+        else
+            m_EmptyBlocks[block / 32] &= ~mask;
+    }
+
+    void ArchiveAllocator::_AppendPage( uint64_t offset )
+    {
+        const uint32_t firstBlock = _GetTableSize();
+
+        m_AllocationTable.resize( m_AllocationTable.size() + m_PageBlockCount, 0 );
+        m_FullBlocks.resize( (m_AllocationTable.size() + 31) / 32, 0 );
+        m_EmptyBlocks.resize( (m_AllocationTable.size() + 31) / 32, 0 );
+
+        for( uint32_t block = firstBlock; block < _GetTableSize(); ++block )
+            _UpdateSummary( block );
+
+        m_PageOffsets.push_back( offset );
+        m_DirtyPages.push_back( true );
+    }
+
+    void ArchiveAllocator::_AddPage()
+    {
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+
+        const uint64_t sectorCount = static_cast<uint64_t>(_GetTableSize()) * blockSize;
+        const uint32_t pageSectorCount = m_PageBlockCount * blockSize;
+
+        if( sectorCount + pageSectorCount >= MaxSectorCount )
+            throw std::runtime_error( "Out of memory" );
+
+        _AppendPage( 0 );
+        _SectorsAdded( static_cast<uint32_t>(sectorCount), pageSectorCount );
+
+        // The page is stored in the space it describes or any hole found earlier
+        const uint64_t pageOffset = _Allocate( m_PageSize );
+
+        m_PageOffsets.back() = pageOffset;
+
+        if( m_PageOffsets.size() > 1 )
+        {
+            // Link to the new page has to be written to the previous page
+            m_DirtyPages[m_PageOffsets.size() - 2] = true;
+        }
+    }
+
+    uint64_t ArchiveAllocator::_AllocateSlot( uint64_t size )
+    {
+        const uint32_t slotSize = GetSlotSize( size );
+
+        std::set<uint32_t>& partialSectors = m_PartialSlotSectors[_GetSlotClass( slotSize )];
+
+        if( partialSectors.empty() )
+        {
+            const uint32_t newSector = GetSector( _Allocate( m_AllocationSize ) );
+
+            _InsertSlotSector( newSector, slotSize );
+            partialSectors.insert( newSector );
+        }
+
+        // Shared sectors at the lowest offsets are filled first
+        const uint32_t sector = *partialSectors.begin();
+        const uint32_t index = m_SlotSectorIndices.at( sector );
+
+        ArchiveSlotSector& slotSector = m_SlotSectors[index];
+
+        const uint32_t slot = CountTrailingZeros64( ~slotSector.Occupancy );
+        const uint32_t slotCount = _GetSlotsPerSector( slotSize );
+
+        slotSector.Occupancy |= uint64_t( 1 ) << slot;
+        _MarkSlotSector( index );
+
+        // No free slot below the slot count of the sector
+        if( CountTrailingZeros64( ~slotSector.Occupancy ) >= slotCount )
+            partialSectors.erase( sector );
+
+        return GetSectorOffset( sector ) + static_cast<uint64_t>(slot) * slotSize;
+    }
+
+    void ArchiveAllocator::_FreeSlot( uint64_t offset, uint64_t size )
+    {
+        const uint32_t slotSize = GetSlotSize( size );
+        const uint32_t sector = GetSector( offset );
+        const uint32_t slot = static_cast<uint32_t>((offset - GetSectorOffset( sector )) / slotSize);
+
+        auto slotSectorIndex = m_SlotSectorIndices.find( sector );
+
+        if( slotSectorIndex == m_SlotSectorIndices.end() || m_SlotSectors[slotSectorIndex->second].SlotSize != slotSize )
+            throw std::invalid_argument( "Invalid shared sector allocation" );
+
+        const uint32_t index = slotSectorIndex->second;
+
+        std::set<uint32_t>& partialSectors = m_PartialSlotSectors[_GetSlotClass( slotSize )];
+
+        m_SlotSectors[index].Occupancy &= ~(uint64_t( 1 ) << slot);
+
+        if( m_SlotSectors[index].Occupancy != 0 )
+        {
+            partialSectors.insert( sector );
+            _MarkSlotSector( index );
+            return;
+        }
+
+        // Return empty shared sector to the allocation table
+        partialSectors.erase( sector );
+        _RemoveSlotSector( index );
+        _Free( GetSectorOffset( sector ), m_AllocationSize );
+    }
+
+    uint32_t ArchiveAllocator::_GetSlotClass( uint32_t slotSize ) const
+    {
+        return CountTrailingZeros( slotSize ) - CountTrailingZeros( MinSlotSize );
+    }
+
+    uint32_t ArchiveAllocator::_GetSlotsPerSector( uint32_t slotSize ) const
+    {
+        return std::min( MaxSlotsPerSector, m_AllocationSize / slotSize );
+    }
+
+    void ArchiveAllocator::_InsertSlotSector( uint32_t sector, uint32_t slotSize )
+    {
+        if( m_SlotSectors.size() == m_SlotPageOffsets.size() * m_SlotPageCapacity )
+        {
+            const uint64_t pageOffset = _Allocate( m_PageSize );
+
+            if( !m_DirtySlotPages.empty() )
+            {
+                // Link to the new page has to be written to the previous page
+                m_DirtySlotPages.back() = true;
             }
 
-            currentSectorOffset++;
-            currentSector++;
+            m_SlotPageOffsets.push_back( pageOffset );
+            m_DirtySlotPages.push_back( true );
         }
 
-        currentSector = sectorsAllocated;
+        m_SlotSectorIndices[sector] = static_cast<uint32_t>(m_SlotSectors.size());
+        m_SlotSectors.push_back( ArchiveSlotSector{ sector, slotSize, 0 } );
+
+        _MarkSlotSector( static_cast<uint32_t>(m_SlotSectors.size() - 1) );
+    }
 
-        currentSectorOffset =
-            (offset + sectorsAllocated * m_AllocationSize) % blockSize;
+    void ArchiveAllocator::_RemoveSlotSector( uint32_t index )
+    {
+        const uint32_t last = static_cast<uint32_t>(m_SlotSectors.size() - 1);
 
-        currentBlockOffset =
-            (offset + sectorsAllocated * m_AllocationSize) / blockSize;
+        m_SlotSectorIndices.erase( m_SlotSectors[index].Sector );
 
-        // Expand the allocation
-        while( currentSector < sectorsRequired )
+        if( index != last )
         {
-            if( currentSectorOffset == blockSize )
+            // Keep the records packed, the last one takes place of the removed one
+            m_SlotSectors[index] = m_SlotSectors[last];
+            m_SlotSectorIndices[m_SlotSectors[index].Sector] = index;
+            _MarkSlotSector( index );
+        }
+
+        m_SlotSectors.pop_back();
+        _MarkSlotSector( last );
+
+        if( m_SlotSectors.size() <= (m_SlotPageOffsets.size() - 1) * m_SlotPageCapacity )
+        {
+            _Free( m_SlotPageOffsets.back(), m_PageSize );
+
+            m_SlotPageOffsets.pop_back();
+            m_DirtySlotPages.pop_back();
+
+            if( !m_DirtySlotPages.empty() )
+                m_DirtySlotPages.back() = true;
+        }
+    }
+
+    void ArchiveAllocator::_MarkSlotSector( uint32_t index )
+    {
+        m_DirtySlotPages[index / m_SlotPageCapacity] = true;
+    }
+
+
+    ArchiveExtentAllocator::ArchiveExtentAllocator(
+        Archive* archive,
+        uint32_t allocationSize,
+        uint32_t pageBlockCount,
+        uint32_t pageSize,
+        uint32_t slotPageCapacity,
+        AllocatorCallbacks allocationCallbacks )
+        : ArchiveAllocator( archive, allocationSize, pageBlockCount, pageSize, slotPageCapacity, allocationCallbacks )
+        , m_FreeExtents()
+        , m_FreeExtentsBySize()
+        , m_FreeSectorCount( 0 )
+    {
+    }
+
+    uint64_t ArchiveExtentAllocator::GetFreeSectorCount() const
+    {
+        return m_FreeSectorCount;
+    }
+
+    double ArchiveExtentAllocator::GetFragmentation() const
+    {
+        if( m_FreeSectorCount == 0 )
+            return 0.0;
+
+        return 1.0 - static_cast<double>(m_FreeExtentsBySize.rbegin()->first) / m_FreeSectorCount;
+    }
+
+    void ArchiveExtentAllocator::Rebuild()
+    {
+        ArchiveAllocator::Rebuild();
+
+        const uint32_t blockSize = BitSizeOf<uint32_t>;
+        const uint64_t sectorCount = static_cast<uint64_t>(_GetTableSize()) * blockSize;
+
+        m_FreeExtents.clear();
+        m_FreeExtentsBySize.clear();
+        m_FreeSectorCount = 0;
+
+        // Rebuild free extents from the allocation table
+        uint64_t sector = 0;
+
+        while( sector < sectorCount )
+        {
+            const uint32_t block = static_cast<uint32_t>(sector / blockSize);
+            const uint32_t bit = static_cast<uint32_t>(sector % blockSize);
+
+            const uint32_t allocated = m_AllocationTable[block] >> bit;
+            const uint32_t freeSectors = std::min( CountTrailingZeros( allocated ), blockSize - bit );
+
+            if( freeSectors == 0 )
             {
-                currentBlockOffset++;
-                currentSectorOffset = 0;
+                // Skip allocated sectors
+                sector += std::min( CountTrailingZeros( ~allocated ), blockSize - bit );
+                continue;
             }
 
-            m_pAllocationTable[currentBlockOffset] |= (1 << currentSectorOffset);
+            auto last = m_FreeExtents.empty() ? m_FreeExtents.end() : std::prev( m_FreeExtents.end() );
+
+            if( last != m_FreeExtents.end() && last->first + last->second == sector )
+                last->second += freeSectors;
+            else
+                m_FreeExtents.emplace( static_cast<uint32_t>(sector), freeSectors );
 
-            currentSectorOffset++;
-            currentSector++;
+            m_FreeSectorCount += freeSectors;
+            sector += freeSectors;
         }
 
+        for( const auto& extent : m_FreeExtents )
+            m_FreeExtentsBySize.emplace( extent.second, extent.first );
+    }
+
+    uint64_t ArchiveExtentAllocator::_Allocate( uint64_t bytesize )
+    {
+        const uint32_t sectorsRequired = _GetSectorCount( bytesize );
+
+        // Best fit: the smallest extent which is large enough, lowest offset on ties
+        auto fit = m_FreeExtentsBySize.lower_bound( std::make_pair( sectorsRequired, 0u ) );
+
+        while( fit == m_FreeExtentsBySize.end() )
+        {
+            _AddPage();
+            fit = m_FreeExtentsBySize.lower_bound( std::make_pair( sectorsRequired, 0u ) );
+        }
+
+        const uint32_t sector = fit->second;
+
+        _ReserveSectors( m_FreeExtents.find( sector ), sector, sectorsRequired );
+        _MarkSectors( sector, sectorsRequired, true );
+
+        return GetSectorOffset( sector );
+    }
+
+    void ArchiveExtentAllocator::_ShrinkAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize )
+    {
+        const uint32_t sectorsRequired = _GetSectorCount( newSize );
+        const uint32_t sectorsAllocated = _GetSectorCount( oldSize );
+
+        const uint32_t firstFreedSector = GetSector( offset ) + sectorsRequired;
+
+        _MarkSectors( firstFreedSector, sectorsAllocated - sectorsRequired, false );
+        _InsertExtent( firstFreedSector, sectorsAllocated - sectorsRequired );
+    }
+
+    bool ArchiveExtentAllocator::_ExpandAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize )
+    {
+        const uint32_t sectorsRequired = _GetSectorCount( newSize );
+        const uint32_t sectorsAllocated = _GetSectorCount( oldSize );
+
+        const uint32_t firstNewSector = GetSector( offset ) + sectorsAllocated;
+
+        // Free space right after the allocation always starts its own extent
+        auto extent = m_FreeExtents.find( firstNewSector );
+
+        if( extent == m_FreeExtents.end() || extent->second < sectorsRequired - sectorsAllocated )
+            return false;
+
+        _ReserveSectors( extent, firstNewSector, sectorsRequired - sectorsAllocated );
+        _MarkSectors( firstNewSector, sectorsRequired - sectorsAllocated, true );
+
         return true;
     }
 
-    void ArchiveAllocator::_Free( uint32_t offset, uint32_t size )
+    void ArchiveExtentAllocator::_Free( uint64_t offset, uint64_t size )
+    {
+        const uint32_t sector = GetSector( offset );
+        const uint32_t sectorCount = _GetSectorCount( size );
+
+        _MarkSectors( sector, sectorCount, false );
+        _InsertExtent( sector, sectorCount );
+    }
+
+    void ArchiveExtentAllocator::_SectorsAdded( uint32_t sector, uint32_t sectorCount )
     {
-        const uint32_t blockSize =
-            static_cast<uint32_t>(BitSizeOfElement( m_pAllocationTable ));
+        _InsertExtent( sector, sectorCount );
+    }
+
+    void ArchiveExtentAllocator::_AllocateAt( uint32_t sector, uint32_t sectorCount )
+    {
+        // Free sectors always belong to the extent starting at or before them
+        auto extent = std::prev( m_FreeExtents.upper_bound( sector ) );
 
-        uint32_t blockOffset = offset / blockSize;
-        uint32_t segmentOffset = offset % blockSize;
+        _ReserveSectors( extent, sector, sectorCount );
+        _MarkSectors( sector, sectorCount, true );
+    }
+
+    void ArchiveExtentAllocator::_InsertExtent( uint32_t sector, uint32_t sectorCount )
+    {
+        m_FreeSectorCount += sectorCount;
 
-        uint32_t allocationSize = (((size - 1) / m_AllocationSize) + 1);
+        // Coalesce with the neighbouring extents
+        auto next = m_FreeExtents.lower_bound( sector );
 
-        while( allocationSize > 0 )
+        if( next != m_FreeExtents.begin() )
         {
-            if( segmentOffset == blockSize )
+            auto prev = std::prev( next );
+
+            if( prev->first + prev->second == sector )
             {
-                blockOffset++;
-                segmentOffset = 0;
+                sector = prev->first;
+                sectorCount += prev->second;
+                _EraseExtent( prev );
             }
+        }
+
+        if( next != m_FreeExtents.end() && sector + sectorCount == next->first )
+        {
+            sectorCount += next->second;
+            _EraseExtent( next );
+        }
+
+        m_FreeExtents.emplace( sector, sectorCount );
+        m_FreeExtentsBySize.emplace( sectorCount, sector );
+    }
+
+    void ArchiveExtentAllocator::_EraseExtent( FreeExtentMap::iterator extent )
+    {
+        m_FreeExtentsBySize.erase( std::make_pair( extent->second, extent->first ) );
+        m_FreeExtents.erase( extent );
+    }
+
+    void ArchiveExtentAllocator::_ReserveSectors( FreeExtentMap::iterator extent, uint32_t sector, uint32_t sectorCount )
+    {
+        const uint32_t extentSector = extent->first;
+        const uint32_t extentEnd = extent->first + extent->second;
 
-            m_pAllocationTable[blockOffset] &= ~(1 << segmentOffset);
+        _EraseExtent( extent );
 
-            segmentOffset++;
-            allocationSize--;
+        // Return the remaining head and tail of the extent
+        if( extentSector < sector )
+        {
+            m_FreeExtents.emplace( extentSector, sector - extentSector );
+            m_FreeExtentsBySize.emplace( sector - extentSector, extentSector );
+        }
+
+        if( sector + sectorCount < extentEnd )
+        {
+            m_FreeExtents.emplace( sector + sectorCount, extentEnd - sector - sectorCount );
+            m_FreeExtentsBySize.emplace( extentEnd - sector - sectorCount, sector + sectorCount );
         }
+
+        m_FreeSectorCount -= sectorCount;
     }
+
 }
@@ -1,15 +1,19 @@
 #pragma once
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 namespace xArchive
 {
     class Archive;
 
     using PFNREALLOCATEENTRY = void(Archive::*)(
-        uint32_t oldOffset,
-        uint32_t newOffset,
-        uint32_t size);
+        uint64_t oldOffset,
+        uint64_t newOffset,
+        uint64_t size);
 
     using PFNFLUSHALLOCATIONTABLE = void(Archive::*)();
 
@@ -19,35 +23,195 @@ namespace xArchive
         PFNFLUSHALLOCATIONTABLE pfnFlushAllocationTable;
     };
 
+    enum class ArchiveAllocatorType : uint32_t
+    {
+        // First-fit search over the allocation table bitmap
+        eBitmap,
+        // Best-fit search over free extents indexed by offset and size
+        eExtent
+    };
+
+    // Shared sector carved into equal slots for allocations smaller than the sector.
+    struct ArchiveSlotSector
+    {
+        uint32_t                Sector;
+        uint32_t                SlotSize;
+        uint64_t                Occupancy;
+    };
+
+    // Allocation table records each allocation unit (sector) with 1 bit. The table is split
+    // into pages of fixed number of blocks, which are stored in the archive itself and added
+    // on demand when there is no free space left, so the archive grows as needed.
     class ArchiveAllocator
     {
     public:
+        // Sectors are addressed with 32-bit indices.
+        static constexpr uint64_t MaxSectorCount = uint64_t( 1 ) << 32;
+
+        // Allocations up to half of the sector are packed into shared sectors
+        // with slots of power-of-two size classes.
+        static constexpr uint32_t MinSlotSize = 64;
+        static constexpr uint32_t MaxSlotSize = 2048;
+        static constexpr uint32_t MaxSlotsPerSector = 64;
+
         ArchiveAllocator(
             Archive* archive,
-            uint32_t* allocationTable,
-            uint32_t allocationTableSize,
             uint32_t allocationSize,
+            uint32_t pageBlockCount,
+            uint32_t pageSize,
+            uint32_t slotPageCapacity,
             AllocatorCallbacks callbacks );
 
-        void     SetAllocationBase( uint32_t base );
-        uint32_t GetAllocationBase() const;
-        uint32_t Allocate( uint32_t size );
-        uint32_t Reallocate( uint32_t offset, uint32_t oldSize, uint32_t newSize );
-        void     Free( uint32_t offset, uint32_t size );
+        virtual ~ArchiveAllocator();
+
+        void     SetAllocationBase( uint64_t base );
+        uint64_t GetAllocationBase() const;
+        uint32_t GetAllocationSize() const;
+        uint64_t Allocate( uint64_t size );
+        uint64_t Reallocate( uint64_t offset, uint64_t oldSize, uint64_t newSize );
+        void     Free( uint64_t offset, uint64_t size );
+
+        // Sector allocations at the given offset or at the first free space after it.
+        // Used to move the data when compacting the archive.
+        void     AllocateAt( uint64_t offset, uint64_t size );
+        uint64_t AllocateAfter( uint64_t offset, uint64_t size );
+        void     ExpandTable( uint64_t sectorCount );
+
+        uint32_t GetSector( uint64_t offset ) const;
+        uint32_t GetSectorCount( uint64_t size ) const;
+        uint64_t GetTotalSectorCount() const;
+        bool     IsSectorAllocated( uint32_t sector ) const;
+
+        // Returns offset right after the last allocated sector.
+        uint64_t GetAllocationEnd() const;
+        uint64_t GetSectorOffset( uint32_t sector ) const;
+        virtual uint64_t GetFreeSectorCount() const;
+
+        // Returns size of the slot used for allocation of the given size, 0 if the
+        // allocation takes whole sectors.
+        uint32_t GetSlotSize( uint64_t size ) const;
+
+        // Returns 0 when all free space is contiguous, approaches 1 as it gets split
+        // into many small runs (1 - largest free run / total free space).
+        virtual double GetFragmentation() const;
+
+        // Appends allocation table page read from the archive. Rebuild must be called
+        // after all pages have been loaded.
+        void     LoadPage( uint64_t offset, const uint32_t* blocks );
+        void     LoadSlotPage( uint64_t offset, const ArchiveSlotSector* slotSectors, uint32_t count );
+        virtual void Rebuild();
+
+        uint32_t GetPageCount() const;
+        uint64_t GetPageOffset( uint32_t page ) const;
+        const uint32_t* GetPageBlocks( uint32_t page ) const;
+        bool     IsPageDirty( uint32_t page ) const;
+
+        // Shared sectors are persisted in pages of slotPageCapacity records.
+        uint32_t GetSlotPageCount() const;
+        uint64_t GetSlotPageOffset( uint32_t page ) const;
+        const ArchiveSlotSector* GetSlotPageSectors( uint32_t page, uint32_t& count ) const;
+        bool     IsSlotPageDirty( uint32_t page ) const;
+
+        void     ClearDirtyPages();
 
     protected:
-        uint32_t* m_pAllocationTable;
-        uint32_t  m_AllocationTableSize;
+        std::vector<uint32_t> m_AllocationTable;
         uint32_t  m_AllocationSize;
-        uint32_t  m_AllocationBase;
+        uint64_t  m_AllocationBase;
+        uint32_t  m_PageBlockCount;
+        uint32_t  m_PageSize;
         Archive* m_pArchive;
         AllocatorCallbacks m_AllocationCallbacks;
 
-        uint32_t _Allocate( uint32_t size );
-        uint32_t _Reallocate( uint32_t offset, uint32_t oldSize, uint32_t newSize );
-        void     _ShrinkAllocation( uint32_t offset, uint32_t oldSize, uint32_t newSize );
-        bool     _ExpandAllocation( uint32_t offset, uint32_t oldSize, uint32_t newSize );
-        void     _Free( uint32_t offset, uint32_t size );
+        std::vector<uint64_t> m_PageOffsets;
+        std::vector<bool> m_DirtyPages;
+
+        // Summary bitmaps with one bit per allocation table block,
+        // set when the block is fully allocated or fully free respectively.
+        std::vector<uint32_t> m_FullBlocks;
+        std::vector<uint32_t> m_EmptyBlocks;
+
+        // All blocks before this one are fully allocated.
+        uint32_t  m_FirstFreeBlock;
+
+        uint32_t  m_SlotPageCapacity;
+        std::vector<ArchiveSlotSector> m_SlotSectors;
+        std::vector<uint64_t> m_SlotPageOffsets;
+        std::vector<bool> m_DirtySlotPages;
+
+        // Sector -> index in m_SlotSectors
+        std::unordered_map<uint32_t, uint32_t> m_SlotSectorIndices;
+        // Shared sectors with free slots, per size class
+        std::vector<std::set<uint32_t>> m_PartialSlotSectors;
+
+        virtual uint64_t _Allocate( uint64_t size );
+        uint64_t _Reallocate( uint64_t offset, uint64_t oldSize, uint64_t newSize );
+        virtual void _ShrinkAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize );
+        virtual bool _ExpandAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize );
+        virtual void _Free( uint64_t offset, uint64_t size );
+        virtual void _SectorsAdded( uint32_t sector, uint32_t sectorCount );
+        virtual void _AllocateAt( uint32_t sector, uint32_t sectorCount );
+
+        uint32_t _GetTableSize() const;
+        uint32_t _GetSectorCount( uint64_t size ) const;
+        bool     _FindFreeSectors( uint32_t sectorCount, uint32_t& sector ) const;
+        bool     _FindFreeSectorsAfter( uint32_t sectorCount, uint32_t firstSector, uint32_t& sector ) const;
+        bool     _AreSectorsFree( uint32_t sector, uint32_t sectorCount ) const;
+        void     _MarkSectors( uint32_t sector, uint32_t sectorCount, bool allocated );
+        uint32_t _GetNextNonFullBlock( uint32_t block ) const;
+        uint32_t _GetEmptyBlockRunLength( uint32_t block ) const;
+        void     _UpdateSummary( uint32_t block );
+        void     _AppendPage( uint64_t offset );
+        void     _AddPage();
+
+        uint64_t _AllocateSlot( uint64_t size );
+        void     _FreeSlot( uint64_t offset, uint64_t size );
+        uint32_t _GetSlotClass( uint32_t slotSize ) const;
+        uint32_t _GetSlotsPerSector( uint32_t slotSize ) const;
+        void     _InsertSlotSector( uint32_t sector, uint32_t slotSize );
+        void     _RemoveSlotSector( uint32_t index );
+        void     _MarkSlotSector( uint32_t index );
+    };
+
+    // Keeps free space as extents indexed both by offset and by length, rebuilt from the
+    // allocation table when the archive is opened. The allocation table remains the persistent
+    // state and is updated together with the extents.
+    class ArchiveExtentAllocator
+        : public ArchiveAllocator
+    {
+    public:
+        ArchiveExtentAllocator(
+            Archive* archive,
+            uint32_t allocationSize,
+            uint32_t pageBlockCount,
+            uint32_t pageSize,
+            uint32_t slotPageCapacity,
+            AllocatorCallbacks callbacks );
+
+        virtual uint64_t GetFreeSectorCount() const override;
+        virtual double GetFragmentation() const override;
+        virtual void Rebuild() override;
+
+    protected:
+        using FreeExtentMap = std::map<uint32_t, uint32_t>;
+        using FreeExtentSizeIndex = std::set<std::pair<uint32_t, uint32_t>>;
+
+        // First sector -> sector count
+        FreeExtentMap m_FreeExtents;
+        // (Sector count, first sector), ordered for best-fit lookup
+        FreeExtentSizeIndex m_FreeExtentsBySize;
+        uint64_t m_FreeSectorCount;
+
+        virtual uint64_t _Allocate( uint64_t size ) override;
+        virtual void _ShrinkAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize ) override;
+        virtual bool _ExpandAllocation( uint64_t offset, uint64_t oldSize, uint64_t newSize ) override;
+        virtual void _Free( uint64_t offset, uint64_t size ) override;
+        virtual void _SectorsAdded( uint32_t sector, uint32_t sectorCount ) override;
+        virtual void _AllocateAt( uint32_t sector, uint32_t sectorCount ) override;
+
+        void _InsertExtent( uint32_t sector, uint32_t sectorCount );
+        void _EraseExtent( FreeExtentMap::iterator extent );
+        void _ReserveSectors( FreeExtentMap::iterator extent, uint32_t sector, uint32_t sectorCount );
     };
 
     using UniqueArchiveAllocator = std::unique_ptr<ArchiveAllocator>;
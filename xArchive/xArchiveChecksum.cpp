@@ -0,0 +1,270 @@
+#include "xArchiveChecksum.h"
+#include <array>
+#include <cstring>
+
+#if defined( _M_X64 ) || defined( __x86_64__ )
+#define XARCHIVE_CRC32C_SSE42
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <nmmintrin.h>
+#endif
+
+#if defined( _MSC_VER ) || !defined( XARCHIVE_CRC32C_SSE42 )
+#define XARCHIVE_TARGET_SSE42
+#else
+#define XARCHIVE_TARGET_SSE42 __attribute__(( target( "sse4.2" ) ))
+#endif
+
+namespace xArchive
+{
+    namespace
+    {
+        // Reflected CRC-32C polynomial
+        constexpr uint32_t Crc32cPolynomial = 0x82F63B78;
+
+        using Crc32cTable = std::array<std::array<uint32_t, 256>, 8>;
+
+        // Tables for slicing-by-8, each next table advances the previous one by a zero byte.
+        constexpr Crc32cTable MakeCrc32cTable()
+        {
+            Crc32cTable table = {};
+
+            for( uint32_t n = 0; n < 256; ++n )
+            {
+                uint32_t crc = n;
+
+                for( int k = 0; k < 8; ++k )
+                    crc = (crc & 1) ? (crc >> 1) ^ Crc32cPolynomial : crc >> 1;
+
+                table[0][n] = crc;
+            }
+
+            for( uint32_t n = 0; n < 256; ++n )
+            {
+                for( size_t k = 1; k < table.size(); ++k )
+                    table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+            }
+
+            return table;
+        }
+
+        constexpr Crc32cTable SoftwareTable = MakeCrc32cTable();
+
+        uint32_t Crc32cSoftware( uint32_t crc, const uint8_t* data, size_t size )
+        {
+            while( size > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0 )
+            {
+                crc = SoftwareTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+                size--;
+            }
+
+            while( size >= 8 )
+            {
+                uint64_t word;
+                memcpy( &word, data, sizeof( word ) );
+
+                word ^= crc;
+                crc = SoftwareTable[7][word & 0xFF] ^
+                    SoftwareTable[6][(word >> 8) & 0xFF] ^
+                    SoftwareTable[5][(word >> 16) & 0xFF] ^
+                    SoftwareTable[4][(word >> 24) & 0xFF] ^
+                    SoftwareTable[3][(word >> 32) & 0xFF] ^
+                    SoftwareTable[2][(word >> 40) & 0xFF] ^
+                    SoftwareTable[1][(word >> 48) & 0xFF] ^
+                    SoftwareTable[0][word >> 56];
+
+                data += 8;
+                size -= 8;
+            }
+
+            while( size > 0 )
+            {
+                crc = SoftwareTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+                size--;
+            }
+
+            return crc;
+        }
+
+#ifdef XARCHIVE_CRC32C_SSE42
+        // Long buffers are processed in 3 interleaved streams to hide latency of the crc32
+        // instruction. Checksums of the streams are combined by shifting them over the
+        // following streams with the tables below.
+        constexpr size_t LongStreamSize = 8192;
+        constexpr size_t ShortStreamSize = 256;
+
+        using Crc32cShiftTable = std::array<std::array<uint32_t, 256>, 4>;
+
+        uint32_t Gf2MatrixTimes( const uint32_t* matrix, uint32_t vector )
+        {
+            uint32_t sum = 0;
+
+            for( ; vector != 0; vector >>= 1, matrix++ )
+            {
+                if( vector & 1 )
+                    sum ^= *matrix;
+            }
+
+            return sum;
+        }
+
+        void Gf2MatrixSquare( uint32_t* square, const uint32_t* matrix )
+        {
+            for( int n = 0; n < 32; ++n )
+                square[n] = Gf2MatrixTimes( matrix, matrix[n] );
+        }
+
+        // Builds tables appending size (power of two) zero bytes to the checksum.
+        Crc32cShiftTable MakeCrc32cShiftTable( size_t size )
+        {
+            uint32_t even[32];
+            uint32_t odd[32];
+
+            // Operator for one zero bit
+            odd[0] = Crc32cPolynomial;
+
+            for( int n = 1; n < 32; ++n )
+                odd[n] = 1u << (n - 1);
+
+            Gf2MatrixSquare( even, odd );
+            Gf2MatrixSquare( odd, even );
+
+            // Each square doubles the number of zero bytes, starting at one byte
+            uint32_t* result = even;
+
+            while( true )
+            {
+                Gf2MatrixSquare( even, odd );
+                result = even;
+
+                if( (size >>= 1) == 0 )
+                    break;
+
+                Gf2MatrixSquare( odd, even );
+                result = odd;
+
+                if( (size >>= 1) == 0 )
+                    break;
+            }
+
+            Crc32cShiftTable table = {};
+
+            for( uint32_t n = 0; n < 256; ++n )
+            {
+                for( uint32_t k = 0; k < 4; ++k )
+                    table[k][n] = Gf2MatrixTimes( result, n << (8 * k) );
+            }
+
+            return table;
+        }
+
+        const Crc32cShiftTable LongShiftTable = MakeCrc32cShiftTable( LongStreamSize );
+        const Crc32cShiftTable ShortShiftTable = MakeCrc32cShiftTable( ShortStreamSize );
+
+        inline uint32_t Crc32cShift( const Crc32cShiftTable& table, uint32_t crc )
+        {
+            return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+        }
+
+        template<size_t StreamSize>
+        XARCHIVE_TARGET_SSE42 inline const uint8_t* Crc32cStreams( uint64_t& crc, const Crc32cShiftTable& table, const uint8_t* data, size_t& size )
+        {
+            while( size >= 3 * StreamSize )
+            {
+                uint64_t crc1 = 0;
+                uint64_t crc2 = 0;
+
+                for( const uint8_t* end = data + StreamSize; data < end; data += 8 )
+                {
+                    uint64_t word0, word1, word2;
+                    memcpy( &word0, data, sizeof( uint64_t ) );
+                    memcpy( &word1, data + StreamSize, sizeof( uint64_t ) );
+                    memcpy( &word2, data + 2 * StreamSize, sizeof( uint64_t ) );
+
+                    crc = _mm_crc32_u64( crc, word0 );
+                    crc1 = _mm_crc32_u64( crc1, word1 );
+                    crc2 = _mm_crc32_u64( crc2, word2 );
+                }
+
+                crc = Crc32cShift( table, static_cast<uint32_t>(crc) ) ^ crc1;
+                crc = Crc32cShift( table, static_cast<uint32_t>(crc) ) ^ crc2;
+
+                data += 2 * StreamSize;
+                size -= 3 * StreamSize;
+            }
+
+            return data;
+        }
+
+        XARCHIVE_TARGET_SSE42 uint32_t Crc32cHardware( uint32_t crc32, const uint8_t* data, size_t size )
+        {
+            uint64_t crc = crc32;
+
+            while( size > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0 )
+            {
+                crc = _mm_crc32_u8( static_cast<uint32_t>(crc), *data++ );
+                size--;
+            }
+
+            data = Crc32cStreams<LongStreamSize>( crc, LongShiftTable, data, size );
+            data = Crc32cStreams<ShortStreamSize>( crc, ShortShiftTable, data, size );
+
+            while( size >= 8 )
+            {
+                uint64_t word;
+                memcpy( &word, data, sizeof( word ) );
+
+                crc = _mm_crc32_u64( crc, word );
+                data += 8;
+                size -= 8;
+            }
+
+            while( size > 0 )
+            {
+                crc = _mm_crc32_u8( static_cast<uint32_t>(crc), *data++ );
+                size--;
+            }
+
+            return static_cast<uint32_t>(crc);
+        }
+
+        bool IsSse42Supported()
+        {
+#ifdef _MSC_VER
+            int info[4];
+            __cpuid( info, 1 );
+            return (info[2] & (1 << 20)) != 0;
+#else
+            unsigned int eax, ebx, ecx, edx;
+            return __get_cpuid( 1, &eax, &ebx, &ecx, &edx ) && (ecx & bit_SSE4_2) != 0;
+#endif
+        }
+
+        const bool Sse42Supported = IsSse42Supported();
+#endif
+    }
+
+    uint32_t Crc32c( const void* data, size_t size, uint32_t crc )
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+#ifdef XARCHIVE_CRC32C_SSE42
+        if( Sse42Supported )
+            return ~Crc32cHardware( ~crc, bytes, size );
+#endif
+
+        return ~Crc32cSoftware( ~crc, bytes, size );
+    }
+
+    uint32_t Crc32cExcludingField( const void* data, size_t size, size_t checksumOffset )
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+        const size_t fieldEnd = checksumOffset + sizeof( uint32_t );
+
+        const uint32_t crc = Crc32c( bytes, checksumOffset );
+        return Crc32c( bytes + fieldEnd, size - fieldEnd, crc );
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace xArchive
+{
+    // CRC-32C (Castagnoli) of the data. Pass result of the previous call as crc to continue
+    // the checksum over multiple buffers. Uses SSE 4.2 crc32 instruction when available.
+    uint32_t Crc32c( const void* data, size_t size, uint32_t crc = 0 );
+
+    // CRC-32C of the structure which stores its own checksum in the 32-bit field at checksumOffset.
+    // The field is skipped, so the checksum can be verified without modifying the structure.
+    uint32_t Crc32cExcludingField( const void* data, size_t size, size_t checksumOffset );
+}
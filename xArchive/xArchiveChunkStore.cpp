@@ -0,0 +1,278 @@
+#include "xArchiveChunkStore.h"
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+namespace xArchive
+{
+    namespace
+    {
+        // Random values for the gear rolling hash, generated with splitmix64.
+        // Chunk boundaries depend on them, so they must never change.
+        constexpr std::array<uint64_t, 256> MakeGearTable()
+        {
+            std::array<uint64_t, 256> table = {};
+            uint64_t state = 0x9E3779B97F4A7C15ull;
+
+            for( size_t i = 0; i < table.size(); ++i )
+            {
+                uint64_t value = (state += 0x9E3779B97F4A7C15ull);
+                value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+                value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+                table[i] = value ^ (value >> 31);
+            }
+
+            return table;
+        }
+
+        constexpr std::array<uint64_t, 256> GearTable = MakeGearTable();
+
+        // Masks with more bits set make boundaries less likely before the average chunk size
+        // and more likely after it, which narrows the distribution of chunk sizes.
+        constexpr uint64_t SmallChunkMask = 0x0003590703530000ull;
+        constexpr uint64_t LargeChunkMask = 0x0000D90003530000ull;
+    }
+
+    ArchiveChunkStore::ArchiveChunkStore( uint32_t pageCapacity )
+        : m_PageCapacity( pageCapacity )
+        , m_Chunks()
+        , m_PageOffsets()
+        , m_DirtyPages()
+        , m_Fingerprints()
+        , m_Offsets()
+    {
+    }
+
+    size_t ArchiveChunkStore::FindChunkBoundary( const void* data, size_t size )
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+        if( size <= MinChunkSize )
+            return size;
+
+        const size_t maxSize = std::min<size_t>( size, MaxChunkSize );
+        const size_t avgSize = std::min<size_t>( size, AvgChunkSize );
+
+        uint64_t hash = 0;
+        size_t i = MinChunkSize;
+
+        for( ; i < avgSize; ++i )
+        {
+            hash = (hash << 1) + GearTable[bytes[i]];
+
+            if( !(hash & SmallChunkMask) )
+                return i + 1;
+        }
+
+        for( ; i < maxSize; ++i )
+        {
+            hash = (hash << 1) + GearTable[bytes[i]];
+
+            if( !(hash & LargeChunkMask) )
+                return i + 1;
+        }
+
+        return maxSize;
+    }
+
+    uint64_t ArchiveChunkStore::Fingerprint( const void* data, size_t size )
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+        // FNV-1a, matches are verified against the stored data
+        uint64_t hash = 0xCBF29CE484222325ull;
+
+        for( size_t i = 0; i < size; ++i )
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+
+    int32_t ArchiveChunkStore::Find( uint64_t fingerprint, uint32_t size, const std::function<bool( const ArchiveChunk& )>& predicate ) const
+    {
+        auto candidates = m_Fingerprints.equal_range( fingerprint );
+
+        for( auto candidate = candidates.first; candidate != candidates.second; ++candidate )
+        {
+            const ArchiveChunk& chunk = m_Chunks[candidate->second];
+
+            if( chunk.Size == size && predicate( chunk ) )
+                return static_cast<int32_t>(candidate->second);
+        }
+
+        return -1;
+    }
+
+    const ArchiveChunk& ArchiveChunkStore::GetChunk( uint32_t index ) const
+    {
+        return m_Chunks[index];
+    }
+
+    void ArchiveChunkStore::AddReference( uint32_t index )
+    {
+        m_Chunks[index].RefCount++;
+        _MarkChunk( index );
+    }
+
+    void ArchiveChunkStore::Insert( uint64_t fingerprint, uint64_t offset, uint32_t size )
+    {
+        if( IsFull() )
+            throw std::runtime_error( "Chunk store is full" );
+
+        const uint32_t index = static_cast<uint32_t>(m_Chunks.size());
+
+        m_Chunks.push_back( ArchiveChunk{ fingerprint, offset, size, 1 } );
+        m_Fingerprints.emplace( fingerprint, index );
+        m_Offsets.emplace( offset, index );
+
+        _MarkChunk( index );
+    }
+
+    bool ArchiveChunkStore::Release( uint64_t offset, uint32_t& size )
+    {
+        auto chunkIndex = m_Offsets.find( offset );
+
+        if( chunkIndex == m_Offsets.end() )
+            throw std::runtime_error( "Chunk not found" );
+
+        const uint32_t index = chunkIndex->second;
+        ArchiveChunk& chunk = m_Chunks[index];
+
+        size = chunk.Size;
+
+        if( --chunk.RefCount > 0 )
+        {
+            _MarkChunk( index );
+            return false;
+        }
+
+        _Remove( index );
+        return true;
+    }
+
+    bool ArchiveChunkStore::IsFull() const
+    {
+        return m_Chunks.size() == m_PageOffsets.size() * m_PageCapacity;
+    }
+
+    void ArchiveChunkStore::AddPage( uint64_t offset )
+    {
+        if( !m_DirtyPages.empty() )
+        {
+            // Link to the new page has to be written to the previous page
+            m_DirtyPages.back() = true;
+        }
+
+        m_PageOffsets.push_back( offset );
+        m_DirtyPages.push_back( true );
+    }
+
+    bool ArchiveChunkStore::RemoveUnusedPage( uint64_t& offset )
+    {
+        if( m_PageOffsets.empty() || m_Chunks.size() > (m_PageOffsets.size() - 1) * m_PageCapacity )
+            return false;
+
+        offset = m_PageOffsets.back();
+
+        m_PageOffsets.pop_back();
+        m_DirtyPages.pop_back();
+
+        if( !m_DirtyPages.empty() )
+            m_DirtyPages.back() = true;
+
+        return true;
+    }
+
+    void ArchiveChunkStore::LoadPage( uint64_t offset, const ArchiveChunk* chunks, uint32_t count )
+    {
+        m_Chunks.insert( m_Chunks.end(), chunks, chunks + count );
+
+        m_PageOffsets.push_back( offset );
+        m_DirtyPages.push_back( false );
+    }
+
+    void ArchiveChunkStore::Rebuild()
+    {
+        m_Fingerprints.clear();
+        m_Offsets.clear();
+
+        for( uint32_t index = 0; index < m_Chunks.size(); ++index )
+        {
+            m_Fingerprints.emplace( m_Chunks[index].Fingerprint, index );
+            m_Offsets.emplace( m_Chunks[index].Offset, index );
+        }
+    }
+
+    uint32_t ArchiveChunkStore::GetPageCount() const
+    {
+        return static_cast<uint32_t>(m_PageOffsets.size());
+    }
+
+    uint64_t ArchiveChunkStore::GetPageOffset( uint32_t page ) const
+    {
+        return m_PageOffsets[page];
+    }
+
+    const ArchiveChunk* ArchiveChunkStore::GetPageChunks( uint32_t page, uint32_t& count ) const
+    {
+        const size_t first = static_cast<size_t>(page) * m_PageCapacity;
+
+        count = static_cast<uint32_t>(std::min<size_t>( m_PageCapacity, m_Chunks.size() - first ));
+        return m_Chunks.data() + first;
+    }
+
+    bool ArchiveChunkStore::IsPageDirty( uint32_t page ) const
+    {
+        return m_DirtyPages[page];
+    }
+
+    void ArchiveChunkStore::ClearDirtyPages()
+    {
+        std::fill( m_DirtyPages.begin(), m_DirtyPages.end(), false );
+    }
+
+    void ArchiveChunkStore::_Remove( uint32_t index )
+    {
+        const uint32_t last = static_cast<uint32_t>(m_Chunks.size() - 1);
+
+        auto eraseFingerprint = [this]( uint32_t chunkIndex )
+        {
+            auto candidates = m_Fingerprints.equal_range( m_Chunks[chunkIndex].Fingerprint );
+
+            for( auto candidate = candidates.first; candidate != candidates.second; ++candidate )
+            {
+                if( candidate->second == chunkIndex )
+                {
+                    m_Fingerprints.erase( candidate );
+                    return;
+                }
+            }
+        };
+
+        eraseFingerprint( index );
+        m_Offsets.erase( m_Chunks[index].Offset );
+
+        if( index != last )
+        {
+            // Keep the records packed, the last one takes place of the removed one
+            eraseFingerprint( last );
+
+            m_Chunks[index] = m_Chunks[last];
+            m_Fingerprints.emplace( m_Chunks[index].Fingerprint, index );
+            m_Offsets[m_Chunks[index].Offset] = index;
+
+            _MarkChunk( index );
+        }
+
+        m_Chunks.pop_back();
+        _MarkChunk( last );
+    }
+
+    void ArchiveChunkStore::_MarkChunk( uint32_t index )
+    {
+        m_DirtyPages[index / m_PageCapacity] = true;
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace xArchive
+{
+    // Unique chunk of entry data shared by all entries containing it.
+    struct ArchiveChunk
+    {
+        uint64_t                Fingerprint;
+        uint64_t                Offset;
+        uint32_t                Size;
+        uint32_t                RefCount;
+    };
+
+    // Fingerprint index of the stored chunks. Records are kept packed and persisted in pages
+    // of pageCapacity records allocated by the archive.
+    class ArchiveChunkStore
+    {
+    public:
+        // Content-defined chunking parameters (FastCDC with normalized chunk sizes).
+        static constexpr uint32_t MinChunkSize = 2048;
+        static constexpr uint32_t AvgChunkSize = 8192;
+        static constexpr uint32_t MaxChunkSize = 65536;
+
+        explicit ArchiveChunkStore( uint32_t pageCapacity );
+
+        // Returns length of the first chunk of the data.
+        static size_t FindChunkBoundary( const void* data, size_t size );
+        static uint64_t Fingerprint( const void* data, size_t size );
+
+        // Returns index of the chunk with given fingerprint and size accepted by the predicate
+        // (which compares the stored data), -1 if there is no such chunk.
+        int32_t  Find( uint64_t fingerprint, uint32_t size, const std::function<bool( const ArchiveChunk& )>& predicate ) const;
+        const ArchiveChunk& GetChunk( uint32_t index ) const;
+        void     AddReference( uint32_t index );
+
+        // Inserts new chunk with 1 reference. AddPage must be called before if the store is full.
+        void     Insert( uint64_t fingerprint, uint64_t offset, uint32_t size );
+
+        // Drops 1 reference of the chunk at the offset, returns true if the chunk is not used anymore.
+        bool     Release( uint64_t offset, uint32_t& size );
+
+        bool     IsFull() const;
+        void     AddPage( uint64_t offset );
+        // Removes the last page if it's not needed anymore, returns false if all pages are in use.
+        bool     RemoveUnusedPage( uint64_t& offset );
+
+        void     LoadPage( uint64_t offset, const ArchiveChunk* chunks, uint32_t count );
+        void     Rebuild();
+
+        uint32_t GetPageCount() const;
+        uint64_t GetPageOffset( uint32_t page ) const;
+        const ArchiveChunk* GetPageChunks( uint32_t page, uint32_t& count ) const;
+        bool     IsPageDirty( uint32_t page ) const;
+        void     ClearDirtyPages();
+
+    protected:
+        uint32_t m_PageCapacity;
+        std::vector<ArchiveChunk> m_Chunks;
+        std::vector<uint64_t> m_PageOffsets;
+        std::vector<bool> m_DirtyPages;
+
+        // Fingerprint -> chunk index, collisions are resolved by the predicate
+        std::unordered_multimap<uint64_t, uint32_t> m_Fingerprints;
+        // Offset -> chunk index
+        std::unordered_map<uint64_t, uint32_t> m_Offsets;
+
+        void _Remove( uint32_t index );
+        void _MarkChunk( uint32_t index );
+    };
+}
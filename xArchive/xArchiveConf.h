@@ -1,5 +1,7 @@
 #pragma once
-#ifdef XARCHIVE_EXPORT
+#if !defined( _WIN32 )
+#define XARCHIVE_API __attribute__((visibility("default")))
+#elif defined( XARCHIVE_EXPORT )
 #define XARCHIVE_API __declspec(dllexport)
 #else
 #define XARCHIVE_API __declspec(dllimport)
@@ -1,10 +1,113 @@
 #include "xArchiveFile.h"
+#include "xArchiveStats.h"
+#include "xArchiveTrace.h"
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <stdexcept>
 #include <zlib.h>
 
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
 namespace xArchive
 {
+    namespace
+    {
+        // Compressibility of a page is estimated from a few windows spread across it. Order-0
+        // entropy of the windows settles most pages, only the nearly random ones are deflated
+        // at the fastest level to find repeated blocks, which the byte statistics don't show.
+        // Windows start at multiples of 16 KB, so repeats of 4, 8 and 16 KB blocks line up.
+        constexpr size_t SampleWindowSize = 4 * 1024;
+        constexpr size_t SampleWindowCount = 4;
+        constexpr double CompressibleEntropy = 7.5;
+
+        class PageSampler
+        {
+        public:
+            PageSampler()
+                : m_Stream()
+                , m_Sample()
+                , m_Buffer()
+            {
+                deflateInit2( &m_Stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY );
+
+                m_Sample.reserve( SampleWindowCount * SampleWindowSize );
+                m_Buffer.resize( deflateBound( &m_Stream, SampleWindowCount * SampleWindowSize ) );
+            }
+
+            ~PageSampler()
+            {
+                deflateEnd( &m_Stream );
+            }
+
+            bool IsIncompressible( const char* data, size_t size )
+            {
+                m_Sample.clear();
+
+                if( size <= SampleWindowCount * SampleWindowSize )
+                {
+                    m_Sample.insert( m_Sample.end(), data, data + size );
+                }
+                else
+                {
+                    for( size_t i = 0; i < SampleWindowCount; ++i )
+                    {
+                        const char* window = data + i * (size / SampleWindowCount);
+                        m_Sample.insert( m_Sample.end(), window, window + SampleWindowSize );
+                    }
+                }
+
+                if( _EstimateEntropy() < CompressibleEntropy )
+                    return false;
+
+                deflateReset( &m_Stream );
+                m_Stream.next_in = reinterpret_cast<Bytef*>(m_Sample.data());
+                m_Stream.avail_in = static_cast<uInt>(m_Sample.size());
+                m_Stream.next_out = reinterpret_cast<Bytef*>(m_Buffer.data());
+                m_Stream.avail_out = static_cast<uInt>(m_Buffer.size());
+
+                if( deflate( &m_Stream, Z_FINISH ) != Z_STREAM_END )
+                    return false;
+
+                return m_Stream.total_out >= m_Sample.size();
+            }
+
+        private:
+            z_stream m_Stream;
+            std::vector<char> m_Sample;
+            std::vector<char> m_Buffer;
+
+            double _EstimateEntropy() const
+            {
+                uint32_t histogram[256] = {};
+
+                for( char byte : m_Sample )
+                    histogram[static_cast<uint8_t>(byte)]++;
+
+                double entropy = 0;
+
+                for( uint32_t count : histogram )
+                {
+                    if( count == 0 )
+                        continue;
+
+                    const double probability = static_cast<double>(count) / static_cast<double>(m_Sample.size());
+                    entropy -= probability * std::log2( probability );
+                }
+
+                return entropy;
+            }
+        };
+    }
+
     ArchiveFile::ArchiveFile( const std::string& filename, ArchiveFileOpenMode mode )
         : m_Filename( filename )
         , m_Mode( mode )
@@ -25,6 +128,11 @@ namespace xArchive
         return m_Mode;
     }
 
+    std::unique_ptr<ArchiveFile> ArchiveFile::Snapshot() const
+    {
+        throw std::runtime_error( (m_Filename + " doesn't support snapshots").c_str() );
+    }
+
 
     UncompressedArchiveFile::UncompressedArchiveFile( const std::string& filename, ArchiveFileOpenMode mode )
         : ArchiveFile( filename, mode )
@@ -44,7 +152,11 @@ namespace xArchive
         if( mode == ArchiveFileOpenMode::eReadWrite )
         {
             // The file may not exist now, create it without trunctation
+#ifdef _MSC_VER
             fopen_s( &m_pFile, filename_, "a" );
+#else
+            m_pFile = fopen( filename_, "a" );
+#endif
 
             if( !m_pFile )
                 throw std::runtime_error( "Cannot open archive file" );
@@ -52,7 +164,11 @@ namespace xArchive
             fclose( m_pFile );
         }
 
+#ifdef _MSC_VER
         fopen_s( &m_pFile, filename_, mode_ );
+#else
+        m_pFile = fopen( filename_, mode_ );
+#endif
 
         if( !m_pFile )
             throw std::runtime_error( "Cannot open archive file" );
@@ -65,22 +181,73 @@ namespace xArchive
 
     void UncompressedArchiveFile::Write( const void* data, size_t size )
     {
+        ArchiveCounters::Add( ArchiveCounter::eBytesWritten, size );
         fwrite( data, 1, size, m_pFile );
     }
 
     void UncompressedArchiveFile::Read( void* buffer, size_t size )
     {
+        ArchiveCounters::Add( ArchiveCounter::eBytesRead, size );
+#ifdef _MSC_VER
         fread_s( buffer, size, 1, size, m_pFile );
+#else
+        fread( buffer, 1, size, m_pFile );
+#endif
     }
 
     void UncompressedArchiveFile::Seek( ptrdiff_t offset, int mode )
     {
-        fseek( m_pFile, static_cast<long>(offset), mode );
+#ifdef _MSC_VER
+        _fseeki64( m_pFile, static_cast<int64_t>(offset), mode );
+#else
+        fseeko( m_pFile, static_cast<off_t>(offset), mode );
+#endif
     }
 
     size_t UncompressedArchiveFile::Tell() const
     {
-        return ftell( m_pFile );
+#ifdef _MSC_VER
+        return static_cast<size_t>(_ftelli64( m_pFile ));
+#else
+        return static_cast<size_t>(ftello( m_pFile ));
+#endif
+    }
+
+    void UncompressedArchiveFile::Truncate( size_t size )
+    {
+        fflush( m_pFile );
+#ifdef _MSC_VER
+        const int result = _chsize_s( _fileno( m_pFile ), static_cast<int64_t>(size) );
+#else
+        const int result = ftruncate( fileno( m_pFile ), static_cast<off_t>(size) );
+#endif
+        if( result != 0 )
+            throw std::runtime_error( "Cannot truncate archive file" );
+    }
+
+    void UncompressedArchiveFile::Discard( size_t offset, size_t size )
+    {
+#ifdef __linux__
+        fflush( m_pFile );
+
+        // Give the space back to the file system, not all file systems support it
+        fallocate( fileno( m_pFile ), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            static_cast<off_t>(offset), static_cast<off_t>(size) );
+#else
+        (void)offset;
+        (void)size;
+#endif
+    }
+
+    void UncompressedArchiveFile::Prefetch( size_t offset, size_t size )
+    {
+#ifdef __linux__
+        // Starts asynchronous read-ahead into the page cache
+        posix_fadvise( fileno( m_pFile ), static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_WILLNEED );
+#else
+        (void)offset;
+        (void)size;
+#endif
     }
 
     void UncompressedArchiveFile::Flush()
@@ -97,9 +264,10 @@ namespace xArchive
 
     CompressedArchiveFile::CompressedArchiveFile( const std::string& filename, ArchiveFileOpenMode mode )
         : ArchiveFile( filename, mode )
-        , m_pBuffer()
-        , m_PointerOffset( 0 )
         , m_IsOpen( true )
+        , m_PointerOffset( 0 )
+        , m_Size( 0 )
+        , m_Pages()
     {
         const char* filename_ = filename.c_str();
 
@@ -120,6 +288,9 @@ namespace xArchive
 
         // Read and uncompress data from gz file
         {
+            ArchiveScopedTimer decompressionTimer( ArchiveCounter::eDecompressionTime );
+            ArchiveTraceScope traceScope( "CompressedArchiveFile::Decompress", "compression" );
+
             gzFile file = gzopen( filename_, "rb" );
 
             // Temporary buffer used to determine size of uncompressed data
@@ -140,12 +311,29 @@ namespace xArchive
                 uncompressedSize += bytesDecompressed;
             }
 
-            m_pBuffer.resize( uncompressedSize );
+            _Resize( uncompressedSize );
 
             gzrewind( file );
-            gzread( file, m_pBuffer.data(), static_cast<unsigned int>(uncompressedSize) );
+
+            for( size_t page = 0; page < m_Pages.size(); ++page )
+            {
+                const size_t pageSize = std::min( PageSize, uncompressedSize - page * PageSize );
+                gzread( file, _GetWritablePage( page ), static_cast<unsigned int>(pageSize) );
+            }
+
             gzclose( file );
         }
+
+        ArchiveCounters::Add( ArchiveCounter::eBytesDecompressed, uncompressedSize );
+    }
+
+    CompressedArchiveFile::CompressedArchiveFile( const CompressedArchiveFile& source )
+        : ArchiveFile( source.m_Filename, ArchiveFileOpenMode::eReadOnly )
+        , m_IsOpen( true )
+        , m_PointerOffset( 0 )
+        , m_Size( source.m_Size )
+        , m_Pages( source.m_Pages )
+    {
     }
 
     CompressedArchiveFile::~CompressedArchiveFile()
@@ -155,20 +343,51 @@ namespace xArchive
 
     void CompressedArchiveFile::Write( const void* data, size_t size )
     {
-        if( m_PointerOffset + size > m_pBuffer.size() )
+        ArchiveCounters::Add( ArchiveCounter::eBytesWritten, size );
+
+        if( m_PointerOffset + size > m_Size )
         {
-            m_pBuffer.resize( m_PointerOffset + size );
+            _Resize( m_PointerOffset + size );
         }
 
-        std::memcpy( m_pBuffer.data() + m_PointerOffset, data, size );
+        const char* bytes = reinterpret_cast<const char*>(data);
 
-        m_PointerOffset += size;
+        while( size > 0 )
+        {
+            const size_t pageOffset = m_PointerOffset % PageSize;
+            const size_t bytesToWrite = std::min( size, PageSize - pageOffset );
+
+            std::memcpy( _GetWritablePage( m_PointerOffset / PageSize ) + pageOffset, bytes, bytesToWrite );
+
+            m_PointerOffset += bytesToWrite;
+            bytes += bytesToWrite;
+            size -= bytesToWrite;
+        }
     }
 
     void CompressedArchiveFile::Read( void* buffer, size_t size )
     {
-        std::memcpy( buffer, m_pBuffer.data() + m_PointerOffset,
-            std::min( size, m_pBuffer.size() - m_PointerOffset ) );
+        ArchiveCounters::Add( ArchiveCounter::eBytesRead, size );
+
+        char* bytes = reinterpret_cast<char*>(buffer);
+        size_t offset = m_PointerOffset;
+        size_t bytesLeft = (offset < m_Size) ? std::min( size, m_Size - offset ) : 0;
+
+        while( bytesLeft > 0 )
+        {
+            const size_t pageOffset = offset % PageSize;
+            const size_t bytesToRead = std::min( bytesLeft, PageSize - pageOffset );
+            const SharedPage& page = m_Pages[offset / PageSize];
+
+            if( page )
+                std::memcpy( bytes, page->Data + pageOffset, bytesToRead );
+            else
+                std::memset( bytes, 0, bytesToRead );
+
+            offset += bytesToRead;
+            bytes += bytesToRead;
+            bytesLeft -= bytesToRead;
+        }
 
         m_PointerOffset += size;
     }
@@ -179,18 +398,46 @@ namespace xArchive
         {
         case SEEK_SET: m_PointerOffset = offset; return;
         case SEEK_CUR: m_PointerOffset = m_PointerOffset + offset; return;
-        case SEEK_END: m_PointerOffset = m_pBuffer.size() + offset; return;
+        case SEEK_END: m_PointerOffset = m_Size + offset; return;
         }
+    }
+
+    size_t CompressedArchiveFile::Tell() const
+    {
+        return m_PointerOffset;
+    }
 
-        if( m_PointerOffset > m_pBuffer.size() )
+    void CompressedArchiveFile::Truncate( size_t size )
+    {
+        _Resize( size );
+    }
+
+    void CompressedArchiveFile::Discard( size_t offset, size_t size )
+    {
+        if( offset >= m_Size )
+            return;
+
+        size = std::min( size, m_Size - offset );
+
+        while( size > 0 )
         {
-            m_pBuffer.resize( m_PointerOffset );
+            const size_t pageOffset = offset % PageSize;
+            const size_t bytesToDiscard = std::min( size, PageSize - pageOffset );
+
+            // Whole pages are released, zeroed ranges take almost no space once compressed
+            if( bytesToDiscard == PageSize )
+                m_Pages[offset / PageSize].reset();
+            else
+                std::memset( _GetWritablePage( offset / PageSize ) + pageOffset, 0, bytesToDiscard );
+
+            offset += bytesToDiscard;
+            size -= bytesToDiscard;
         }
     }
 
-    size_t CompressedArchiveFile::Tell() const
+    void CompressedArchiveFile::Prefetch( size_t, size_t )
     {
-        return m_PointerOffset;
+        // Whole contents are kept in memory
     }
 
     void CompressedArchiveFile::Flush()
@@ -202,11 +449,79 @@ namespace xArchive
         if( !m_IsOpen || m_Mode == ArchiveFileOpenMode::eReadOnly )
             return;
 
+        ArchiveScopedTimer compressionTimer( ArchiveCounter::eCompressionTime );
+        ArchiveTraceScope traceScope( "CompressedArchiveFile::Compress", "compression" );
+
         gzFile file = gzopen( m_Filename.c_str(), "wb" );
 
-        gzwrite( file, m_pBuffer.data(), static_cast<uint32_t>(m_pBuffer.size()) );
+        static const Page ZeroPage = {};
+
+        // Incompressible pages are written as stored deflate blocks, which the reader
+        // just copies. Level is changed only when it differs from the previous page.
+        bool storeRaw = false;
+
+        PageSampler sampler;
+
+        for( size_t page = 0; page < m_Pages.size(); ++page )
+        {
+            const size_t pageSize = std::min( PageSize, m_Size - page * PageSize );
+            const Page* pageData = m_Pages[page] ? m_Pages[page].get() : &ZeroPage;
+
+            const bool incompressible = m_Pages[page] && sampler.IsIncompressible( pageData->Data, pageSize );
+
+            if( incompressible != storeRaw )
+            {
+                gzsetparams( file, incompressible ? Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY );
+                storeRaw = incompressible;
+            }
+
+            if( incompressible )
+                ArchiveCounters::Add( ArchiveCounter::eBytesStoredRaw, pageSize );
+
+            gzwrite( file, pageData->Data, static_cast<uint32_t>(pageSize) );
+        }
 
         gzflush( file, Z_FINISH );
         gzclose( file );
+
+        // Closing again (in the destructor) would compress the same contents once more
+        m_IsOpen = false;
+
+        ArchiveCounters::Add( ArchiveCounter::eBytesCompressed, m_Size );
+    }
+
+    std::unique_ptr<ArchiveFile> CompressedArchiveFile::Snapshot() const
+    {
+        // Pages are shared until either side writes them
+        return std::unique_ptr<ArchiveFile>( new CompressedArchiveFile( *this ) );
+    }
+
+    void CompressedArchiveFile::_Resize( size_t size )
+    {
+        // Bytes past the new end must read as zeros if the file grows again
+        if( size < m_Size && size % PageSize != 0 )
+        {
+            const size_t pageOffset = size % PageSize;
+            const size_t pageEnd = std::min( PageSize, m_Size - (size - pageOffset) );
+
+            if( m_Pages[size / PageSize] )
+                std::memset( _GetWritablePage( size / PageSize ) + pageOffset, 0, pageEnd - pageOffset );
+        }
+
+        m_Pages.resize( (size + PageSize - 1) / PageSize );
+        m_Size = size;
+    }
+
+    char* CompressedArchiveFile::_GetWritablePage( size_t page )
+    {
+        SharedPage& sharedPage = m_Pages[page];
+
+        // The page is copied if any snapshot still refers to it
+        if( !sharedPage )
+            sharedPage = std::make_shared<Page>();
+        else if( sharedPage.use_count() > 1 )
+            sharedPage = std::make_shared<Page>( *sharedPage );
+
+        return const_cast<char*>(sharedPage->Data);
     }
 }
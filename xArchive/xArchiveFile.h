@@ -23,11 +23,19 @@ namespace xArchive
         virtual void Read( void* buffer, size_t size ) = 0;
         virtual void Seek( ptrdiff_t offset, int mode = SEEK_SET ) = 0;
         virtual size_t Tell() const = 0;
+        virtual void Truncate( size_t size ) = 0;
+        // Hints that the range doesn't hold any data anymore
+        virtual void Discard( size_t offset, size_t size ) = 0;
+        // Hints that the range will be read soon
+        virtual void Prefetch( size_t offset, size_t size ) = 0;
         virtual void Flush() = 0;
         virtual void Close() = 0;
         virtual std::string Name() const;
         virtual ArchiveFileOpenMode Mode() const;
 
+        // Returns read-only view of the current contents, which is not affected by later writes.
+        virtual std::unique_ptr<ArchiveFile> Snapshot() const;
+
     protected:
         std::string m_Filename;
         ArchiveFileOpenMode m_Mode;
@@ -48,6 +56,9 @@ namespace xArchive
         virtual void Read( void* buffer, size_t size ) override;
         virtual void Seek( ptrdiff_t offset, int mode = SEEK_SET ) override;
         virtual size_t Tell() const override;
+        virtual void Truncate( size_t size ) override;
+        virtual void Discard( size_t offset, size_t size ) override;
+        virtual void Prefetch( size_t offset, size_t size ) override;
         virtual void Flush() override;
         virtual void Close() override;
 
@@ -55,10 +66,14 @@ namespace xArchive
         FILE* m_pFile;
     };
 
+    // Uncompressed contents are kept in memory in pages shared with the snapshots.
+    // Pages are copied on the first write after the snapshot has been taken.
     class CompressedArchiveFile
         : public ArchiveFile
     {
     public:
+        static constexpr size_t PageSize = 64 * 1024;
+
         CompressedArchiveFile( const std::string& filename, ArchiveFileOpenMode mode );
         virtual ~CompressedArchiveFile();
 
@@ -66,12 +81,30 @@ namespace xArchive
         virtual void Read( void* buffer, size_t size ) override;
         virtual void Seek( ptrdiff_t offset, int mode = SEEK_SET ) override;
         virtual size_t Tell() const override;
+        virtual void Truncate( size_t size ) override;
+        virtual void Discard( size_t offset, size_t size ) override;
+        virtual void Prefetch( size_t offset, size_t size ) override;
         virtual void Flush() override;
         virtual void Close() override;
+        virtual std::unique_ptr<ArchiveFile> Snapshot() const override;
 
     protected:
+        struct Page
+        {
+            char Data[PageSize];
+        };
+
+        using SharedPage = std::shared_ptr<const Page>;
+
         bool m_IsOpen;
         size_t m_PointerOffset;
-        std::vector<char> m_pBuffer;
+        size_t m_Size;
+        // Null pages are filled with zeros
+        std::vector<SharedPage> m_Pages;
+
+        CompressedArchiveFile( const CompressedArchiveFile& source );
+
+        void _Resize( size_t size );
+        char* _GetWritablePage( size_t page );
     };
 }
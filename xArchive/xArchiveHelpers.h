@@ -1,16 +1,26 @@
 #pragma once
 #include <type_traits>
+#include <cstdint>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
 #include <cctype>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #undef min
 #undef max
 
 #define ElementOf( Struct, Element ) (((Struct*)0)->Element)
 #define OffsetOf( Struct, Element )  (offsetof( Struct, Element ))
 
-#define BSwap( Value ) ((Value<<24)|((Value&0xFF00)<<8)|((Value>>8)&0xFF00)|(Value>>24))
+#define BSwap( Value ) ((uint32_t( Value )<<24)|((uint32_t( Value )&0xFF00)<<8)|((uint32_t( Value )>>8)&0xFF00)|(uint32_t( Value )>>24))
 
 namespace xArchive
 {
@@ -45,6 +55,58 @@ namespace xArchive
         return ArrayLength;
     }
 
+    // Returns number of zero bits below the lowest set bit, 32 for 0.
+    inline uint32_t CountTrailingZeros(
+        uint32_t value )
+    {
+        if( value == 0 )
+            return 32;
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward( &index, value );
+        return static_cast<uint32_t>(index);
+#else
+        return static_cast<uint32_t>(__builtin_ctz( value ));
+#endif
+    }
+
+    // Returns number of zero bits below the lowest set bit, 64 for 0.
+    inline uint32_t CountTrailingZeros64(
+        uint64_t value )
+    {
+        const uint32_t low = static_cast<uint32_t>(value);
+
+        if( low != 0 )
+            return CountTrailingZeros( low );
+
+        return 32 + CountTrailingZeros( static_cast<uint32_t>(value >> 32) );
+    }
+
+    // Returns number of zero bits above the highest set bit, 32 for 0.
+    inline uint32_t CountLeadingZeros(
+        uint32_t value )
+    {
+        if( value == 0 )
+            return 32;
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse( &index, value );
+        return 31 - static_cast<uint32_t>(index);
+#else
+        return static_cast<uint32_t>(__builtin_clz( value ));
+#endif
+    }
+
+    inline uint32_t PopCount(
+        uint32_t value )
+    {
+#ifdef _MSC_VER
+        return static_cast<uint32_t>(__popcnt( value ));
+#else
+        return static_cast<uint32_t>(__builtin_popcount( value ));
+#endif
+    }
+
     inline bool StringStartsWith(
         const std::string& a,
         const std::string& b )
@@ -79,14 +141,14 @@ namespace xArchive
 
     template<size_t ArraySize>
     inline void StringToArray(
-        const std::string& string,
+        std::string_view string,
         char( &array )[ArraySize] )
     {
         if( ArraySize < string.length() + 1 )
             throw std::invalid_argument( "Insufficient buffer" );
 
-        memcpy( array, string.data(), std::min( ArraySize - 1, string.length() + 1 ) );
-        array[ArraySize - 1] = 0;
+        memcpy( array, string.data(), string.length() );
+        memset( array + string.length(), 0, ArraySize - string.length() );
     }
 
     inline std::string StringJoin(
@@ -158,4 +220,170 @@ namespace xArchive
 
         return splitted;
     }
+
+    inline bool PathIsAbsolute(
+        std::string_view path )
+    {
+        return !path.empty() && path.front() == '/';
+    }
+
+    // Iterates over non-empty components of the path without copying them.
+    // Repeated, leading and trailing separators are skipped.
+    class PathIterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = ptrdiff_t;
+        using pointer = const std::string_view*;
+        using reference = const std::string_view&;
+
+        PathIterator()
+            : m_Remaining()
+            , m_Component()
+        {
+        }
+
+        explicit PathIterator( std::string_view path )
+            : m_Remaining( path )
+            , m_Component()
+        {
+            _Advance();
+        }
+
+        reference operator*() const
+        {
+            return m_Component;
+        }
+
+        pointer operator->() const
+        {
+            return &m_Component;
+        }
+
+        PathIterator& operator++()
+        {
+            _Advance();
+            return *this;
+        }
+
+        PathIterator operator++( int )
+        {
+            PathIterator it = *this;
+            _Advance();
+            return it;
+        }
+
+        bool operator==( const PathIterator& other ) const
+        {
+            return m_Component.data() == other.m_Component.data()
+                && m_Component.length() == other.m_Component.length();
+        }
+
+        bool operator!=( const PathIterator& other ) const
+        {
+            return !(*this == other);
+        }
+
+    private:
+        std::string_view m_Remaining;
+        std::string_view m_Component;
+
+        void _Advance()
+        {
+            const size_t begin = m_Remaining.find_first_not_of( '/' );
+
+            if( begin == std::string_view::npos )
+            {
+                m_Remaining = std::string_view();
+                m_Component = std::string_view();
+                return;
+            }
+
+            const size_t end = m_Remaining.find( '/', begin );
+
+            m_Component = m_Remaining.substr( begin, end - begin );
+            m_Remaining.remove_prefix( std::min( end, m_Remaining.length() ) );
+        }
+    };
+
+    // Range adapter which allows iterating over path components in range-based for loops.
+    class PathComponents
+    {
+    public:
+        explicit PathComponents( std::string_view path )
+            : m_Path( path )
+        {
+        }
+
+        PathIterator begin() const
+        {
+            return PathIterator( m_Path );
+        }
+
+        PathIterator end() const
+        {
+            return PathIterator();
+        }
+
+    private:
+        std::string_view m_Path;
+    };
+
+    // Splits the path into parent directory path and the last component.
+    // The parent keeps the leading separator of absolute paths, so "/a" yields "/" and "a",
+    // while "a" yields an empty (current directory) parent.
+    inline void PathSplitLast(
+        std::string_view path,
+        std::string_view& parent,
+        std::string_view& name )
+    {
+        const size_t end = path.find_last_not_of( '/' );
+
+        if( end == std::string_view::npos )
+        {
+            parent = path.substr( 0, PathIsAbsolute( path ) ? 1 : 0 );
+            name = std::string_view();
+            return;
+        }
+
+        const size_t sep = path.find_last_of( '/', end );
+
+        if( sep == std::string_view::npos )
+        {
+            parent = std::string_view();
+            name = path.substr( 0, end + 1 );
+            return;
+        }
+
+        parent = path.substr( 0, sep + 1 );
+        name = path.substr( sep + 1, end - sep );
+    }
+
+    // Resolves path against already normalized directory path (in "/dir/subdir/" form)
+    // in place. "." components are dropped and ".." removes the last directory.
+    inline void PathNormalize(
+        std::string_view path,
+        std::string& normalizedPath )
+    {
+        if( PathIsAbsolute( path ) || normalizedPath.empty() )
+            normalizedPath.assign( 1, '/' );
+
+        for( std::string_view component : PathComponents( path ) )
+        {
+            if( component == "." )
+                continue;
+
+            if( component == ".." )
+            {
+                if( normalizedPath.length() > 1 )
+                    normalizedPath.resize( normalizedPath.find_last_of( '/', normalizedPath.length() - 2 ) + 1 );
+
+                continue;
+            }
+
+            normalizedPath.append( component.data(), component.length() );
+            normalizedPath.push_back( '/' );
+        }
+    }
 }
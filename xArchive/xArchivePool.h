@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace xArchive
+{
+    template<typename BlockType>
+    class ArchiveBlockPool;
+
+    // Intrusive reference to the block allocated from ArchiveBlockPool.
+    // The block is returned to the pool when the last handle is released.
+    template<typename BlockType>
+    class ArchiveBlockHandle
+    {
+        using Node = typename ArchiveBlockPool<BlockType>::Node;
+
+    public:
+        ArchiveBlockHandle()
+            : m_pNode( nullptr )
+        {
+        }
+
+        ArchiveBlockHandle( std::nullptr_t )
+            : m_pNode( nullptr )
+        {
+        }
+
+        ArchiveBlockHandle( const ArchiveBlockHandle& other )
+            : m_pNode( other.m_pNode )
+        {
+            if( m_pNode ) m_pNode->RefCount++;
+        }
+
+        ArchiveBlockHandle( ArchiveBlockHandle&& other ) noexcept
+            : m_pNode( other.m_pNode )
+        {
+            other.m_pNode = nullptr;
+        }
+
+        ~ArchiveBlockHandle()
+        {
+            reset();
+        }
+
+        ArchiveBlockHandle& operator=( const ArchiveBlockHandle& other )
+        {
+            ArchiveBlockHandle( other ).swap( *this );
+            return *this;
+        }
+
+        ArchiveBlockHandle& operator=( ArchiveBlockHandle&& other ) noexcept
+        {
+            ArchiveBlockHandle( std::move( other ) ).swap( *this );
+            return *this;
+        }
+
+        void reset()
+        {
+            if( m_pNode && --m_pNode->RefCount == 0 )
+                m_pNode->pPool->_Release( m_pNode );
+
+            m_pNode = nullptr;
+        }
+
+        void swap( ArchiveBlockHandle& other ) noexcept
+        {
+            std::swap( m_pNode, other.m_pNode );
+        }
+
+        BlockType* get() const { return m_pNode ? &m_pNode->Block : nullptr; }
+        BlockType* operator->() const { return &m_pNode->Block; }
+        BlockType& operator*() const { return m_pNode->Block; }
+        explicit operator bool() const { return m_pNode != nullptr; }
+
+    private:
+        friend class ArchiveBlockPool<BlockType>;
+
+        Node* m_pNode;
+
+        explicit ArchiveBlockHandle( Node* node )
+            : m_pNode( node )
+        {
+        }
+    };
+
+    // Fixed-size block allocator. Blocks are carved from chunks which are never returned
+    // to the heap until the pool is destroyed, so steady-state allocation is a free-list pop.
+    template<typename BlockType>
+    class ArchiveBlockPool
+    {
+    public:
+        static constexpr size_t BlocksPerChunk = 32;
+
+        ArchiveBlockPool()
+            : m_pChunks()
+            , m_pFreeList( nullptr )
+        {
+        }
+
+        ArchiveBlockPool( const ArchiveBlockPool& ) = delete;
+        ArchiveBlockPool& operator=( const ArchiveBlockPool& ) = delete;
+
+        // Allocates block with unspecified contents, the caller is expected to overwrite it.
+        ArchiveBlockHandle<BlockType> Allocate()
+        {
+            if( !m_pFreeList )
+                _AllocateChunk();
+
+            Node* node = m_pFreeList;
+            m_pFreeList = node->pNextFree;
+
+            node->pNextFree = nullptr;
+            node->RefCount = 1;
+
+            return ArchiveBlockHandle<BlockType>( node );
+        }
+
+        ArchiveBlockHandle<BlockType> Allocate( const BlockType& block )
+        {
+            ArchiveBlockHandle<BlockType> handle = Allocate();
+            *handle = block;
+
+            return handle;
+        }
+
+    private:
+        friend class ArchiveBlockHandle<BlockType>;
+
+        struct Node
+        {
+            BlockType               Block;
+            ArchiveBlockPool*       pPool;
+            Node*                   pNextFree;
+            uint32_t                RefCount;
+        };
+
+        std::vector<std::unique_ptr<Node[]>> m_pChunks;
+        Node* m_pFreeList;
+
+        void _AllocateChunk()
+        {
+            std::unique_ptr<Node[]> chunk( new Node[BlocksPerChunk] );
+
+            for( size_t i = 0; i < BlocksPerChunk; ++i )
+            {
+                chunk[i].pPool = this;
+                chunk[i].pNextFree = m_pFreeList;
+                chunk[i].RefCount = 0;
+                m_pFreeList = &chunk[i];
+            }
+
+            m_pChunks.push_back( std::move( chunk ) );
+        }
+
+        void _Release( Node* node )
+        {
+            node->pNextFree = m_pFreeList;
+            m_pFreeList = node;
+        }
+    };
+}
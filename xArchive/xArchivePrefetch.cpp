@@ -0,0 +1,301 @@
+#include "xArchivePrefetch.h"
+#include "xArchiveTrace.h"
+#include <algorithm>
+
+namespace xArchive
+{
+    void Archive::Prefetch( const std::vector<std::string>& paths )
+    {
+        ArchiveTraceScope traceScope( "Archive::Prefetch", "api" );
+
+        _CheckRead();
+
+        std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>> groups;
+
+        for( const std::string& path : paths )
+        {
+            ArchiveWorkloadScope workloadScope( this, ArchiveOperation::ePrefetch, path );
+
+            ArchiveDirectory directory;
+            const ArchiveEntry* entry = nullptr;
+
+            try
+            {
+                entry = &_GetEntry( path, directory );
+            }
+            catch( const std::invalid_argument& )
+            {
+                continue;
+            }
+
+            if( entry->Type == ArchiveEntryType::eFile )
+                _PrefetchEntry( *entry, groups );
+        }
+
+        _PrefetchSolidGroups( groups );
+    }
+
+    void Archive::PrefetchDirectory( std::string_view path, bool recursive )
+    {
+        ArchiveTraceScope traceScope( "Archive::PrefetchDirectory", "api" );
+        ArchiveWorkloadScope workloadScope( this, ArchiveOperation::ePrefetchDirectory, path );
+        workloadScope.Size = recursive ? static_cast<uint64_t>(ArchiveWorkloadFlags::eRecursive) : 0;
+
+        _CheckRead();
+
+        std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>> groups;
+
+        _PrefetchDirectory( _GetDirectoryOffset( path ), recursive, groups );
+        _PrefetchSolidGroups( groups );
+    }
+
+    void Archive::_PrefetchDirectory( uint64_t directoryOffset, bool recursive, std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>>& groups )
+    {
+        ArchiveDirectory directory;
+        uint64_t blockOffset = directoryOffset;
+
+        while( blockOffset != 0 )
+        {
+            _ReadDirectory( blockOffset, directory );
+
+            for( uint32_t i = 0; i < directory.NumEntries; ++i )
+            {
+                const ArchiveEntry& entry = directory.GetEntry( i );
+
+                if( entry.Type == ArchiveEntryType::eFile )
+                    _PrefetchEntry( entry, groups );
+
+                else if( recursive )
+                    _PrefetchDirectory( _GetEntryOffset( entry ), recursive, groups );
+            }
+
+            blockOffset = directory.Next;
+        }
+    }
+
+    void Archive::_PrefetchEntry( const ArchiveEntry& entry, std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>>& groups )
+    {
+        if( entry.IsInline() )
+            return;
+
+        if( entry.IsSolid() )
+        {
+            const uint64_t groupOffset = _GetEntryOffset( entry );
+
+            // Members of the same group usually follow each other
+            if( groupOffset == m_SolidCacheOffset || (!groups.empty() && groups.back().first == groupOffset) )
+                return;
+
+            ArchiveSolidGroupHeader groupHeader;
+            std::vector<ArchiveSolidMember> members;
+            _ReadSolidGroup( groupOffset, groupHeader, members );
+
+            m_pArchiveFile->Prefetch( static_cast<size_t>(groupOffset), static_cast<size_t>(groupHeader.GetGroupSize()) );
+
+            groups.emplace_back( groupOffset, groupHeader );
+        }
+        else if( entry.IsChunked() )
+        {
+            std::vector<ArchiveChunkReference> chunks;
+            _ReadChunkList( entry, chunks );
+
+            for( const ArchiveChunkReference& chunk : chunks )
+                m_pArchiveFile->Prefetch( static_cast<size_t>(chunk.Offset), chunk.Size );
+        }
+        else
+        {
+            m_pArchiveFile->Prefetch( static_cast<size_t>(_GetEntryOffset( entry )), static_cast<size_t>(entry.GetSize()) );
+        }
+    }
+
+    void Archive::_PrefetchSolidGroups( const std::vector<std::pair<uint64_t, ArchiveSolidGroupHeader>>& groups )
+    {
+        if( groups.empty() )
+            return;
+
+        UniqueArchiveFile file;
+
+        // Groups are inflated from the snapshot, files without snapshots are only hinted
+        try
+        {
+            file = m_pArchiveFile->Snapshot();
+        }
+        catch( const std::runtime_error& )
+        {
+            return;
+        }
+
+        if( !m_pPrefetcher )
+            m_pPrefetcher = std::make_unique<ArchivePrefetcher>();
+
+        m_pPrefetcher->Request( std::move( file ), groups );
+    }
+
+    ArchivePrefetcher::ArchivePrefetcher()
+        : m_Mutex()
+        , m_Condition()
+        , m_Requests()
+        , m_Pending()
+        , m_Groups()
+        , m_CacheOrder()
+        , m_CacheSize( 0 )
+        , m_NextRequestId( 1 )
+        , m_Exit( false )
+        , m_Thread()
+    {
+        m_Thread = std::thread( &ArchivePrefetcher::_Worker, this );
+    }
+
+    ArchivePrefetcher::~ArchivePrefetcher()
+    {
+        {
+            std::unique_lock<std::mutex> lock( m_Mutex );
+            m_Exit = true;
+        }
+
+        m_Condition.notify_all();
+        m_Thread.join();
+    }
+
+    void ArchivePrefetcher::Request( UniqueArchiveFile file, const std::vector<SolidGroup>& groups )
+    {
+        std::unique_lock<std::mutex> lock( m_Mutex );
+
+        PrefetchRequest request = { std::move( file ), {}, m_NextRequestId++ };
+
+        for( const SolidGroup& group : groups )
+        {
+            if( m_Groups.count( group.first ) || m_Pending.count( group.first ) )
+                continue;
+
+            m_Pending.emplace( group.first, request.Id );
+            request.Groups.push_back( group );
+        }
+
+        if( request.Groups.empty() )
+            return;
+
+        m_Requests.push_back( std::move( request ) );
+        m_Condition.notify_all();
+    }
+
+    ArchivePrefetcher::SolidData ArchivePrefetcher::Acquire( uint64_t offset )
+    {
+        std::unique_lock<std::mutex> lock( m_Mutex );
+
+        m_Condition.wait( lock, [&]() { return m_Pending.count( offset ) == 0; } );
+
+        auto group = m_Groups.find( offset );
+
+        return (group != m_Groups.end()) ? group->second : nullptr;
+    }
+
+    void ArchivePrefetcher::Invalidate( uint64_t offset, uint64_t size )
+    {
+        std::unique_lock<std::mutex> lock( m_Mutex );
+
+        auto inRange = [&]( uint64_t groupOffset )
+        {
+            return groupOffset >= offset && groupOffset - offset < size;
+        };
+
+        // Groups being inflated are dropped when done, their request no longer owns them
+        for( auto pending = m_Pending.begin(); pending != m_Pending.end(); )
+            pending = inRange( pending->first ) ? m_Pending.erase( pending ) : std::next( pending );
+
+        for( auto group = m_Groups.begin(); group != m_Groups.end(); )
+        {
+            if( !inRange( group->first ) )
+            {
+                ++group;
+                continue;
+            }
+
+            m_CacheSize -= group->second->size();
+            m_CacheOrder.erase( std::find( m_CacheOrder.begin(), m_CacheOrder.end(), group->first ) );
+            group = m_Groups.erase( group );
+        }
+
+        m_Condition.notify_all();
+    }
+
+    void ArchivePrefetcher::_Worker()
+    {
+        std::unique_lock<std::mutex> lock( m_Mutex );
+
+        while( true )
+        {
+            m_Condition.wait( lock, [this]() { return m_Exit || !m_Requests.empty(); } );
+
+            if( m_Exit )
+                break;
+
+            PrefetchRequest request = std::move( m_Requests.front() );
+            m_Requests.pop_front();
+
+            for( const SolidGroup& group : request.Groups )
+            {
+                auto isOwner = [&]()
+                {
+                    auto pending = m_Pending.find( group.first );
+                    return pending != m_Pending.end() && pending->second == request.Id;
+                };
+
+                if( m_Exit )
+                    break;
+
+                if( !isOwner() )
+                    continue;
+
+                lock.unlock();
+
+                std::shared_ptr<std::vector<char>> data = std::make_shared<std::vector<char>>();
+
+                try
+                {
+                    ArchiveTraceScope traceScope( "Archive::PrefetchSolidGroup", "compression" );
+
+                    Archive::_InflateSolidGroup( *request.File, group.first, group.second, *data );
+                }
+                catch( const std::exception& )
+                {
+                    // Reading the entry inflates the group again and reports the error
+                    data = nullptr;
+                }
+
+                lock.lock();
+
+                if( !isOwner() )
+                    continue;
+
+                m_Pending.erase( group.first );
+
+                if( data )
+                {
+                    ArchiveCounters::Add( ArchiveCounter::eSolidGroupsPrefetched, 1 );
+
+                    m_CacheSize += data->size();
+                    m_CacheOrder.push_back( group.first );
+                    m_Groups.emplace( group.first, std::move( data ) );
+
+                    _Evict();
+                }
+
+                m_Condition.notify_all();
+            }
+        }
+    }
+
+    void ArchivePrefetcher::_Evict()
+    {
+        // The most recent group is kept even if it exceeds the capacity alone
+        while( m_CacheSize > CacheCapacity && m_CacheOrder.size() > 1 )
+        {
+            auto group = m_Groups.find( m_CacheOrder.front() );
+
+            m_CacheSize -= group->second->size();
+            m_Groups.erase( group );
+            m_CacheOrder.pop_front();
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "xArchive.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace xArchive
+{
+    // Inflates solid groups requested by Archive::Prefetch on the background thread. Each request
+    // reads from its own snapshot of the archive file, so the archive may be used meanwhile.
+    // Inflated groups are kept until the cache capacity is exceeded, oldest ones are dropped first.
+    class ArchivePrefetcher
+    {
+    public:
+        using SolidGroup = std::pair<uint64_t, Archive::ArchiveSolidGroupHeader>;
+        using SolidData = std::shared_ptr<const std::vector<char>>;
+
+        // Maximum uncompressed size of the groups kept in memory
+        static constexpr size_t CacheCapacity = 64 * 1024 * 1024;
+
+        ArchivePrefetcher();
+        ~ArchivePrefetcher();
+
+        ArchivePrefetcher( const ArchivePrefetcher& ) = delete;
+        ArchivePrefetcher& operator=( const ArchivePrefetcher& ) = delete;
+
+        // Queues the groups which are not cached or queued already
+        void Request( UniqueArchiveFile file, const std::vector<SolidGroup>& groups );
+
+        // Returns data of the group, waits if the group is being inflated.
+        // Returns null if the group hasn't been requested or it has failed to inflate.
+        SolidData Acquire( uint64_t offset );
+
+        // Drops the groups starting in the range, which is about to be freed or moved
+        void Invalidate( uint64_t offset, uint64_t size );
+
+    private:
+        struct PrefetchRequest
+        {
+            UniqueArchiveFile       File;
+            std::vector<SolidGroup> Groups;
+            uint64_t                Id;
+        };
+
+        std::mutex                  m_Mutex;
+        // Signaled when a request is queued and when a group is done
+        std::condition_variable     m_Condition;
+        std::deque<PrefetchRequest>         m_Requests;
+        // Queued groups and id of the request which inflates them
+        std::unordered_map<uint64_t, uint64_t> m_Pending;
+        std::unordered_map<uint64_t, SolidData> m_Groups;
+        // Offsets of the cached groups in order of insertion
+        std::deque<uint64_t>        m_CacheOrder;
+        size_t                      m_CacheSize;
+        uint64_t                    m_NextRequestId;
+        bool                        m_Exit;
+        std::thread                 m_Thread;
+
+        void _Worker();
+        void _Evict();
+    };
+}
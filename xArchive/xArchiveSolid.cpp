@@ -0,0 +1,324 @@
+#include "xArchive.h"
+#include "xArchiveChecksum.h"
+#include "xArchivePrefetch.h"
+#include "xArchiveTrace.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
+#include <zlib.h>
+
+namespace xArchive
+{
+    namespace
+    {
+        // Type and similarity of the files are estimated from the beginning of their contents
+        constexpr size_t SampleSize = 16 * 1024;
+
+        // Files of the same type follow each other in the solid groups, similar files within
+        // the type are placed next to each other, so the compressor finds matches in the
+        // previous file within its window.
+        struct SolidOrderKey
+        {
+            bool                    Binary;
+            std::string             Extension;
+            // First bytes of the binary file, usually identify the file format
+            uint32_t                Magic;
+            uint64_t                Sketch;
+            size_t                  Index;
+
+            bool operator<( const SolidOrderKey& other ) const
+            {
+                return std::tie( Binary, Extension, Magic, Sketch, Index ) <
+                    std::tie( other.Binary, other.Extension, other.Magic, other.Sketch, other.Index );
+            }
+        };
+
+        std::string GetExtension( std::string_view name )
+        {
+            const size_t separator = name.find_last_of( '.' );
+
+            // Hidden files like ".gitignore" have no extension
+            if( separator == std::string_view::npos || separator == 0 )
+                return std::string();
+
+            std::string extension( name.substr( separator + 1 ) );
+
+            for( char& c : extension )
+                c = static_cast<char>(std::tolower( static_cast<unsigned char>(c) ));
+
+            return extension;
+        }
+
+        bool IsBinary( const char* data, size_t size )
+        {
+            for( size_t i = 0; i < size; ++i )
+            {
+                const unsigned char c = static_cast<unsigned char>(data[i]);
+
+                if( c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' )
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Minimum hash of all 4-byte sequences of the data. Files sharing most of their
+        // sequences likely have the same minimum, so sorting by it puts them together.
+        uint64_t ComputeSketch( const char* data, size_t size )
+        {
+            uint64_t sketch = ~uint64_t( 0 );
+
+            for( size_t i = 0; i + sizeof( uint32_t ) <= size; ++i )
+            {
+                uint32_t sequence;
+                memcpy( &sequence, data + i, sizeof( uint32_t ) );
+
+                uint64_t hash = sequence * 0x9E3779B97F4A7C15ull;
+                hash ^= hash >> 29;
+
+                sketch = std::min( sketch, hash );
+            }
+
+            return sketch;
+        }
+    }
+
+    uint64_t Archive::ArchiveSolidGroupHeader::GetGroupSize() const
+    {
+        return sizeof( ArchiveSolidGroupHeader ) + static_cast<uint64_t>(MemberCount) * sizeof( ArchiveSolidMember ) + CompressedSize;
+    }
+
+    uint32_t Archive::ArchiveSolidGroupHeader::ComputeChecksum( const ArchiveSolidMember* members ) const
+    {
+        const uint32_t headerChecksum = Crc32cExcludingField( this, sizeof( ArchiveSolidGroupHeader ), OffsetOf( ArchiveSolidGroupHeader, Checksum ) );
+
+        return Crc32c( members, MemberCount * sizeof( ArchiveSolidMember ), headerChecksum );
+    }
+
+    void Archive::_WriteSolidGroups( std::vector<ArchiveSolidItem>& items, uint32_t groupSize )
+    {
+        ArchiveTraceScope traceScope( "Archive::WriteSolidGroups", "io" );
+
+        std::vector<SolidOrderKey> keys( items.size() );
+        std::vector<char> buffer;
+
+        for( size_t i = 0; i < items.size(); ++i )
+        {
+            _ReadImportSource( *items[i].Source, buffer, SampleSize );
+
+            SolidOrderKey& key = keys[i];
+            key.Binary = IsBinary( buffer.data(), buffer.size() );
+            key.Extension = GetExtension( items[i].Name );
+            key.Magic = 0;
+            key.Sketch = ComputeSketch( buffer.data(), buffer.size() );
+            key.Index = i;
+
+            if( key.Binary && buffer.size() >= sizeof( uint32_t ) )
+                memcpy( &key.Magic, buffer.data(), sizeof( uint32_t ) );
+        }
+
+        std::sort( keys.begin(), keys.end() );
+
+        z_stream stream = {};
+        std::vector<ArchiveSolidMember> members;
+        std::vector<char> compressedData;
+        uint64_t uncompressedSize = 0;
+        size_t firstKey = 0;
+
+        auto compress = [&]( const void* data, size_t size, int flush )
+        {
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+            stream.avail_in = static_cast<uInt>(size);
+
+            int result = Z_OK;
+
+            do
+            {
+                const size_t compressedSize = compressedData.size() - stream.avail_out;
+
+                if( stream.avail_out == 0 )
+                    compressedData.resize( std::max<size_t>( compressedData.size() * 2, 64 * 1024 ) );
+
+                stream.next_out = reinterpret_cast<Bytef*>(compressedData.data() + compressedSize);
+                stream.avail_out = static_cast<uInt>(compressedData.size() - compressedSize);
+
+                result = deflate( &stream, flush );
+
+                if( result == Z_STREAM_ERROR )
+                    throw std::runtime_error( "Error while compressing solid group" );
+            }
+            while( stream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END) );
+        };
+
+        try
+        {
+            for( size_t k = 0; k <= keys.size(); ++k )
+            {
+                // The group is written when the next file doesn't fit in it
+                if( !members.empty() && (k == keys.size() ||
+                    members.size() == ArchiveSolidGroupHeader::MaxMembers ||
+                    uncompressedSize + items[keys[k].Index].Source->Size > groupSize) )
+                {
+                    compress( nullptr, 0, Z_FINISH );
+
+                    compressedData.resize( compressedData.size() - stream.avail_out );
+                    deflateEnd( &stream );
+
+                    const uint64_t groupOffset = _WriteSolidGroup( members, compressedData );
+
+                    for( size_t i = firstKey; i < k; ++i )
+                        items[keys[i].Index].Offset = groupOffset;
+
+                    members.clear();
+                    firstKey = k;
+                }
+
+                if( k == keys.size() )
+                    break;
+
+                if( members.empty() )
+                {
+                    // Raw deflate stream, the group has its own header
+                    stream = z_stream();
+
+                    if( deflateInit2( &stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY ) != Z_OK )
+                        throw std::runtime_error( "Error while compressing solid group" );
+
+                    compressedData.clear();
+                    uncompressedSize = 0;
+                }
+
+                ArchiveSolidItem& item = items[keys[k].Index];
+
+                _ReadImportSource( *item.Source, buffer );
+
+                item.Checksum = Crc32c( buffer.data(), buffer.size() );
+                item.Member = static_cast<uint8_t>(members.size());
+
+                members.push_back( ArchiveSolidMember{ uncompressedSize, buffer.size() } );
+                uncompressedSize += buffer.size();
+
+                compress( buffer.data(), buffer.size(), Z_NO_FLUSH );
+            }
+        }
+        catch( ... )
+        {
+            // Source of the file may fail to read in the middle of the group
+            deflateEnd( &stream );
+            throw;
+        }
+    }
+
+    uint64_t Archive::_WriteSolidGroup( const std::vector<ArchiveSolidMember>& members, const std::vector<char>& compressedData )
+    {
+        ArchiveSolidGroupHeader groupHeader = {};
+        groupHeader.Magic = ArchiveMagic::eSolidGroup;
+        groupHeader.MemberCount = static_cast<uint32_t>(members.size());
+        groupHeader.ReferenceCount = static_cast<uint32_t>(members.size());
+        groupHeader.CompressedSize = compressedData.size();
+        groupHeader.UncompressedSize = members.back().Offset + members.back().Size;
+        groupHeader.Checksum = groupHeader.ComputeChecksum( members.data() );
+
+        // Groups are never packed into shared sectors, Slot of their entries holds the member index
+        const uint64_t groupOffset = m_pAllocator->Allocate( std::max<uint64_t>( groupHeader.GetGroupSize(), m_pAllocator->GetAllocationSize() ) );
+
+        m_pArchiveFile->Seek( groupOffset );
+        m_pArchiveFile->Write( &groupHeader, sizeof( ArchiveSolidGroupHeader ) );
+        m_pArchiveFile->Write( members.data(), members.size() * sizeof( ArchiveSolidMember ) );
+        m_pArchiveFile->Write( compressedData.data(), compressedData.size() );
+
+        return groupOffset;
+    }
+
+    void Archive::_ReadSolidGroup( uint64_t offset, ArchiveSolidGroupHeader& groupHeader, std::vector<ArchiveSolidMember>& members )
+    {
+        m_pArchiveFile->Seek( offset );
+        m_pArchiveFile->Read( &groupHeader, sizeof( ArchiveSolidGroupHeader ) );
+
+        if( groupHeader.Magic != ArchiveMagic::eSolidGroup ||
+            groupHeader.MemberCount == 0 ||
+            groupHeader.MemberCount > ArchiveSolidGroupHeader::MaxMembers )
+            throw std::runtime_error( "Archive file corrupted" );
+
+        members.resize( groupHeader.MemberCount );
+        m_pArchiveFile->Read( members.data(), members.size() * sizeof( ArchiveSolidMember ) );
+
+        if( m_VerifyChecksums && groupHeader.Checksum != groupHeader.ComputeChecksum( members.data() ) )
+            throw std::runtime_error( "Archive file corrupted" );
+    }
+
+    void Archive::_InflateSolidGroup( ArchiveFile& file, uint64_t offset, const ArchiveSolidGroupHeader& groupHeader, std::vector<char>& data )
+    {
+        ArchiveTraceScope traceScope( "Archive::InflateSolidGroup", "compression" );
+
+        std::vector<char> compressedData( static_cast<size_t>(groupHeader.CompressedSize) );
+
+        file.Seek( offset + groupHeader.GetGroupSize() - groupHeader.CompressedSize );
+        file.Read( compressedData.data(), compressedData.size() );
+
+        data.resize( static_cast<size_t>(groupHeader.UncompressedSize) );
+
+        z_stream stream = {};
+
+        if( inflateInit2( &stream, -MAX_WBITS ) != Z_OK )
+            throw std::runtime_error( "Error while decompressing solid group" );
+
+        stream.next_in = reinterpret_cast<Bytef*>(compressedData.data());
+        stream.avail_in = static_cast<uInt>(compressedData.size());
+        stream.next_out = reinterpret_cast<Bytef*>(data.data());
+        stream.avail_out = static_cast<uInt>(data.size());
+
+        const int result = inflate( &stream, Z_FINISH );
+        const bool complete = (result == Z_STREAM_END && stream.avail_out == 0);
+
+        inflateEnd( &stream );
+
+        if( !complete )
+            throw std::runtime_error( "Archive file corrupted" );
+    }
+
+    void Archive::_ReadSolidMember( const ArchiveEntry& entry, void* buffer )
+    {
+        const uint64_t groupOffset = _GetEntryOffset( entry );
+
+        ArchiveSolidGroupHeader groupHeader;
+        std::vector<ArchiveSolidMember> members;
+        _ReadSolidGroup( groupOffset, groupHeader, members );
+
+        if( entry.Slot >= members.size() ||
+            members[entry.Slot].Size != entry.GetSize() ||
+            members[entry.Slot].Offset + members[entry.Slot].Size > groupHeader.UncompressedSize )
+            throw std::runtime_error( "Archive file corrupted" );
+
+        // Members are usually read together, so the whole group is kept for the following reads
+        if( m_SolidCacheOffset != groupOffset )
+        {
+            m_SolidCacheOffset = 0;
+            m_SolidCache = nullptr;
+
+            // The group may have been inflated in the background by Prefetch
+            if( m_pPrefetcher )
+                m_SolidCache = m_pPrefetcher->Acquire( groupOffset );
+
+            if( m_SolidCache )
+            {
+                ArchiveCounters::Add( ArchiveCounter::ePrefetchHits, 1 );
+            }
+            else
+            {
+                auto data = std::make_shared<std::vector<char>>();
+                _InflateSolidGroup( *m_pArchiveFile, groupOffset, groupHeader, *data );
+
+                ArchiveCounters::Add( ArchiveCounter::eSolidGroupsInflated, 1 );
+                m_SolidCache = std::move( data );
+            }
+
+            m_SolidCacheOffset = groupOffset;
+        }
+
+        const ArchiveSolidMember& member = members[entry.Slot];
+        memcpy( buffer, m_SolidCache->data() + member.Offset, static_cast<size_t>(member.Size) );
+    }
+}
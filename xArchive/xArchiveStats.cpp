@@ -0,0 +1,40 @@
+#include "xArchiveStats.h"
+
+namespace xArchive
+{
+    ArchiveCounters::Counter ArchiveCounters::s_Counters[static_cast<uint32_t>(ArchiveCounter::eCount)] = {};
+
+    ArchiveStats ArchiveCounters::Get()
+    {
+        auto get = []( ArchiveCounter counter )
+        {
+            return s_Counters[static_cast<uint32_t>(counter)].Value.load( std::memory_order_relaxed );
+        };
+
+        ArchiveStats stats;
+        stats.DirectoryLookups = get( ArchiveCounter::eDirectoryLookups );
+        stats.DirectoryBlocksRead = get( ArchiveCounter::eDirectoryBlocksRead );
+        stats.AllocationBlocksScanned = get( ArchiveCounter::eAllocationBlocksScanned );
+        stats.HeaderFlushes = get( ArchiveCounter::eHeaderFlushes );
+        stats.BytesRead = get( ArchiveCounter::eBytesRead );
+        stats.BytesWritten = get( ArchiveCounter::eBytesWritten );
+        stats.Relocations = get( ArchiveCounter::eRelocations );
+        stats.BytesRelocated = get( ArchiveCounter::eBytesRelocated );
+        stats.BytesCompressed = get( ArchiveCounter::eBytesCompressed );
+        stats.BytesDecompressed = get( ArchiveCounter::eBytesDecompressed );
+        stats.BytesStoredRaw = get( ArchiveCounter::eBytesStoredRaw );
+        stats.SolidGroupsInflated = get( ArchiveCounter::eSolidGroupsInflated );
+        stats.SolidGroupsPrefetched = get( ArchiveCounter::eSolidGroupsPrefetched );
+        stats.PrefetchHits = get( ArchiveCounter::ePrefetchHits );
+        stats.CompressionTime = std::chrono::nanoseconds( get( ArchiveCounter::eCompressionTime ) );
+        stats.DecompressionTime = std::chrono::nanoseconds( get( ArchiveCounter::eDecompressionTime ) );
+
+        return stats;
+    }
+
+    void ArchiveCounters::Reset()
+    {
+        for( Counter& counter : s_Counters )
+            counter.Value.store( 0, std::memory_order_relaxed );
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Counting costs a relaxed atomic add per event, define XARCHIVE_DISABLE_STATS
+// to compile the counters out completely.
+
+namespace xArchive
+{
+    // Counters of the library hot paths, shared by all archives in the process.
+    struct ArchiveStats
+    {
+        // Path components looked up in the directories and directory blocks read meanwhile
+        uint64_t                DirectoryLookups;
+        uint64_t                DirectoryBlocksRead;
+        // Allocation table blocks (32 sectors each) scanned while searching for free space
+        uint64_t                AllocationBlocksScanned;
+        uint64_t                HeaderFlushes;
+        uint64_t                BytesRead;
+        uint64_t                BytesWritten;
+        // Allocations moved by the allocator to grow in place
+        uint64_t                Relocations;
+        uint64_t                BytesRelocated;
+        // Uncompressed sizes of the archive files saved and loaded
+        uint64_t                BytesCompressed;
+        uint64_t                BytesDecompressed;
+        // Part of the compressed bytes stored without compression, because it was incompressible
+        uint64_t                BytesStoredRaw;
+        // Solid groups inflated when read and in the background by Archive::Prefetch
+        uint64_t                SolidGroupsInflated;
+        uint64_t                SolidGroupsPrefetched;
+        // Reads of the solid groups which have already been inflated in the background
+        uint64_t                PrefetchHits;
+        std::chrono::nanoseconds CompressionTime;
+        std::chrono::nanoseconds DecompressionTime;
+    };
+
+    enum class ArchiveCounter : uint32_t
+    {
+        eDirectoryLookups,
+        eDirectoryBlocksRead,
+        eAllocationBlocksScanned,
+        eHeaderFlushes,
+        eBytesRead,
+        eBytesWritten,
+        eRelocations,
+        eBytesRelocated,
+        eBytesCompressed,
+        eBytesDecompressed,
+        eBytesStoredRaw,
+        eSolidGroupsInflated,
+        eSolidGroupsPrefetched,
+        ePrefetchHits,
+        eCompressionTime,
+        eDecompressionTime,
+        eCount
+    };
+
+    class ArchiveCounters
+    {
+    public:
+        static void Add( ArchiveCounter counter, uint64_t value )
+        {
+#ifndef XARCHIVE_DISABLE_STATS
+            s_Counters[static_cast<uint32_t>(counter)].Value.fetch_add( value, std::memory_order_relaxed );
+#endif
+        }
+
+        static ArchiveStats Get();
+        static void Reset();
+
+    private:
+        // Each counter has its own cache line, so threads counting different events don't contend
+        struct alignas(64) Counter
+        {
+            std::atomic<uint64_t> Value;
+        };
+
+        static Counter s_Counters[static_cast<uint32_t>(ArchiveCounter::eCount)];
+    };
+
+    // Accumulates events locally and adds them to the counter when going out of scope.
+    class ArchiveScopedCounter
+    {
+    public:
+        explicit ArchiveScopedCounter( ArchiveCounter counter )
+            : m_Counter( counter )
+            , m_Value( 0 )
+        {
+        }
+
+        ~ArchiveScopedCounter()
+        {
+            if( m_Value != 0 )
+                ArchiveCounters::Add( m_Counter, m_Value );
+        }
+
+        ArchiveScopedCounter& operator+=( uint64_t value )
+        {
+#ifndef XARCHIVE_DISABLE_STATS
+            m_Value += value;
+#endif
+            return *this;
+        }
+
+    private:
+        ArchiveCounter m_Counter;
+        uint64_t m_Value;
+    };
+
+    // Adds time spent in the scope to the counter.
+    class ArchiveScopedTimer
+    {
+    public:
+        explicit ArchiveScopedTimer( ArchiveCounter counter )
+            : m_Counter( counter )
+#ifndef XARCHIVE_DISABLE_STATS
+            , m_StartTime( std::chrono::steady_clock::now() )
+#endif
+        {
+        }
+
+        ~ArchiveScopedTimer()
+        {
+#ifndef XARCHIVE_DISABLE_STATS
+            const auto duration = std::chrono::steady_clock::now() - m_StartTime;
+            ArchiveCounters::Add( m_Counter, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() );
+#endif
+        }
+
+    private:
+        ArchiveCounter m_Counter;
+#ifndef XARCHIVE_DISABLE_STATS
+        std::chrono::steady_clock::time_point m_StartTime;
+#endif
+    };
+}
@@ -0,0 +1,217 @@
+#include "xArchiveTrace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace xArchive
+{
+    namespace
+    {
+        // Fields are atomic, so the buffer can be exported while the owning thread writes it.
+        struct TraceEvent
+        {
+            std::atomic<const char*> Name;
+            std::atomic<const char*> Category;
+            std::atomic<uint64_t> StartTime;
+            std::atomic<uint64_t> EndTime;
+        };
+
+        struct TraceBuffer
+        {
+            uint32_t ThreadId = 0;
+            // Cleared when the owning thread exits, the buffer is then reused by a new thread
+            bool InUse = false;
+
+            // Events are written only by the owning thread. The slot is reserved before it's
+            // overwritten, so the reader can drop events which may have changed while copied.
+            std::atomic<uint64_t> ReservedCount{ 0 };
+            std::atomic<uint64_t> CommittedCount{ 0 };
+            // Events before this index have been cleared
+            std::atomic<uint64_t> ClearedCount{ 0 };
+
+            TraceEvent Events[ArchiveTracing::BufferCapacity];
+        };
+
+        struct TraceRegistry
+        {
+            std::mutex Mutex;
+            std::vector<std::unique_ptr<TraceBuffer>> Buffers;
+        };
+
+        TraceRegistry& GetTraceRegistry()
+        {
+            // Never destroyed, threads may record events during static destruction
+            static TraceRegistry* registry = new TraceRegistry();
+            return *registry;
+        }
+
+        // Buffer of the current thread, acquired on the first recorded event.
+        class ThreadTraceBuffer
+        {
+        public:
+            ~ThreadTraceBuffer()
+            {
+                if( !m_pBuffer )
+                    return;
+
+                TraceRegistry& registry = GetTraceRegistry();
+                std::unique_lock<std::mutex> lock( registry.Mutex );
+
+                m_pBuffer->InUse = false;
+            }
+
+            TraceBuffer& Get()
+            {
+                if( !m_pBuffer )
+                    m_pBuffer = _Acquire();
+
+                return *m_pBuffer;
+            }
+
+        private:
+            TraceBuffer* m_pBuffer = nullptr;
+
+            static TraceBuffer* _Acquire()
+            {
+                TraceRegistry& registry = GetTraceRegistry();
+                std::unique_lock<std::mutex> lock( registry.Mutex );
+
+                for( const auto& buffer : registry.Buffers )
+                {
+                    if( !buffer->InUse )
+                    {
+                        buffer->InUse = true;
+                        return buffer.get();
+                    }
+                }
+
+                registry.Buffers.push_back( std::make_unique<TraceBuffer>() );
+
+                TraceBuffer* buffer = registry.Buffers.back().get();
+                buffer->ThreadId = static_cast<uint32_t>(registry.Buffers.size());
+                buffer->InUse = true;
+
+                return buffer;
+            }
+        };
+
+        thread_local ThreadTraceBuffer CurrentThreadBuffer;
+    }
+
+    std::atomic<bool> ArchiveTracing::s_Enabled( false );
+
+    void ArchiveTracing::Enable( bool enable )
+    {
+        s_Enabled.store( enable, std::memory_order_relaxed );
+    }
+
+    uint64_t ArchiveTracing::Now()
+    {
+        static const auto startTime = std::chrono::steady_clock::now();
+
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    void ArchiveTracing::Record( const char* name, const char* category, uint64_t startTime, uint64_t endTime )
+    {
+        TraceBuffer& buffer = CurrentThreadBuffer.Get();
+
+        const uint64_t index = buffer.CommittedCount.load( std::memory_order_relaxed );
+        TraceEvent& event = buffer.Events[index % BufferCapacity];
+
+        buffer.ReservedCount.store( index + 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+
+        event.Name.store( name, std::memory_order_relaxed );
+        event.Category.store( category, std::memory_order_relaxed );
+        event.StartTime.store( startTime, std::memory_order_relaxed );
+        event.EndTime.store( endTime, std::memory_order_relaxed );
+
+        buffer.CommittedCount.store( index + 1, std::memory_order_release );
+    }
+
+    void ArchiveTracing::Save( const std::string& filename )
+    {
+        std::ofstream file( filename, std::ios::out | std::ios::trunc );
+
+        if( !file )
+            throw std::runtime_error( (std::string( filename ) + " cannot be opened").c_str() );
+
+        struct Event
+        {
+            const char* Name;
+            const char* Category;
+            uint64_t StartTime;
+            uint64_t EndTime;
+        };
+
+        std::vector<Event> events;
+        bool first = true;
+
+        // Times are in microseconds with nanosecond fraction
+        file << std::fixed << std::setprecision( 3 );
+        file << "{\"traceEvents\":[";
+
+        TraceRegistry& registry = GetTraceRegistry();
+        std::unique_lock<std::mutex> lock( registry.Mutex );
+
+        for( const auto& buffer : registry.Buffers )
+        {
+            const uint64_t committedCount = buffer->CommittedCount.load( std::memory_order_acquire );
+            const uint64_t oldestIndex = (committedCount > BufferCapacity) ? committedCount - BufferCapacity : 0;
+            const uint64_t firstIndex = std::max( oldestIndex, buffer->ClearedCount.load( std::memory_order_relaxed ) );
+
+            events.clear();
+
+            for( uint64_t index = firstIndex; index < committedCount; ++index )
+            {
+                const TraceEvent& event = buffer->Events[index % BufferCapacity];
+
+                events.push_back( Event{
+                    event.Name.load( std::memory_order_relaxed ),
+                    event.Category.load( std::memory_order_relaxed ),
+                    event.StartTime.load( std::memory_order_relaxed ),
+                    event.EndTime.load( std::memory_order_relaxed ) } );
+            }
+
+            // Events in slots reserved by the writer meanwhile may be torn
+            std::atomic_thread_fence( std::memory_order_acquire );
+            const uint64_t reservedCount = buffer->ReservedCount.load( std::memory_order_relaxed );
+            const uint64_t validIndex = (reservedCount > BufferCapacity) ? reservedCount - BufferCapacity : 0;
+            const size_t skippedCount = static_cast<size_t>(std::min<uint64_t>( events.size(), (validIndex > firstIndex) ? validIndex - firstIndex : 0 ));
+
+            if( skippedCount == events.size() )
+                continue;
+
+            file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->ThreadId
+                << ",\"args\":{\"name\":\"Thread " << buffer->ThreadId << "\"}}";
+            first = false;
+
+            for( size_t i = skippedCount; i < events.size(); ++i )
+            {
+                const Event& event = events[i];
+
+                file << ",\n{\"name\":\"" << event.Name << "\",\"cat\":\"" << event.Category
+                    << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->ThreadId
+                    << ",\"ts\":" << (event.StartTime / 1000.0)
+                    << ",\"dur\":" << ((event.EndTime - event.StartTime) / 1000.0) << "}";
+            }
+        }
+
+        file << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    }
+
+    void ArchiveTracing::Clear()
+    {
+        TraceRegistry& registry = GetTraceRegistry();
+        std::unique_lock<std::mutex> lock( registry.Mutex );
+
+        for( const auto& buffer : registry.Buffers )
+            buffer->ClearedCount.store( buffer->CommittedCount.load( std::memory_order_acquire ), std::memory_order_relaxed );
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace xArchive
+{
+    // Scoped trace events of all archives in the process. Each thread records its events into
+    // its own ring buffer without locking, the buffers are exported in Chrome trace format,
+    // which can be opened in chrome://tracing or Perfetto.
+    class ArchiveTracing
+    {
+    public:
+        // Number of the most recent events kept for each thread.
+        static constexpr uint32_t BufferCapacity = 16384;
+
+        static void Enable( bool enable );
+
+        static bool IsEnabled()
+        {
+            return s_Enabled.load( std::memory_order_relaxed );
+        }
+
+        // Returns nanoseconds since the first call.
+        static uint64_t Now();
+
+        // Name and category must be string literals, only the pointers are stored.
+        static void Record( const char* name, const char* category, uint64_t startTime, uint64_t endTime );
+
+        static void Save( const std::string& filename );
+        static void Clear();
+
+    private:
+        static std::atomic<bool> s_Enabled;
+    };
+
+    // Records the event covering the scope. When tracing is disabled, the scope costs a single load.
+    class ArchiveTraceScope
+    {
+    public:
+        ArchiveTraceScope( const char* name, const char* category )
+            : m_Name( name )
+            , m_Category( category )
+            , m_Enabled( ArchiveTracing::IsEnabled() )
+            , m_StartTime( m_Enabled ? ArchiveTracing::Now() : 0 )
+        {
+        }
+
+        ~ArchiveTraceScope()
+        {
+            if( m_Enabled )
+                ArchiveTracing::Record( m_Name, m_Category, m_StartTime, ArchiveTracing::Now() );
+        }
+
+        ArchiveTraceScope( const ArchiveTraceScope& ) = delete;
+        ArchiveTraceScope& operator=( const ArchiveTraceScope& ) = delete;
+
+    private:
+        const char* m_Name;
+        const char* m_Category;
+        bool m_Enabled;
+        uint64_t m_StartTime;
+    };
+}
@@ -0,0 +1,689 @@
+#include "xArchive.h"
+#include "xArchiveChecksum.h"
+#include "xArchiveTrace.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace xArchive
+{
+    // Consistency check of the archive snapshot. Directories and files are processed by
+    // the worker threads, each reading from its own snapshot, allocations are cross-checked
+    // with the allocation table once the whole tree has been walked.
+    class ArchiveVerifier
+    {
+    public:
+        ArchiveVerifier( Archive* archive, const ArchiveVerifyOptions& options );
+
+        ArchiveVerifyResult Run();
+
+    private:
+        struct Task
+        {
+            uint64_t                Offset;
+            uint64_t                ParentOffset;
+            std::string             Path;
+            bool                    IsFile;
+            Archive::ArchiveEntry   Entry;
+            uint32_t                Checksum;
+        };
+
+        struct Allocation
+        {
+            uint64_t                Offset;
+            uint64_t                Size;
+            bool                    Slot;
+            std::string             Owner;
+        };
+
+        // Entry referencing the member of the solid group
+        struct SolidReference
+        {
+            uint32_t                Member;
+            uint64_t                Size;
+            bool                    HasChecksum;
+            uint32_t                Checksum;
+            std::string             Path;
+        };
+
+        using SolidReferenceMap = std::unordered_map<uint64_t, std::vector<SolidReference>>;
+
+        // Occupancy of the shared sector and slots used by the entries
+        struct SlotSector
+        {
+            uint32_t                SlotSize;
+            uint64_t                Occupancy;
+            uint64_t                Used;
+        };
+
+        Archive*                    m_pArchive;
+        ArchiveVerifyOptions        m_Options;
+
+        std::mutex                  m_Mutex;
+        std::condition_variable     m_TaskAvailable;
+        std::deque<Task>            m_Tasks;
+        // Tasks queued or being processed
+        uint64_t                    m_PendingTasks;
+        std::unordered_set<uint64_t> m_VisitedBlocks;
+
+        std::vector<Allocation>     m_Allocations;
+        std::unordered_map<uint64_t, uint32_t> m_ChunkReferences;
+        SolidReferenceMap           m_SolidReferences;
+        std::vector<std::string>    m_Issues;
+
+        std::atomic<uint64_t>       m_DirectoryCount;
+        std::atomic<uint64_t>       m_FileCount;
+        std::atomic<uint64_t>       m_BytesVerified;
+
+        void _Worker();
+        void _VerifyDirectory( Archive& reader, const Task& task, std::vector<Task>& tasks, std::vector<Allocation>& allocations, std::vector<std::string>& issues );
+        void _VerifyFile( Archive& reader, const Task& task, std::vector<char>& buffer, std::vector<Allocation>& allocations, std::unordered_map<uint64_t, uint32_t>& chunkReferences, SolidReferenceMap& solidReferences, std::vector<std::string>& issues );
+        void _VerifySolidGroups( uint32_t threadCount );
+        void _VerifySolidGroup( Archive& reader, uint64_t offset, const std::vector<SolidReference>& references, std::vector<char>& buffer, std::vector<Allocation>& allocations, std::vector<std::string>& issues );
+        void _VerifyAllocations();
+    };
+
+    template<typename Value>
+    static std::string ToHex( Value value )
+    {
+        std::stringstream stringBuilder;
+        stringBuilder << "0x" << std::hex << value;
+
+        return stringBuilder.str();
+    }
+
+    ArchiveVerifyResult Archive::Verify( const ArchiveVerifyOptions& options )
+    {
+        ArchiveTraceScope traceScope( "Archive::Verify", "api" );
+
+        _CheckRead();
+
+        UniqueArchive snapshot( Snapshot() );
+
+        ArchiveVerifier verifier( snapshot.get(), options );
+        return verifier.Run();
+    }
+
+    ArchiveVerifier::ArchiveVerifier( Archive* archive, const ArchiveVerifyOptions& options )
+        : m_pArchive( archive )
+        , m_Options( options )
+        , m_Mutex()
+        , m_TaskAvailable()
+        , m_Tasks()
+        , m_PendingTasks( 0 )
+        , m_VisitedBlocks()
+        , m_Allocations()
+        , m_ChunkReferences()
+        , m_SolidReferences()
+        , m_Issues()
+        , m_DirectoryCount( 0 )
+        , m_FileCount( 0 )
+        , m_BytesVerified( 0 )
+    {
+    }
+
+    ArchiveVerifyResult ArchiveVerifier::Run()
+    {
+        const auto startTime = std::chrono::steady_clock::now();
+
+        Task root = {};
+        root.Offset = OffsetOf( Archive::ArchiveHeader, Root );
+        root.Path = "/";
+
+        m_Tasks.push_back( root );
+        m_PendingTasks = 1;
+
+        uint32_t threadCount = m_Options.ThreadCount;
+
+        if( threadCount == 0 )
+            threadCount = std::max( 1u, std::thread::hardware_concurrency() );
+
+        std::vector<std::thread> workers;
+
+        for( uint32_t i = 0; i < threadCount; ++i )
+            workers.emplace_back( &ArchiveVerifier::_Worker, this );
+
+        for( std::thread& worker : workers )
+            worker.join();
+
+        // Members of each solid group are checked together, so the group is inflated once
+        _VerifySolidGroups( threadCount );
+        _VerifyAllocations();
+
+        std::sort( m_Issues.begin(), m_Issues.end() );
+
+        ArchiveVerifyResult result;
+        result.DirectoryCount = m_DirectoryCount;
+        result.FileCount = m_FileCount;
+        result.BytesVerified = m_BytesVerified;
+        result.Duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+        result.Issues = std::move( m_Issues );
+
+        return result;
+    }
+
+    void ArchiveVerifier::_Worker()
+    {
+        // Snapshots of the same snapshot share all pages and can be read without locking
+        UniqueArchive reader( m_pArchive->Snapshot() );
+
+        std::vector<Task> tasks;
+        std::vector<Allocation> allocations;
+        std::unordered_map<uint64_t, uint32_t> chunkReferences;
+        SolidReferenceMap solidReferences;
+        std::vector<std::string> issues;
+        std::vector<char> buffer;
+
+        while( true )
+        {
+            Task task;
+
+            {
+                std::unique_lock<std::mutex> lock( m_Mutex );
+                m_TaskAvailable.wait( lock, [this]() { return !m_Tasks.empty() || m_PendingTasks == 0; } );
+
+                if( m_Tasks.empty() )
+                    break;
+
+                task = std::move( m_Tasks.front() );
+                m_Tasks.pop_front();
+            }
+
+            try
+            {
+                if( task.IsFile )
+                    _VerifyFile( *reader, task, buffer, allocations, chunkReferences, solidReferences, issues );
+                else
+                    _VerifyDirectory( *reader, task, tasks, allocations, issues );
+            }
+            catch( const std::exception& exception )
+            {
+                issues.push_back( task.Path + ": " + exception.what() );
+            }
+
+            {
+                std::unique_lock<std::mutex> lock( m_Mutex );
+
+                for( Task& newTask : tasks )
+                    m_Tasks.push_back( std::move( newTask ) );
+
+                m_PendingTasks += tasks.size();
+                m_PendingTasks--;
+            }
+
+            tasks.clear();
+            m_TaskAvailable.notify_all();
+        }
+
+        std::unique_lock<std::mutex> lock( m_Mutex );
+
+        m_Allocations.insert( m_Allocations.end(), allocations.begin(), allocations.end() );
+        m_Issues.insert( m_Issues.end(), issues.begin(), issues.end() );
+
+        for( const auto& chunkReference : chunkReferences )
+            m_ChunkReferences[chunkReference.first] += chunkReference.second;
+
+        for( auto& solidReference : solidReferences )
+        {
+            std::vector<SolidReference>& references = m_SolidReferences[solidReference.first];
+            references.insert( references.end(), solidReference.second.begin(), solidReference.second.end() );
+        }
+    }
+
+    void ArchiveVerifier::_VerifyDirectory( Archive& reader, const Task& task, std::vector<Task>& tasks, std::vector<Allocation>& allocations, std::vector<std::string>& issues )
+    {
+        using ArchiveDirectory = Archive::ArchiveDirectory;
+        using ArchiveEntry = Archive::ArchiveEntry;
+
+        m_DirectoryCount++;
+
+        ArchiveDirectory block;
+        uint64_t blockOffset = task.Offset;
+
+        while( blockOffset != 0 )
+        {
+            {
+                std::unique_lock<std::mutex> lock( m_Mutex );
+
+                if( !m_VisitedBlocks.insert( blockOffset ).second )
+                {
+                    issues.push_back( task.Path + ": directory block at " + ToHex( blockOffset ) + " is referenced more than once" );
+                    return;
+                }
+            }
+
+            // Root directory is stored in the header
+            if( blockOffset != OffsetOf( Archive::ArchiveHeader, Root ) )
+                allocations.push_back( Allocation{ blockOffset, sizeof( ArchiveDirectory ), false, task.Path } );
+
+            reader._ReadDirectory( blockOffset, block );
+
+            // Entries of the damaged block can't be trusted
+            if( block.Checksum != block.ComputeChecksum() )
+            {
+                issues.push_back( task.Path + ": directory block at " + ToHex( blockOffset ) + " has invalid checksum" );
+                return;
+            }
+
+            if( block.Parent != task.ParentOffset )
+                issues.push_back( task.Path + ": directory block at " + ToHex( blockOffset ) + " has invalid parent link" );
+
+            if( block.HeapOffset > ArchiveDirectory::DataSize || sizeof( ArchiveEntry ) * block.NumEntries > block.HeapOffset )
+            {
+                issues.push_back( task.Path + ": directory block at " + ToHex( blockOffset ) + " has invalid layout" );
+                return;
+            }
+
+            for( uint32_t i = 0; i < block.NumEntries; ++i )
+            {
+                const ArchiveEntry& entry = block.GetEntry( i );
+
+                if( entry.NameLength == 0 || entry.NameOffset < block.HeapOffset ||
+                    entry.NameOffset + entry.GetHeapSize() > ArchiveDirectory::DataSize )
+                {
+                    issues.push_back( task.Path + ": entry " + std::to_string( i ) + " of directory block at " + ToHex( blockOffset ) + " has invalid name" );
+                    continue;
+                }
+
+                Task entryTask = {};
+                entryTask.Path = task.Path + std::string( block.GetEntryName( i ) );
+                entryTask.Entry = entry;
+
+                if( entry.Type == ArchiveEntryType::eDirectory )
+                {
+                    if( entry.Flags != 0 )
+                    {
+                        issues.push_back( entryTask.Path + ": directory entry has invalid flags" );
+                        continue;
+                    }
+
+                    entryTask.Offset = reader._GetEntryOffset( entry );
+                    entryTask.ParentOffset = task.Offset;
+                    entryTask.Path += "/";
+                }
+
+                else if( entry.Type == ArchiveEntryType::eFile )
+                {
+                    // Inline data is covered by the checksum of the block
+                    if( entry.IsInline() )
+                    {
+                        m_FileCount++;
+                        continue;
+                    }
+
+                    entryTask.IsFile = true;
+                    entryTask.Offset = reader._GetEntryOffset( entry );
+                    entryTask.Checksum = entry.HasChecksum() ? block.GetEntryChecksum( entry ) : 0;
+                }
+
+                else
+                {
+                    issues.push_back( entryTask.Path + ": entry has unknown type" );
+                    continue;
+                }
+
+                tasks.push_back( std::move( entryTask ) );
+            }
+
+            blockOffset = block.Next;
+        }
+    }
+
+    void ArchiveVerifier::_VerifyFile( Archive& reader, const Task& task, std::vector<char>& buffer, std::vector<Allocation>& allocations, std::unordered_map<uint64_t, uint32_t>& chunkReferences, SolidReferenceMap& solidReferences, std::vector<std::string>& issues )
+    {
+        constexpr size_t ReadSize = 1024 * 1024;
+
+        m_FileCount++;
+
+        const Archive::ArchiveEntry& entry = task.Entry;
+        const uint64_t size = entry.GetSize();
+
+        // Ranges of the file data in the archive
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+
+        if( entry.IsSolid() )
+        {
+            solidReferences[task.Offset].push_back( SolidReference{ entry.Slot, size, entry.HasChecksum(), task.Checksum, task.Path } );
+            return;
+        }
+
+        if( entry.IsChunked() )
+        {
+            std::vector<Archive::ArchiveChunkReference> chunks;
+            reader._ReadChunkList( entry, chunks );
+
+            allocations.push_back( Allocation{ task.Offset, reader._GetEntryAllocationSize( entry ), false, task.Path + " (chunk list)" } );
+
+            uint64_t chunkedSize = 0;
+
+            for( const Archive::ArchiveChunkReference& chunk : chunks )
+            {
+                chunkReferences[chunk.Offset]++;
+                chunkedSize += chunk.Size;
+                ranges.emplace_back( chunk.Offset, chunk.Size );
+            }
+
+            if( chunkedSize != size )
+            {
+                issues.push_back( task.Path + ": chunks don't match size of the file" );
+                return;
+            }
+        }
+        else
+        {
+            allocations.push_back( Allocation{ task.Offset, size, entry.IsSlot(), task.Path } );
+            ranges.emplace_back( task.Offset, size );
+        }
+
+        if( !m_Options.VerifyData || !entry.HasChecksum() )
+            return;
+
+        uint32_t checksum = 0;
+        buffer.resize( ReadSize );
+
+        for( const auto& range : ranges )
+        {
+            reader.m_pArchiveFile->Seek( range.first );
+
+            for( uint64_t position = 0; position < range.second; position += ReadSize )
+            {
+                const size_t bytesToRead = static_cast<size_t>(std::min<uint64_t>( ReadSize, range.second - position ));
+
+                reader.m_pArchiveFile->Read( buffer.data(), bytesToRead );
+                checksum = Crc32c( buffer.data(), bytesToRead, checksum );
+            }
+        }
+
+        m_BytesVerified += size;
+
+        if( checksum != task.Checksum )
+            issues.push_back( task.Path + ": data checksum mismatch" );
+    }
+
+    void ArchiveVerifier::_VerifySolidGroups( uint32_t threadCount )
+    {
+        std::vector<const SolidReferenceMap::value_type*> groups;
+
+        for( const auto& group : m_SolidReferences )
+            groups.push_back( &group );
+
+        std::atomic<size_t> nextGroup( 0 );
+        std::vector<std::thread> workers;
+
+        threadCount = static_cast<uint32_t>(std::min<size_t>( threadCount, groups.size() ));
+
+        for( uint32_t i = 0; i < threadCount; ++i )
+        {
+            workers.emplace_back( [&]()
+                {
+                    UniqueArchive reader( m_pArchive->Snapshot() );
+
+                    std::vector<Allocation> allocations;
+                    std::vector<std::string> issues;
+                    std::vector<char> buffer;
+
+                    for( size_t index = nextGroup++; index < groups.size(); index = nextGroup++ )
+                    {
+                        const uint64_t offset = groups[index]->first;
+
+                        try
+                        {
+                            _VerifySolidGroup( *reader, offset, groups[index]->second, buffer, allocations, issues );
+                        }
+                        catch( const std::exception& exception )
+                        {
+                            issues.push_back( "solid group at " + ToHex( offset ) + ": " + exception.what() );
+                        }
+                    }
+
+                    std::unique_lock<std::mutex> lock( m_Mutex );
+
+                    m_Allocations.insert( m_Allocations.end(), allocations.begin(), allocations.end() );
+                    m_Issues.insert( m_Issues.end(), issues.begin(), issues.end() );
+                } );
+        }
+
+        for( std::thread& worker : workers )
+            worker.join();
+    }
+
+    void ArchiveVerifier::_VerifySolidGroup( Archive& reader, uint64_t offset, const std::vector<SolidReference>& references, std::vector<char>& buffer, std::vector<Allocation>& allocations, std::vector<std::string>& issues )
+    {
+        const std::string owner = "solid group at " + ToHex( offset );
+
+        Archive::ArchiveSolidGroupHeader groupHeader;
+        std::vector<Archive::ArchiveSolidMember> members;
+        reader._ReadSolidGroup( offset, groupHeader, members );
+
+        // Member table of the damaged group can't be trusted
+        if( groupHeader.Checksum != groupHeader.ComputeChecksum( members.data() ) )
+        {
+            issues.push_back( owner + ": has invalid checksum" );
+            return;
+        }
+
+        allocations.push_back( Allocation{ offset, std::max<uint64_t>( groupHeader.GetGroupSize(), reader.m_pAllocator->GetAllocationSize() ), false, owner } );
+
+        if( groupHeader.ReferenceCount != references.size() )
+            issues.push_back( owner + ": has " + std::to_string( groupHeader.ReferenceCount ) + " references recorded, " + std::to_string( references.size() ) + " found" );
+
+        std::vector<bool> used( members.size(), false );
+
+        for( const Archive::ArchiveSolidMember& member : members )
+        {
+            if( member.Offset + member.Size > groupHeader.UncompressedSize )
+            {
+                issues.push_back( owner + ": member exceeds size of the group" );
+                return;
+            }
+        }
+
+        for( const SolidReference& reference : references )
+        {
+            if( reference.Member >= members.size() )
+                issues.push_back( reference.Path + ": refers to unknown member of " + owner );
+
+            else if( members[reference.Member].Size != reference.Size )
+                issues.push_back( reference.Path + ": size doesn't match member of " + owner );
+
+            else if( used[reference.Member] )
+                issues.push_back( reference.Path + ": member of " + owner + " is used by another entry" );
+
+            else
+                used[reference.Member] = true;
+        }
+
+        if( !m_Options.VerifyData )
+            return;
+
+        Archive::_InflateSolidGroup( *reader.m_pArchiveFile, offset, groupHeader, buffer );
+
+        for( const SolidReference& reference : references )
+        {
+            if( reference.Member >= members.size() || !reference.HasChecksum )
+                continue;
+
+            const Archive::ArchiveSolidMember& member = members[reference.Member];
+
+            if( member.Size != reference.Size )
+                continue;
+
+            m_BytesVerified += member.Size;
+
+            if( Crc32c( buffer.data() + member.Offset, static_cast<size_t>(member.Size) ) != reference.Checksum )
+                issues.push_back( reference.Path + ": data checksum mismatch" );
+        }
+    }
+
+    void ArchiveVerifier::_VerifyAllocations()
+    {
+        const ArchiveAllocator& allocator = *m_pArchive->m_pAllocator;
+        const ArchiveChunkStore& chunkStore = m_pArchive->m_ChunkStore;
+
+        // Metadata pages of the archive
+        for( uint32_t i = 0; i < allocator.GetPageCount(); ++i )
+            m_Allocations.push_back( Allocation{ allocator.GetPageOffset( i ), Archive::ArchiveAllocationPage::PageSize, false, "allocation table" } );
+
+        for( uint32_t i = 0; i < allocator.GetSlotPageCount(); ++i )
+            m_Allocations.push_back( Allocation{ allocator.GetSlotPageOffset( i ), Archive::ArchiveSlotPage::PageSize, false, "shared sector table" } );
+
+        for( uint32_t i = 0; i < chunkStore.GetPageCount(); ++i )
+        {
+            m_Allocations.push_back( Allocation{ chunkStore.GetPageOffset( i ), Archive::ArchiveChunkPage::PageSize, false, "chunk table" } );
+
+            uint32_t count = 0;
+            const ArchiveChunk* chunks = chunkStore.GetPageChunks( i, count );
+
+            for( uint32_t j = 0; j < count; ++j )
+            {
+                const std::string owner = "chunk at " + ToHex( chunks[j].Offset );
+
+                m_Allocations.push_back( Allocation{ chunks[j].Offset, chunks[j].Size, allocator.GetSlotSize( chunks[j].Size ) != 0, owner } );
+
+                auto references = m_ChunkReferences.find( chunks[j].Offset );
+                const uint32_t referenceCount = (references != m_ChunkReferences.end()) ? references->second : 0;
+
+                if( referenceCount != chunks[j].RefCount )
+                    m_Issues.push_back( owner + ": has " + std::to_string( chunks[j].RefCount ) + " references recorded, " + std::to_string( referenceCount ) + " found" );
+
+                if( references != m_ChunkReferences.end() )
+                    m_ChunkReferences.erase( references );
+            }
+        }
+
+        for( const auto& chunkReference : m_ChunkReferences )
+            m_Issues.push_back( "chunk at " + ToHex( chunkReference.first ) + ": referenced, but not recorded in the chunk table" );
+
+        std::unordered_map<uint32_t, SlotSector> slotSectors;
+
+        for( uint32_t i = 0; i < allocator.GetSlotPageCount(); ++i )
+        {
+            uint32_t count = 0;
+            const ArchiveSlotSector* sectors = allocator.GetSlotPageSectors( i, count );
+
+            for( uint32_t j = 0; j < count; ++j )
+                slotSectors.emplace( sectors[j].Sector, SlotSector{ sectors[j].SlotSize, sectors[j].Occupancy, 0 } );
+        }
+
+        const uint64_t sectorCount = allocator.GetTotalSectorCount();
+        const uint64_t allocationBase = allocator.GetAllocationBase();
+        const uint32_t allocationSize = allocator.GetAllocationSize();
+
+        // Index of the allocation owning each sector + 1, 0 for free sectors
+        constexpr uint32_t SharedSector = ~0u;
+        std::vector<uint32_t> owners( static_cast<size_t>(sectorCount), 0 );
+
+        for( uint32_t index = 0; index < m_Allocations.size(); ++index )
+        {
+            const Allocation& allocation = m_Allocations[index];
+
+            if( allocation.Offset < allocationBase || (allocation.Slot ? 0 : (allocation.Offset - allocationBase) % allocationSize) != 0 )
+            {
+                m_Issues.push_back( allocation.Owner + ": invalid offset " + ToHex( allocation.Offset ) );
+                continue;
+            }
+
+            const uint64_t firstSector = (allocation.Offset - allocationBase) / allocationSize;
+
+            if( allocation.Slot )
+            {
+                auto slotSector = slotSectors.find( static_cast<uint32_t>(firstSector) );
+
+                if( firstSector >= sectorCount || slotSector == slotSectors.end() )
+                {
+                    m_Issues.push_back( allocation.Owner + ": stored in unknown shared sector" );
+                    continue;
+                }
+
+                SlotSector& sector = slotSector->second;
+                const uint64_t slot = (allocation.Offset - allocator.GetSectorOffset( static_cast<uint32_t>(firstSector) )) / sector.SlotSize;
+                const uint64_t slotMask = uint64_t( 1 ) << slot;
+
+                if( allocation.Size > sector.SlotSize || slot >= ArchiveAllocator::MaxSlotsPerSector )
+                    m_Issues.push_back( allocation.Owner + ": doesn't fit in the slot of shared sector" );
+
+                else if( (sector.Occupancy & slotMask) == 0 )
+                    m_Issues.push_back( allocation.Owner + ": slot is not marked as allocated" );
+
+                else if( sector.Used & slotMask )
+                    m_Issues.push_back( allocation.Owner + ": slot is used by another entry" );
+
+                sector.Used |= slotMask;
+                continue;
+            }
+
+            const uint64_t sectorCountOfAllocation = allocator.GetSectorCount( allocation.Size );
+
+            if( firstSector + sectorCountOfAllocation > sectorCount )
+            {
+                m_Issues.push_back( allocation.Owner + ": extends beyond the allocation table" );
+                continue;
+            }
+
+            bool overlapReported = false;
+            bool allocationReported = false;
+
+            for( uint64_t sector = firstSector; sector < firstSector + sectorCountOfAllocation; ++sector )
+            {
+                if( owners[sector] != 0 && !overlapReported )
+                {
+                    m_Issues.push_back( allocation.Owner + ": overlaps " + m_Allocations[owners[sector] - 1].Owner );
+                    overlapReported = true;
+                }
+
+                if( !allocator.IsSectorAllocated( static_cast<uint32_t>(sector) ) && !allocationReported )
+                {
+                    m_Issues.push_back( allocation.Owner + ": sectors are not marked as allocated" );
+                    allocationReported = true;
+                }
+
+                owners[sector] = index + 1;
+            }
+        }
+
+        for( const auto& slotSector : slotSectors )
+        {
+            const uint32_t sector = slotSector.first;
+            const std::string owner = "shared sector " + std::to_string( sector );
+
+            if( sector >= sectorCount || !allocator.IsSectorAllocated( sector ) )
+            {
+                m_Issues.push_back( owner + ": is not marked as allocated" );
+                continue;
+            }
+
+            if( owners[sector] != 0 )
+                m_Issues.push_back( owner + ": overlaps " + m_Allocations[owners[sector] - 1].Owner );
+
+            owners[sector] = SharedSector;
+
+            const uint64_t leakedSlots = slotSector.second.Occupancy & ~slotSector.second.Used;
+
+            if( leakedSlots != 0 )
+                m_Issues.push_back( owner + ": slots " + ToHex( leakedSlots ) + " are allocated, but not used" );
+        }
+
+        // Allocated sectors not owned by anything are reported in runs
+        for( uint64_t sector = 0; sector < sectorCount; )
+        {
+            if( owners[sector] != 0 || !allocator.IsSectorAllocated( static_cast<uint32_t>(sector) ) )
+            {
+                sector++;
+                continue;
+            }
+
+            const uint64_t firstSector = sector;
+
+            while( sector < sectorCount && owners[sector] == 0 && allocator.IsSectorAllocated( static_cast<uint32_t>(sector) ) )
+                sector++;
+
+            m_Issues.push_back( "sectors " + std::to_string( firstSector ) + "-" + std::to_string( sector - 1 ) + ": are allocated, but not used" );
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#include "xArchive.h"
+
+namespace xArchive
+{
+    ArchiveWalker::Iterator::Iterator( ArchiveWalker* walker )
+        : m_pWalker( walker )
+    {
+    }
+
+    ArchiveWalker::Iterator::reference ArchiveWalker::Iterator::operator*() const
+    {
+        return m_pWalker->Current();
+    }
+
+    ArchiveWalker::Iterator::pointer ArchiveWalker::Iterator::operator->() const
+    {
+        return &m_pWalker->Current();
+    }
+
+    ArchiveWalker::Iterator& ArchiveWalker::Iterator::operator++()
+    {
+        if( !m_pWalker->Next() )
+            m_pWalker = nullptr;
+
+        return *this;
+    }
+
+    bool ArchiveWalker::Iterator::operator==( const Iterator& other ) const
+    {
+        return m_pWalker == other.m_pWalker;
+    }
+
+    bool ArchiveWalker::Iterator::operator!=( const Iterator& other ) const
+    {
+        return m_pWalker != other.m_pWalker;
+    }
+
+
+    ArchiveWalker::ArchiveWalker( Archive* archive, uint64_t offset, std::string path, bool recursive, ArchiveWalkOrder order )
+        : m_pArchive( archive )
+        , m_Recursive( recursive )
+        , m_Order( order )
+        , m_Frames()
+        , m_Current()
+    {
+        m_Frames.push_back( Frame{ m_pArchive->_ReadDirectory( offset ), 0, std::move( path ) } );
+    }
+
+    bool ArchiveWalker::Next()
+    {
+        while( !m_Frames.empty() )
+        {
+            // Depth-first walk descends into the most recently found directory,
+            // breadth-first walk finishes directories in the order they were found
+            Frame& frame = (m_Order == ArchiveWalkOrder::eDepthFirst)
+                ? m_Frames.back()
+                : m_Frames.front();
+
+            if( frame.Index == frame.Directory->NumEntries )
+            {
+                if( frame.Directory->Next != 0 )
+                {
+                    frame.Directory = m_pArchive->_ReadDirectory( frame.Directory->Next );
+                    frame.Index = 0;
+                    continue;
+                }
+
+                if( m_Order == ArchiveWalkOrder::eDepthFirst )
+                    m_Frames.pop_back();
+                else
+                    m_Frames.pop_front();
+
+                continue;
+            }
+
+            const Archive::ArchiveEntry& entry = frame.Directory->GetEntry( frame.Index );
+            const std::string_view name = frame.Directory->GetEntryName( frame.Index );
+            frame.Index++;
+
+            m_Current.Name.assign( name.data(), name.length() );
+            m_Current.Path.assign( frame.Path ).append( name.data(), name.length() );
+            m_Current.Type = entry.Type;
+            m_Current.Size = entry.GetSize();
+            m_Current.Offset = entry.IsInline() ? 0 : m_pArchive->_GetEntryOffset( entry );
+            m_Current.Inline = entry.IsInline();
+
+            if( m_Recursive && entry.Type == ArchiveEntryType::eDirectory )
+            {
+                m_Frames.push_back( Frame{ m_pArchive->_ReadDirectory( m_Current.Offset ), 0, m_Current.Path + "/" } );
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    const ArchiveEntryInfo& ArchiveWalker::Current() const
+    {
+        return m_Current;
+    }
+
+    ArchiveWalker::Iterator ArchiveWalker::begin()
+    {
+        return Iterator( Next() ? this : nullptr );
+    }
+
+    ArchiveWalker::Iterator ArchiveWalker::end()
+    {
+        return Iterator();
+    }
+}
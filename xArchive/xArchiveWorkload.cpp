@@ -0,0 +1,250 @@
+#include "xArchive.h"
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <unordered_map>
+
+namespace xArchive
+{
+    namespace
+    {
+        // Workload trace file starts with the magic and version followed by the records:
+        //   operation (1 byte), time since the previous record, duration, size, path reference
+        // All numbers are stored as LEB128 varints, times in microseconds. Path reference is
+        // 0 for a new path (length and characters follow) or 1 + index of the path seen before.
+        constexpr uint32_t WorkloadTraceMagic = BSwap( 'XWLT' );
+        // Version 1 traces have the same layout, but don't record walks, imports and prefetches.
+        constexpr uint32_t WorkloadTraceVersion = 2;
+
+        void WriteVarint( std::ostream& file, uint64_t value )
+        {
+            while( value >= 0x80 )
+            {
+                file.put( static_cast<char>((value & 0x7F) | 0x80) );
+                value >>= 7;
+            }
+
+            file.put( static_cast<char>(value) );
+        }
+
+        bool ReadVarint( std::istream& file, uint64_t& value )
+        {
+            value = 0;
+
+            for( uint32_t shift = 0; shift < 64; shift += 7 )
+            {
+                const int byte = file.get();
+
+                if( byte == std::char_traits<char>::eof() )
+                    return false;
+
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+                if( !(byte & 0x80) )
+                    return true;
+            }
+
+            return false;
+        }
+    }
+
+    Archive::ArchiveWorkloadScope::ArchiveWorkloadScope( Archive* archive, ArchiveOperation operation, std::string_view path )
+        : Size( 0 )
+        , m_pArchive( nullptr )
+        , m_Operation( operation )
+        , m_Outermost( false )
+        , m_UncaughtExceptions( 0 )
+        , m_Path()
+        , m_StartTime()
+    {
+        // Reads of the files are also recorded to the access trace
+        if( !archive->m_WorkloadTraceEnabled && !(archive->m_AccessTraceEnabled && operation == ArchiveOperation::eReadFile) )
+            return;
+
+        m_pArchive = archive;
+        m_Outermost = (m_pArchive->m_WorkloadDepth++ == 0);
+
+        if( !m_Outermost )
+            return;
+
+        m_UncaughtExceptions = std::uncaught_exceptions();
+        m_StartTime = std::chrono::steady_clock::now();
+
+        // Paths are recorded in absolute form without the trailing separator
+        m_Path = m_pArchive->m_CurrentDirectoryPath;
+        PathNormalize( path, m_Path );
+
+        if( m_Path.length() > 1 )
+            m_Path.pop_back();
+    }
+
+    Archive::ArchiveWorkloadScope::~ArchiveWorkloadScope()
+    {
+        if( !m_pArchive )
+            return;
+
+        m_pArchive->m_WorkloadDepth--;
+
+        // Failed calls are not recorded
+        if( !m_Outermost || std::uncaught_exceptions() > m_UncaughtExceptions )
+            return;
+
+        const auto endTime = std::chrono::steady_clock::now();
+
+        if( m_Operation == ArchiveOperation::eReadFile && m_pArchive->m_AccessTraceEnabled )
+        {
+            ArchiveAccessRecord accessRecord;
+            accessRecord.Path = m_Path;
+            accessRecord.Time = std::chrono::duration_cast<std::chrono::microseconds>(m_StartTime - m_pArchive->m_AccessTraceStart);
+
+            m_pArchive->m_AccessTrace.push_back( std::move( accessRecord ) );
+        }
+
+        if( !m_pArchive->m_WorkloadTraceEnabled )
+            return;
+
+        ArchiveWorkloadRecord record;
+        record.Operation = m_Operation;
+        record.Path = std::move( m_Path );
+        record.Size = Size;
+        record.Time = std::chrono::duration_cast<std::chrono::microseconds>(m_StartTime - m_pArchive->m_WorkloadTraceStart);
+        record.Duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - m_StartTime);
+
+        m_pArchive->m_WorkloadTrace.push_back( std::move( record ) );
+    }
+
+    void Archive::BeginWorkloadTrace()
+    {
+        m_WorkloadTrace.clear();
+        m_WorkloadTraceStart = std::chrono::steady_clock::now();
+        m_WorkloadTraceEnabled = true;
+    }
+
+    std::vector<ArchiveWorkloadRecord> Archive::EndWorkloadTrace()
+    {
+        m_WorkloadTraceEnabled = false;
+
+        std::vector<ArchiveWorkloadRecord> trace;
+        trace.swap( m_WorkloadTrace );
+
+        return trace;
+    }
+
+    XARCHIVE_API void Archive::SaveWorkloadTrace( const std::string& filename, const std::vector<ArchiveWorkloadRecord>& trace )
+    {
+        std::ofstream file( filename, std::ios::out | std::ios::binary | std::ios::trunc );
+
+        if( !file )
+            throw std::runtime_error( (std::string( filename ) + " cannot be opened").c_str() );
+
+        file.write( reinterpret_cast<const char*>(&WorkloadTraceMagic), sizeof( WorkloadTraceMagic ) );
+        file.write( reinterpret_cast<const char*>(&WorkloadTraceVersion), sizeof( WorkloadTraceVersion ) );
+
+        std::unordered_map<std::string, uint64_t> paths;
+        std::chrono::microseconds previousTime( 0 );
+
+        for( const ArchiveWorkloadRecord& record : trace )
+        {
+            // Records are appended in order of the calls, but the trace may have been edited
+            const std::chrono::microseconds time = std::max( record.Time, previousTime );
+
+            file.put( static_cast<char>(record.Operation) );
+            WriteVarint( file, static_cast<uint64_t>((time - previousTime).count()) );
+            WriteVarint( file, static_cast<uint64_t>(record.Duration.count()) );
+            WriteVarint( file, record.Size );
+
+            previousTime = time;
+
+            auto path = paths.find( record.Path );
+
+            if( path != paths.end() )
+            {
+                WriteVarint( file, path->second + 1 );
+                continue;
+            }
+
+            paths.emplace( record.Path, paths.size() );
+
+            WriteVarint( file, 0 );
+            WriteVarint( file, record.Path.length() );
+            file.write( record.Path.data(), record.Path.length() );
+        }
+
+        if( !file )
+            throw std::runtime_error( (std::string( filename ) + " cannot be written").c_str() );
+    }
+
+    XARCHIVE_API std::vector<ArchiveWorkloadRecord> Archive::LoadWorkloadTrace( const std::string& filename )
+    {
+        std::ifstream file( filename, std::ios::in | std::ios::binary );
+
+        if( !file )
+            throw std::runtime_error( (std::string( filename ) + " cannot be opened").c_str() );
+
+        uint32_t magic = 0;
+        uint32_t version = 0;
+
+        file.read( reinterpret_cast<char*>(&magic), sizeof( magic ) );
+        file.read( reinterpret_cast<char*>(&version), sizeof( version ) );
+
+        if( !file || magic != WorkloadTraceMagic || version == 0 || version > WorkloadTraceVersion )
+            throw std::runtime_error( (std::string( filename ) + " is not a workload trace").c_str() );
+
+        std::vector<ArchiveWorkloadRecord> trace;
+        std::vector<std::string> paths;
+        std::chrono::microseconds time( 0 );
+
+        while( true )
+        {
+            const int operation = file.get();
+
+            if( operation == std::char_traits<char>::eof() )
+                break;
+
+            uint64_t timeDelta = 0;
+            uint64_t duration = 0;
+            uint64_t size = 0;
+            uint64_t pathReference = 0;
+
+            if( operation > static_cast<int>(ArchiveOperation::ePrefetchDirectory) ||
+                !ReadVarint( file, timeDelta ) ||
+                !ReadVarint( file, duration ) ||
+                !ReadVarint( file, size ) ||
+                !ReadVarint( file, pathReference ) ||
+                pathReference > paths.size() )
+            {
+                throw std::runtime_error( (std::string( filename ) + " is corrupted").c_str() );
+            }
+
+            if( pathReference == 0 )
+            {
+                uint64_t length = 0;
+
+                if( !ReadVarint( file, length ) || length > MaxNameLength * 1024 )
+                    throw std::runtime_error( (std::string( filename ) + " is corrupted").c_str() );
+
+                std::string path( static_cast<size_t>(length), '\0' );
+                file.read( &path[0], static_cast<std::streamsize>(length) );
+
+                if( !file )
+                    throw std::runtime_error( (std::string( filename ) + " is corrupted").c_str() );
+
+                paths.push_back( std::move( path ) );
+                pathReference = paths.size();
+            }
+
+            time += std::chrono::microseconds( timeDelta );
+
+            ArchiveWorkloadRecord record;
+            record.Operation = static_cast<ArchiveOperation>(operation);
+            record.Path = paths[static_cast<size_t>(pathReference - 1)];
+            record.Size = size;
+            record.Time = time;
+            record.Duration = std::chrono::microseconds( duration );
+
+            trace.push_back( std::move( record ) );
+        }
+
+        return trace;
+    }
+}
@@ -0,0 +1,677 @@
+// xArchiveBench.cpp
+
+#include "../xArchive/xArchive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+using namespace xArchive;
+using namespace std;
+
+
+struct benchmark_config
+{
+    // Multiplies sizes of the synthetic trees
+    uint32_t scale = 1;
+    std::string filter;
+    std::string outputFilename;
+    std::string workDirectory = ".";
+};
+
+struct benchmark_result
+{
+    std::string name;
+    uint64_t operations = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    // Value specific to the benchmark, e.g. fragmentation of the archive
+    double metric = 0;
+    ArchiveStats stats = {};
+};
+
+// Measured part of the benchmark reports number of operations and bytes processed
+struct benchmark_context
+{
+    uint64_t operations = 0;
+    uint64_t bytes = 0;
+    double metric = 0;
+    std::chrono::steady_clock::duration elapsed = {};
+    // Counters of the measured part only
+    ArchiveStats stats = {};
+
+    template<typename Function>
+    void measure( Function function )
+    {
+        Archive::ResetStats();
+
+        const auto startTime = std::chrono::steady_clock::now();
+        function();
+        elapsed += std::chrono::steady_clock::now() - startTime;
+
+        stats = Archive::GetStats();
+    }
+};
+
+using benchmark_function = std::function<void( const benchmark_config&, benchmark_context& )>;
+
+
+std::string archive_filename( const benchmark_config& config, const char* name )
+{
+    return config.workDirectory + "/xarchivebench_" + name + ".xar";
+}
+
+// Data compressible about as well as the source code
+std::vector<char> make_payload( size_t size, uint64_t seed )
+{
+    static const char* words[] = { "archive ", "directory ", "entry ", "sector ", "offset ", "size ", "{\n", "}\n", "    ", "return ", "0; ", "void " };
+
+    std::mt19937_64 random( seed );
+    std::vector<char> payload;
+    payload.reserve( size + 16 );
+
+    while( payload.size() < size )
+    {
+        const char* word = words[random() % (sizeof( words ) / sizeof( words[0] ))];
+        payload.insert( payload.end(), word, word + std::strlen( word ) );
+    }
+
+    payload.resize( size );
+    return payload;
+}
+
+void bench_create_open( const benchmark_config& config, benchmark_context& context )
+{
+    const std::string filename = archive_filename( config, "create_open" );
+    const uint32_t count = 20 * config.scale;
+
+    context.measure( [&]()
+        {
+            for( uint32_t i = 0; i < count; ++i )
+            {
+                std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+                archive.reset( Archive::Open( filename ) );
+            }
+        } );
+
+    context.operations = 2 * count;
+    std::remove( filename.c_str() );
+}
+
+void bench_create_files( const benchmark_config& config, benchmark_context& context, const char* name, uint32_t count, size_t minSize, size_t maxSize )
+{
+    const std::string filename = archive_filename( config, name );
+
+    std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+    archive->CreateDirectory( "files" );
+
+    std::mt19937_64 random( count );
+    const std::vector<char> payload = make_payload( maxSize, count );
+
+    context.measure( [&]()
+        {
+            for( uint32_t i = 0; i < count; ++i )
+            {
+                const size_t size = minSize + static_cast<size_t>(random() % (maxSize - minSize + 1));
+
+                archive->CreateFile( "/files/" + std::to_string( i ), payload.data(), size );
+                context.bytes += size;
+            }
+        } );
+
+    context.operations = count;
+
+    archive.reset();
+    std::remove( filename.c_str() );
+}
+
+void bench_create_small( const benchmark_config& config, benchmark_context& context )
+{
+    bench_create_files( config, context, "create_small", 5000 * config.scale, 16, 1024 );
+}
+
+void bench_create_medium( const benchmark_config& config, benchmark_context& context )
+{
+    bench_create_files( config, context, "create_medium", 500 * config.scale, 16 * 1024, 256 * 1024 );
+}
+
+void bench_create_huge( const benchmark_config& config, benchmark_context& context )
+{
+    bench_create_files( config, context, "create_huge", 4 * config.scale, 16 * 1024 * 1024, 32 * 1024 * 1024 );
+}
+
+void bench_lookup_deep( const benchmark_config& config, benchmark_context& context )
+{
+    const std::string filename = archive_filename( config, "lookup_deep" );
+    const uint32_t depth = 32 * config.scale;
+    const uint32_t count = 2000 * config.scale;
+
+    std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+
+    std::string path;
+
+    for( uint32_t i = 0; i < depth; ++i )
+    {
+        path += "/level" + std::to_string( i );
+        archive->CreateDirectory( path );
+    }
+
+    path += "/file";
+    archive->CreateFile( path, "data", 4 );
+
+    context.measure( [&]()
+        {
+            for( uint32_t i = 0; i < count; ++i )
+                context.bytes += archive->GetFileSize( path );
+        } );
+
+    context.operations = count;
+
+    archive.reset();
+    std::remove( filename.c_str() );
+}
+
+void bench_lookup_wide( const benchmark_config& config, benchmark_context& context )
+{
+    const std::string filename = archive_filename( config, "lookup_wide" );
+    const uint32_t width = 5000 * config.scale;
+    const uint32_t count = 20000 * config.scale;
+
+    std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+    archive->CreateDirectory( "wide" );
+
+    {
+        ArchiveBatch batch( archive.get() );
+
+        for( uint32_t i = 0; i < width; ++i )
+            archive->CreateFile( "/wide/file" + std::to_string( i ), "data", 4 );
+
+        batch.Commit();
+    }
+
+    std::mt19937_64 random( width );
+
+    context.measure( [&]()
+        {
+            for( uint32_t i = 0; i < count; ++i )
+                context.bytes += archive->GetFileSize( "/wide/file" + std::to_string( random() % width ) );
+        } );
+
+    context.operations = count;
+
+    archive.reset();
+    std::remove( filename.c_str() );
+}
+
+void bench_list_directory( const benchmark_config& config, benchmark_context& context )
+{
+    const std::string filename = archive_filename( config, "list_directory" );
+    const uint32_t width = 5000 * config.scale;
+    const uint32_t count = 100;
+
+    std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+    archive->CreateDirectory( "wide" );
+
+    {
+        ArchiveBatch batch( archive.get() );
+
+        for( uint32_t i = 0; i < width; ++i )
+            archive->CreateFile( "/wide/file" + std::to_string( i ), "data", 4 );
+
+        batch.Commit();
+    }
+
+    context.measure( [&]()
+        {
+            for( uint32_t i = 0; i < count; ++i )
+                context.bytes += archive->ListDirectory( "/wide" ).size();
+        } );
+
+    context.operations = count;
+
+    archive.reset();
+    std::remove( filename.c_str() );
+}
+
+void bench_allocator_fragmentation( const benchmark_config& config, benchmark_context& context )
+{
+    const std::string filename = archive_filename( config, "allocator_fragmentation" );
+    const uint32_t count = 4000 * config.scale;
+
+    std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+    archive->SetInlineThreshold( 0 );
+    archive->CreateDirectory( "files" );
+
+    const std::vector<char> payload = make_payload( 64 * 1024, count );
+    std::mt19937_64 random( count );
+
+    auto randomSize = [&]()
+    {
+        return 1 + static_cast<size_t>(random() % payload.size());
+    };
+
+    context.measure( [&]()
+        {
+            // Fill the archive, free every other file and fill the holes with files of different sizes
+            for( uint32_t i = 0; i < count; ++i )
+            {
+                const size_t size = randomSize();
+                archive->CreateFile( "/files/" + std::to_string( i ), payload.data(), size );
+                context.bytes += size;
+            }
+
+            for( uint32_t i = 0; i < count; i += 2 )
+                archive->RemoveFile( "/files/" + std::to_string( i ) );
+
+            for( uint32_t i = 0; i < count; i += 2 )
+            {
+                const size_t size = randomSize();
+                archive->CreateFile( "/files/" + std::to_string( i ), payload.data(), size );
+                context.bytes += size;
+            }
+        } );
+
+    context.operations = count + count / 2 + count / 2;
+    context.metric = archive->GetFragmentation();
+
+    archive.reset();
+    std::remove( filename.c_str() );
+}
+
+void bench_compression( const benchmark_config& config, benchmark_context& context )
+{
+    const std::string filename = archive_filename( config, "compression" );
+    const uint32_t count = 16 * config.scale;
+    const std::vector<char> payload = make_payload( 4 * 1024 * 1024, count );
+
+    std::unique_ptr<Archive> archive( Archive::Create( filename ) );
+
+    for( uint32_t i = 0; i < count; ++i )
+        archive->CreateFile( std::to_string( i ), payload.data(), payload.size() );
+
+    // Archive is compressed when closed and decompressed when opened
+    context.measure( [&]()
+        {
+            archive.reset();
+            archive.reset( Archive::Open( filename ) );
+        } );
+
+    context.operations = 2;
+    context.bytes = 2 * static_cast<uint64_t>(count) * payload.size();
+
+    archive.reset();
+    std::remove( filename.c_str() );
+}
+
+benchmark_result run_benchmark( const benchmark_config& config, const char* name, const benchmark_function& function )
+{
+    benchmark_context context;
+    function( config, context );
+
+    benchmark_result result;
+    result.name = name;
+    result.operations = context.operations;
+    result.bytes = context.bytes;
+    result.seconds = std::chrono::duration<double>( context.elapsed ).count();
+    result.metric = context.metric;
+    result.stats = context.stats;
+
+    return result;
+}
+
+std::string format_results( const benchmark_config& config, const std::vector<benchmark_result>& results )
+{
+    std::stringstream json;
+    json << "{\n  \"scale\": " << config.scale << ",\n  \"results\": [";
+
+    for( size_t i = 0; i < results.size(); ++i )
+    {
+        const benchmark_result& result = results[i];
+        const double seconds = std::max( result.seconds, 1e-9 );
+
+        json << (i ? "," : "") << "\n    {"
+            << "\"name\": \"" << result.name << "\", "
+            << "\"operations\": " << result.operations << ", "
+            << "\"bytes\": " << result.bytes << ", "
+            << "\"seconds\": " << result.seconds << ", "
+            << "\"operations_per_second\": " << (static_cast<double>(result.operations) / seconds) << ", "
+            << "\"megabytes_per_second\": " << (static_cast<double>(result.bytes) / seconds / (1024 * 1024)) << ", "
+            << "\"metric\": " << result.metric << ", "
+            << "\"directory_lookups\": " << result.stats.DirectoryLookups << ", "
+            << "\"directory_blocks_read\": " << result.stats.DirectoryBlocksRead << ", "
+            << "\"allocation_blocks_scanned\": " << result.stats.AllocationBlocksScanned << ", "
+            << "\"header_flushes\": " << result.stats.HeaderFlushes << ", "
+            << "\"relocations\": " << result.stats.Relocations << "}";
+    }
+
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+
+struct replay_config
+{
+    uint32_t threads = 1;
+    // Multiplies pace of the recorded calls, 0 to replay them as fast as possible
+    double speed = 0;
+    std::string outputFilename;
+};
+
+const char* operation_names[] = { "ReadFile", "CreateFile", "RemoveFile", "GetFileSize", "ListDirectory", "CreateDirectory", "RemoveDirectory",
+    "WalkDirectory", "ImportTree", "Prefetch", "PrefetchDirectory" };
+constexpr size_t operation_count = sizeof( operation_names ) / sizeof( operation_names[0] );
+
+bool is_read_operation( ArchiveOperation operation )
+{
+    return operation == ArchiveOperation::eReadFile ||
+        operation == ArchiveOperation::eGetFileSize ||
+        operation == ArchiveOperation::eListDirectory ||
+        operation == ArchiveOperation::eWalkDirectory ||
+        operation == ArchiveOperation::ePrefetch ||
+        operation == ArchiveOperation::ePrefetchDirectory;
+}
+
+void replay_operation( Archive& archive, const ArchiveWorkloadRecord& record, const std::vector<char>& payload )
+{
+    switch( record.Operation )
+    {
+    case ArchiveOperation::eReadFile: archive.ReadFile( record.Path ); break;
+    case ArchiveOperation::eCreateFile: archive.CreateFile( record.Path, payload.data(), static_cast<size_t>(record.Size) ); break;
+    case ArchiveOperation::eRemoveFile: archive.RemoveFile( record.Path ); break;
+    case ArchiveOperation::eGetFileSize: archive.GetFileSize( record.Path ); break;
+    case ArchiveOperation::eListDirectory: archive.ListDirectory( record.Path ); break;
+    case ArchiveOperation::eCreateDirectory: archive.CreateDirectory( record.Path ); break;
+    case ArchiveOperation::eRemoveDirectory: archive.RemoveDirectory( record.Path ); break;
+    case ArchiveOperation::eWalkDirectory:
+    {
+        const bool recursive = (record.Size & static_cast<uint64_t>(ArchiveWorkloadFlags::eRecursive)) != 0;
+        const ArchiveWalkOrder order = (record.Size & static_cast<uint64_t>(ArchiveWorkloadFlags::eBreadthFirst)) != 0
+            ? ArchiveWalkOrder::eBreadthFirst
+            : ArchiveWalkOrder::eDepthFirst;
+
+        // Callers usually read the whole walk, while the recorded duration covers only its start
+        ArchiveWalker walker = archive.Walk( record.Path, recursive, order );
+
+        while( walker.Next() )
+            continue;
+
+        break;
+    }
+    case ArchiveOperation::eImportTree: break;
+    case ArchiveOperation::ePrefetch: archive.Prefetch( { record.Path } ); break;
+    case ArchiveOperation::ePrefetchDirectory: archive.PrefetchDirectory( record.Path, (record.Size & static_cast<uint64_t>(ArchiveWorkloadFlags::eRecursive)) != 0 ); break;
+    }
+}
+
+// Returns the value below which the given fraction of the sorted values lies
+double percentile( const std::vector<double>& sortedValues, double fraction )
+{
+    if( sortedValues.empty() )
+        return 0;
+
+    const size_t index = static_cast<size_t>(fraction * static_cast<double>(sortedValues.size()));
+    return sortedValues[std::min( index, sortedValues.size() - 1 )];
+}
+
+void format_latencies( std::stringstream& json, const char* prefix, std::vector<double>& latencies )
+{
+    std::sort( latencies.begin(), latencies.end() );
+
+    json << "\"" << prefix << "p50_us\": " << percentile( latencies, 0.5 ) << ", "
+        << "\"" << prefix << "p90_us\": " << percentile( latencies, 0.9 ) << ", "
+        << "\"" << prefix << "p99_us\": " << percentile( latencies, 0.99 ) << ", "
+        << "\"" << prefix << "p999_us\": " << percentile( latencies, 0.999 ) << ", "
+        << "\"" << prefix << "max_us\": " << (latencies.empty() ? 0 : latencies.back());
+}
+
+// Re-executes the recorded calls against the archive (which is modified by them). With multiple
+// threads, reads run on snapshots in parallel and modifications are serialized on the archive.
+int replay_workload( const char* archiveFilename, const char* traceFilename, const replay_config& config )
+{
+    const std::vector<ArchiveWorkloadRecord> trace = Archive::LoadWorkloadTrace( traceFilename );
+
+    std::unique_ptr<Archive> archive( Archive::Open( archiveFilename ) );
+
+    uint64_t maxSize = 0;
+
+    for( const ArchiveWorkloadRecord& record : trace )
+    {
+        if( record.Operation == ArchiveOperation::eCreateFile )
+            maxSize = std::max( maxSize, record.Size );
+    }
+
+    const std::vector<char> payload = make_payload( static_cast<size_t>(maxSize), maxSize );
+
+    std::mutex archiveMutex;
+    // Incremented by each modification, so the readers know their snapshots are outdated
+    std::atomic<uint64_t> generation( 0 );
+    std::atomic<size_t> nextRecord( 0 );
+    std::atomic<uint64_t> failures( 0 );
+
+    // Latencies in microseconds for each thread and operation
+    std::vector<std::vector<std::vector<double>>> latencies( config.threads, std::vector<std::vector<double>>( operation_count ) );
+
+    const auto startTime = std::chrono::steady_clock::now();
+
+    auto worker = [&]( std::vector<std::vector<double>>& threadLatencies )
+    {
+        std::unique_ptr<Archive> snapshot;
+        uint64_t snapshotGeneration = 0;
+
+        while( true )
+        {
+            const size_t index = nextRecord++;
+
+            if( index >= trace.size() )
+                break;
+
+            const ArchiveWorkloadRecord& record = trace[index];
+
+            // Files of the imported tree are not part of the trace
+            if( record.Operation == ArchiveOperation::eImportTree )
+                continue;
+
+            if( config.speed > 0 )
+                std::this_thread::sleep_until( startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>( record.Time / config.speed ) );
+
+            // Waiting for the lock and refreshing the snapshot are not part of the call, the start
+            // time is taken again once the archive can be used
+            auto callStartTime = std::chrono::steady_clock::now();
+
+            try
+            {
+                if( !is_read_operation( record.Operation ) || config.threads == 1 )
+                {
+                    std::unique_lock<std::mutex> lock( archiveMutex );
+
+                    callStartTime = std::chrono::steady_clock::now();
+                    replay_operation( *archive, record, payload );
+
+                    if( !is_read_operation( record.Operation ) )
+                        generation++;
+                }
+                else
+                {
+                    if( !snapshot || snapshotGeneration != generation )
+                    {
+                        std::unique_lock<std::mutex> lock( archiveMutex );
+
+                        snapshot.reset( archive->Snapshot() );
+                        snapshotGeneration = generation;
+                    }
+
+                    callStartTime = std::chrono::steady_clock::now();
+                    replay_operation( *snapshot, record, payload );
+                }
+            }
+            catch( const std::exception& )
+            {
+                // Calls may fail when executed in different order than recorded
+                failures++;
+            }
+
+            const std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - callStartTime;
+            threadLatencies[static_cast<size_t>(record.Operation)].push_back( latency.count() );
+        }
+    };
+
+    std::vector<std::thread> workers;
+
+    for( uint32_t i = 0; i < config.threads; ++i )
+        workers.emplace_back( worker, std::ref( latencies[i] ) );
+
+    for( std::thread& thread : workers )
+        thread.join();
+
+    const double seconds = std::max( std::chrono::duration<double>( std::chrono::steady_clock::now() - startTime ).count(), 1e-9 );
+
+    std::stringstream json;
+    json << "{\n  \"threads\": " << config.threads << ",\n  \"speed\": " << config.speed
+        << ",\n  \"calls\": " << trace.size() << ",\n  \"failures\": " << failures
+        << ",\n  \"seconds\": " << seconds << ",\n  \"calls_per_second\": " << (static_cast<double>(trace.size()) / seconds)
+        << ",\n  \"operations\": [";
+
+    bool first = true;
+
+    for( size_t operation = 0; operation < operation_count; ++operation )
+    {
+        std::vector<double> replayed;
+        std::vector<double> recorded;
+
+        for( const auto& threadLatencies : latencies )
+            replayed.insert( replayed.end(), threadLatencies[operation].begin(), threadLatencies[operation].end() );
+
+        for( const ArchiveWorkloadRecord& record : trace )
+        {
+            if( static_cast<size_t>(record.Operation) == operation )
+                recorded.push_back( static_cast<double>(record.Duration.count()) );
+        }
+
+        if( replayed.empty() )
+            continue;
+
+        json << (first ? "" : ",") << "\n    {\"name\": \"" << operation_names[operation] << "\", \"count\": " << replayed.size() << ", ";
+        format_latencies( json, "", replayed );
+        json << ", ";
+        format_latencies( json, "recorded_", recorded );
+        json << "}";
+
+        first = false;
+    }
+
+    json << "\n  ]\n}\n";
+
+    if( config.outputFilename.empty() )
+    {
+        cout << json.str();
+        return 0;
+    }
+
+    std::ofstream output( config.outputFilename, std::ios::out | std::ios::trunc );
+    output << json.str();
+
+    return output ? 0 : 1;
+}
+
+int main( int argc, char** argv )
+{
+    // Usage: xarchivebench replay <archive>(2) <trace>(3) [options]
+    if( argc >= 4 && std::strcmp( argv[1], "replay" ) == 0 )
+    {
+        replay_config config;
+
+        for( int i = 4; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+
+            if( argument == "--threads" && i + 1 < argc )
+                config.threads = static_cast<uint32_t>(std::max( 1, std::atoi( argv[++i] ) ));
+
+            else if( argument == "--speed" && i + 1 < argc )
+                config.speed = std::max( 0.0, std::atof( argv[++i] ) );
+
+            else if( argument == "--output" && i + 1 < argc )
+                config.outputFilename = argv[++i];
+
+            else
+            {
+                cerr << "Usage: " << argv[0] << " replay <archive> <trace> [--threads <n>] [--speed <factor>] [--output <results.json>]" << endl;
+                return -1;
+            }
+        }
+
+        return replay_workload( argv[2], argv[3], config );
+    }
+
+    benchmark_config config;
+
+    for( int i = 1; i < argc; ++i )
+    {
+        const std::string argument = argv[i];
+
+        if( argument == "--scale" && i + 1 < argc )
+            config.scale = std::max( 1, std::atoi( argv[++i] ) );
+
+        else if( argument == "--filter" && i + 1 < argc )
+            config.filter = argv[++i];
+
+        else if( argument == "--output" && i + 1 < argc )
+            config.outputFilename = argv[++i];
+
+        else if( argument == "--dir" && i + 1 < argc )
+            config.workDirectory = argv[++i];
+
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--scale <n>] [--filter <name>] [--output <results.json>] [--dir <directory>]" << endl;
+            cerr << "       " << argv[0] << " replay <archive> <trace> [--threads <n>] [--speed <factor>] [--output <results.json>]" << endl;
+            return -1;
+        }
+    }
+
+    const std::pair<const char*, benchmark_function> benchmarks[] = {
+        { "create_open", bench_create_open },
+        { "create_small", bench_create_small },
+        { "create_medium", bench_create_medium },
+        { "create_huge", bench_create_huge },
+        { "lookup_deep", bench_lookup_deep },
+        { "lookup_wide", bench_lookup_wide },
+        { "list_directory", bench_list_directory },
+        { "allocator_fragmentation", bench_allocator_fragmentation },
+        { "compression", bench_compression } };
+
+    std::vector<benchmark_result> results;
+
+    for( const auto& benchmark : benchmarks )
+    {
+        if( !config.filter.empty() && std::string( benchmark.first ).find( config.filter ) == std::string::npos )
+            continue;
+
+        const benchmark_result result = run_benchmark( config, benchmark.first, benchmark.second );
+
+        cerr << result.name << ": " << result.operations << " operations in " << result.seconds << "s" << endl;
+        results.push_back( result );
+    }
+
+    const std::string json = format_results( config, results );
+
+    if( config.outputFilename.empty() )
+    {
+        cout << json;
+        return 0;
+    }
+
+    std::ofstream output( config.outputFilename, std::ios::out | std::ios::trunc );
+    output << json;
+
+    return output ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+#-------------------------------------------------
+#
+# Benchmarks of the xArchive hot paths, builds the library
+# sources directly so it doesn't depend on the Windows binaries.
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = xarchivebench
+TEMPLATE = app
+
+CONFIG += console c++17
+CONFIG -= app_bundle qt
+
+SOURCES += \
+        xArchiveBench.cpp \
+        ../xArchive/xArchive.cpp \
+        ../xArchive/xArchiveAllocator.cpp \
+        ../xArchive/xArchiveChecksum.cpp \
+        ../xArchive/xArchiveChunkStore.cpp \
+        ../xArchive/xArchiveFile.cpp \
+        ../xArchive/xArchivePrefetch.cpp \
+        ../xArchive/xArchiveSolid.cpp \
+        ../xArchive/xArchiveStats.cpp \
+        ../xArchive/xArchiveTrace.cpp \
+        ../xArchive/xArchiveVerify.cpp \
+        ../xArchive/xArchiveWalker.cpp \
+        ../xArchive/xArchiveWorkload.cpp
+
+HEADERS += \
+        ../xArchive/xArchive.h \
+        ../xArchive/xArchiveAllocator.h \
+        ../xArchive/xArchiveChecksum.h \
+        ../xArchive/xArchiveChunkStore.h \
+        ../xArchive/xArchiveConf.h \
+        ../xArchive/xArchiveFile.h \
+        ../xArchive/xArchiveHelpers.h \
+        ../xArchive/xArchivePool.h \
+        ../xArchive/xArchivePrefetch.h \
+        ../xArchive/xArchiveStats.h \
+        ../xArchive/xArchiveTrace.h
+
+INCLUDEPATH += \
+        ../xArchive
+
+DEFINES += XARCHIVE_EXPORT
+
+# Magic values of the archive structures are multi-character constants
+unix: QMAKE_CXXFLAGS += -Wno-multichar
+unix: LIBS += -lz -lpthread
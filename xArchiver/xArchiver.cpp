@@ -15,7 +15,7 @@ using namespace xArchive;
 using namespace std;
 
 
-void export_directory( Archive& archive, const std::string& path )
+void collect_directory( std::vector<ArchiveImportEntry>& manifest, const std::string& path, const std::string& archivePath )
 {
     const std::string searchPath = path + "\\*";
 
@@ -32,47 +32,116 @@ void export_directory( Archive& archive, const std::string& path )
             continue;
         }
 
+        ArchiveImportEntry entry;
+        entry.Path = archivePath + findFileData.cFileName;
+        entry.SourceFilename = path + "\\" + findFileData.cFileName;
+
         if( findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
         {
-            archive.CreateDirectory( findFileData.cFileName );
-            archive.SetCurrentDirectory( findFileData.cFileName );
-
-            export_directory( archive, path + "\\" + findFileData.cFileName );
+            entry.Type = ArchiveEntryType::eDirectory;
+            manifest.push_back( entry );
 
-            archive.SetCurrentDirectory( ".." );
+            collect_directory( manifest, entry.SourceFilename, entry.Path + "/" );
         }
 
         else
         {
-            ifstream file( (path + "\\" + findFileData.cFileName).c_str(), ios::in | ios::binary );
-
-            vector<char> fileBytes( static_cast<size_t>(file.seekg( 0, fstream::end ).tellg()) );
-
-            file.seekg( 0, fstream::beg )
-                .read( fileBytes.data(), fileBytes.size() );
-
-            archive.CreateFile( findFileData.cFileName, fileBytes.data(), fileBytes.size() );
+            entry.Type = ArchiveEntryType::eFile;
+            entry.Size = (static_cast<uint64_t>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
+            manifest.push_back( entry );
         }
     }
 
     FindClose( hFindFile );
 }
 
+int relayout_archive( const char* archiveFilename, const char* traceFilename )
+{
+    std::unique_ptr<Archive> archive( Archive::Open( archiveFilename ) );
+
+    const ArchiveCompactResult result = archive->Relayout( Archive::LoadAccessTrace( traceFilename ) );
+
+    cout << "Moved " << result.EntriesMoved << " entries (" << result.BytesMoved << "B)" << endl;
+
+    return 0;
+}
+
+int verify_archive( const char* archiveFilename )
+{
+    std::unique_ptr<Archive> archive( Archive::Open( archiveFilename, ArchiveOpenFlags::eReadonly ) );
+
+    const ArchiveVerifyResult result = archive->Verify();
+
+    const double seconds = std::max<int64_t>( result.Duration.count(), 1 ) / 1000.0;
+
+    cout << "Verified " << result.DirectoryCount << " directories, " << result.FileCount << " files (" << result.BytesVerified << "B) in "
+        << result.Duration.count() << "ms, " << (result.BytesVerified / seconds / (1024 * 1024)) << "MB/s" << endl;
+
+    for( const std::string& issue : result.Issues )
+        cout << issue << endl;
+
+    cout << result.Issues.size() << " issues found" << endl;
+
+    return result.Issues.empty() ? 0 : 1;
+}
+
+int create_archive( const char* archiveFilename, const char* inputDirectory, const ArchiveImportOptions& options )
+{
+    std::unique_ptr<Archive> archive( Archive::Create( archiveFilename ) );
+
+    // The whole tree is sized first and written in a single pass
+    std::vector<ArchiveImportEntry> manifest;
+    collect_directory( manifest, inputDirectory, "" );
+
+    archive->ImportTree( manifest, options );
+
+    return 0;
+}
+
 int main( int argc, char** argv )
 {
     if( argc < 3 )
     {
         cerr << "Usage: " << argv[0] << " <archive> <directory>" << endl;
+        cerr << "       " << argv[0] << " solid <archive> <directory>" << endl;
+        cerr << "       " << argv[0] << " relayout <archive> <trace>" << endl;
+        cerr << "       " << argv[0] << " verify <archive>" << endl;
         return -1;
     }
 
-    // Usage: xarchiver <archive>(1) <directory>(2)
-    const char* outputFilename = argv[1];
-    const char* inputDirectory = argv[2];
+    // Usage: xarchiver verify <archive>(2)
+    if( std::strcmp( argv[1], "verify" ) == 0 )
+    {
+        return verify_archive( argv[2] );
+    }
+
+    // Usage: xarchiver solid <archive>(2) <directory>(3)
+    if( std::strcmp( argv[1], "solid" ) == 0 )
+    {
+        if( argc < 4 )
+        {
+            cerr << "Usage: " << argv[0] << " solid <archive> <directory>" << endl;
+            return -1;
+        }
 
-    std::unique_ptr<Archive> archive( Archive::Create( outputFilename ) );
+        ArchiveImportOptions options;
+        options.Solid = true;
 
-    export_directory( *archive, inputDirectory );
+        return create_archive( argv[2], argv[3], options );
+    }
 
-    return 0;
+    // Usage: xarchiver relayout <archive>(2) <trace>(3)
+    if( std::strcmp( argv[1], "relayout" ) == 0 )
+    {
+        if( argc < 4 )
+        {
+            cerr << "Usage: " << argv[0] << " relayout <archive> <trace>" << endl;
+            return -1;
+        }
+
+        return relayout_archive( argv[2], argv[3] );
+    }
+
+    // Usage: xarchiver <archive>(1) <directory>(2)
+    return create_archive( argv[1], argv[2], ArchiveImportOptions() );
 }